@@ -0,0 +1,84 @@
+#ifndef _aabb_h
+#define _aabb_h
+
+#include "vector.hpp"
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+
+using namespace std;
+
+/* Axis aligned bounding box, double in either precision like the traversal */
+struct AABB
+{
+
+	Vector_T<double> min_pt;
+	Vector_T<double> max_pt;
+
+	AABB() : min_pt(DBL_MAX,DBL_MAX,DBL_MAX), max_pt(-DBL_MAX,-DBL_MAX,-DBL_MAX) {}
+	AABB(const Vector_T<double>& lo, const Vector_T<double>& hi) : min_pt(lo), max_pt(hi) {}
+
+	void grow(const Vector_T<double>& p)
+	{
+		min_pt.x = min(min_pt.x,p.x); max_pt.x = max(max_pt.x,p.x);
+		min_pt.y = min(min_pt.y,p.y); max_pt.y = max(max_pt.y,p.y);
+		min_pt.z = min(min_pt.z,p.z); max_pt.z = max(max_pt.z,p.z);
+	}
+
+	/* Corner by corner, so an empty box leaves this one as it is */
+	void grow(const AABB& box)
+	{
+		min_pt.x = min(min_pt.x,box.min_pt.x); max_pt.x = max(max_pt.x,box.max_pt.x);
+		min_pt.y = min(min_pt.y,box.min_pt.y); max_pt.y = max(max_pt.y,box.max_pt.y);
+		min_pt.z = min(min_pt.z,box.min_pt.z); max_pt.z = max(max_pt.z,box.max_pt.z);
+	}
+
+	bool empty() const
+	{
+		return min_pt.x > max_pt.x;
+	}
+
+	Vector_T<double> centroid() const
+	{
+		return Vector_T<double>((min_pt.x + max_pt.x)*0.5, (min_pt.y + max_pt.y)*0.5, (min_pt.z + max_pt.z)*0.5);
+	}
+
+	double axis_min(int axis) const { return (axis == 0) ? min_pt.x : ((axis == 1) ? min_pt.y : min_pt.z); }
+	double axis_max(int axis) const { return (axis == 0) ? max_pt.x : ((axis == 1) ? max_pt.y : max_pt.z); }
+
+	double surface_area() const
+	{
+		if(empty()) {
+			return 0.0;
+		}
+		double dx = max_pt.x - min_pt.x;
+		double dy = max_pt.y - min_pt.y;
+		double dz = max_pt.z - min_pt.z;
+		return 2.0 * (dx*dy + dy*dz + dz*dx);
+	}
+
+	/* Slab test, returns the entry distance in t_entry when the box is hit in [0,t_max] */
+	bool intersect(const Vector_T<double>& vec_origin, const Vector_T<double>& inv_dir, double t_max, double& t_entry) const
+	{
+		double t1 = (min_pt.x - vec_origin.x) * inv_dir.x;
+		double t2 = (max_pt.x - vec_origin.x) * inv_dir.x;
+		double t_near = min(t1,t2);
+		double t_far = max(t1,t2);
+
+		t1 = (min_pt.y - vec_origin.y) * inv_dir.y;
+		t2 = (max_pt.y - vec_origin.y) * inv_dir.y;
+		t_near = max(t_near, min(t1,t2));
+		t_far = min(t_far, max(t1,t2));
+
+		t1 = (min_pt.z - vec_origin.z) * inv_dir.z;
+		t2 = (max_pt.z - vec_origin.z) * inv_dir.z;
+		t_near = max(t_near, min(t1,t2));
+		t_far = min(t_far, max(t1,t2));
+
+		t_entry = t_near;
+		return (t_far >= t_near) && (t_far >= 0.0) && (t_near <= t_max);
+	}
+
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _aligned_allocator_h
+#define _aligned_allocator_h
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <new>
+#include <vector>
+
+#define CACHE_LINE_SIZE 64
+
+/* std::allocator replacement that hands out cache line aligned blocks, so
+   SIMD loads never straddle lines and separate arrays never share one */
+template<typename T, size_t Alignment = CACHE_LINE_SIZE>
+struct Aligned_Allocator
+{
+	typedef T value_type;
+
+	template<typename U>
+	struct rebind { typedef Aligned_Allocator<U, Alignment> other; };
+
+	Aligned_Allocator() {}
+	template<typename U>
+	Aligned_Allocator(const Aligned_Allocator<U, Alignment>&) {}
+
+	T* allocate(size_t n)
+	{
+		size_t bytes = ((n * sizeof(T) + Alignment - 1) / Alignment) * Alignment;
+		void* ptr = aligned_alloc(Alignment, bytes);
+		if(ptr == NULL) {
+			throw std::bad_alloc();
+		}
+		return static_cast<T*>(ptr);
+	}
+
+	void deallocate(T* ptr, size_t)
+	{
+		free(ptr);
+	}
+
+	template<typename U>
+	bool operator== (const Aligned_Allocator<U, Alignment>&) const { return true; }
+	template<typename U>
+	bool operator!= (const Aligned_Allocator<U, Alignment>&) const { return false; }
+};
+
+template<typename T>
+struct Aligned_Vector
+{
+	typedef std::vector<T, Aligned_Allocator<T> > type;
+};
+
+#endif
@@ -0,0 +1,519 @@
+#include "scene.hpp"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#define BENCH_MIN_TIME 0.2          /* seconds a repetition runs at least */
+#define BENCH_REPETITIONS 5         /* the median repetition is reported */
+#define BENCH_THRESHOLD 10.0        /* percent slower than the baseline that counts as a regression */
+#define BENCH_FRAME_DIM 512         /* pixels on a side of the frame benchmarks */
+
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+using namespace std;
+
+/* Benchmarks of the ray tracer's hot paths and of whole frames on scenes
+   built here, so results only change when the code does. Every result is
+   the time per operation (one ray, one pixel vector, one shaded hit) of the
+   median of BENCH_REPETITIONS runs, written one per line as JSON:
+
+     ./my_raytracer_bench [-o results.json] [--filter name] [--baseline old.json [--threshold percent]]
+
+   With a baseline the results are compared by name and the exit status is
+   1 if any benchmark got slower than the threshold allows. */
+
+struct Bench_Result
+{
+	string name;
+	string unit;
+	double ns_per_op;
+	double min_ns_per_op;
+	double ops_per_sec;
+	double frames_per_sec;    /* frame benchmarks only, 0 otherwise */
+};
+
+/* Keeps results of the measured code alive so it is not optimized away */
+static volatile double bench_sink;
+
+static double bench_seconds()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* body() does ops_per_call operations. It is called often enough for a
+   repetition to take BENCH_MIN_TIME, once first to warm caches. */
+template<typename Body>
+static Bench_Result run_bench(const string& name, const string& unit, uint64_t ops_per_call, Body body)
+{
+	body();
+
+	uint64_t calls = 1;
+	for(;;) {
+		const double start = bench_seconds();
+		for(uint64_t i=0;i<calls;i++) {
+			body();
+		}
+		const double elapsed = bench_seconds() - start;
+		if(elapsed >= BENCH_MIN_TIME) {
+			break;
+		}
+		calls = (elapsed > 0.0) ? max(calls + 1, (uint64_t)(calls * 1.2 * BENCH_MIN_TIME / elapsed)) : calls * 2;
+	}
+
+	vector<double> ns_per_op;
+	for(int r=0;r<BENCH_REPETITIONS;r++) {
+		const double start = bench_seconds();
+		for(uint64_t i=0;i<calls;i++) {
+			body();
+		}
+		ns_per_op.push_back((bench_seconds() - start) * 1e9 / (calls * ops_per_call));
+	}
+	sort(ns_per_op.begin(), ns_per_op.end());
+
+	Bench_Result result;
+	result.name = name;
+	result.unit = unit;
+	result.ns_per_op = ns_per_op[BENCH_REPETITIONS/2];
+	result.min_ns_per_op = ns_per_op[0];
+	result.ops_per_sec = 1e9 / result.ns_per_op;
+	result.frames_per_sec = 0.0;
+	return result;
+}
+
+/* The scene of my_scene.scene: a dozen reflective spheres over a plane, five lights */
+static void basic_scene(Scene_Description& desc)
+{
+	static const double spheres[][8] = {
+		/* center, radius, color, reflectivity */
+		{ 1, -0.5, -5, .5, .4, .6, .6, .8 },	{ -4.5, 1, -10, 1, .8, .4, .6, .7 },	{ 0, 1, -3, 1, .75, .75, .75, 1 },
+		{ -1.5, -0.5, -7, .5, .2, .8, .2, .7 },	{ 4, 0.5, -10, 1, .2, .3, .7, .8 },		{ 3, 0.5, 1, .5, .7, .2, .2, .5 },
+		{ 8, 2, -3, 1, .7, .7, .2, .8 },		{ -7, 0.5, -2, 1, .2, .2, .9, .6 },		{ -4, 0.5, 1.5, .5, .4, .7, .4, 1 },
+		{ 3, 0.5, 8, 1, .7, .2, .7, 1 },		{ -2, 0.5, 5, 1, .2, .6, .6, .7 },		{ 0, -0.5, 3, .5, .6, .6, .6, 1 }
+	};
+	static const double lights[][6] = {
+		{ -5, 10, 0, 1, .7, .7 }, { 0, 12, -5, .7, .7, .7 }, { 5, 10, 0, .7, .7, 1 }, { 0, 12, 30, .5, .5, .5 }, { 5, 10, 10, .3, .3, .3 }
+	};
+
+	for(size_t i=0;i<sizeof(spheres)/sizeof(spheres[0]);i++) {
+		Sphere_Record& sphere = desc.add_sphere();
+		memcpy(sphere.center, &spheres[i][0], 3*sizeof(double));
+		sphere.radius = spheres[i][3];
+		memcpy(sphere.color, &spheres[i][4], 3*sizeof(double));
+		sphere.reflectivity = spheres[i][7];
+	}
+
+	Plane_Record& plane = desc.add_plane();
+	plane.center[0] = 0.0; plane.center[1] = -1.0; plane.center[2] = -5.0;
+	plane.width = plane.length = 500.0;
+	plane.headup[0] = 0.0; plane.headup[1] = 0.0; plane.headup[2] = 1.0;
+	plane.color[0] = plane.color[1] = plane.color[2] = 0.5;
+
+	for(size_t i=0;i<sizeof(lights)/sizeof(lights[0]);i++) {
+		Light_Record& light = desc.add_light();
+		memcpy(light.location, &lights[i][0], 3*sizeof(double));
+		memcpy(light.color, &lights[i][3], 3*sizeof(double));
+	}
+}
+
+/* 64 x 64 small spheres in a slab in front of the camera, for the BVH */
+static void grid_scene(Scene_Description& desc)
+{
+	for(int i=0;i<64;i++) {
+		for(int j=0;j<64;j++) {
+			Sphere_Record& sphere = desc.add_sphere();
+			sphere.center[0] = (i - 31.5) * 0.5;
+			sphere.center[1] = (j - 31.5) * 0.5;
+			sphere.center[2] = -12.0 - 4.0*sample_uniform(i*64 + j, 0, 0);
+			sphere.radius = 0.2;
+			sphere.color[0] = i/64.0; sphere.color[1] = j/64.0; sphere.color[2] = 0.5;
+			sphere.reflectivity = 0.5;
+		}
+	}
+
+	Light_Record& light = desc.add_light();
+	light.location[0] = 0.0; light.location[1] = 20.0; light.location[2] = 0.0;
+	Light_Record& fill = desc.add_light();
+	fill.location[0] = -10.0; fill.location[1] = 5.0; fill.location[2] = 5.0;
+}
+
+/* Layers of small mirrors, many more than fit in cache, whose reflections
+   bounce between the layers in every direction */
+static void mirror_scene(Scene_Description& desc)
+{
+	for(int layer=0;layer<3;layer++) {
+		for(int i=0;i<128;i++) {
+			for(int j=0;j<128;j++) {
+				const uint32_t n = (layer*128 + i)*128 + j;
+				Sphere_Record& sphere = desc.add_sphere();
+				sphere.center[0] = (i - 63.5) * 0.3 + 0.1*sample_uniform(n, 0, 1);
+				sphere.center[1] = (j - 63.5) * 0.3 + 0.1*sample_uniform(n, 0, 2);
+				sphere.center[2] = -6.0 - 3.0*layer - 2.0*sample_uniform(n, 0, 0);
+				sphere.radius = 0.12;
+				sphere.color[0] = 0.5; sphere.color[1] = 0.5; sphere.color[2] = 0.5;
+				sphere.reflectivity = 0.9;
+			}
+		}
+	}
+
+	Light_Record& light = desc.add_light();
+	light.location[0] = 0.0; light.location[1] = 20.0; light.location[2] = 0.0;
+}
+
+/* Unit sphere of 2*rings*rings triangles sharing their vertices and normals,
+   built in memory like an OBJ with vn would be read */
+static Mesh_Handle sphere_mesh(uint32_t rings)
+{
+	Mesh_Data* mesh = new Mesh_Data();
+	const uint32_t segments = 2*rings;
+
+	for(uint32_t j=0;j<=rings;j++) {
+		for(uint32_t i=0;i<segments;i++) {
+			const double theta = PI*j/rings, phi = 2.0*PI*i/segments;
+			const float p[3] = { (float)(sin(theta)*cos(phi)), (float)cos(theta), (float)(sin(theta)*sin(phi)) };
+			mesh->positions.insert(mesh->positions.end(), p, p + 3);
+			mesh->normals.insert(mesh->normals.end(), p, p + 3);
+		}
+	}
+	for(uint32_t j=0;j<rings;j++) {
+		for(uint32_t i=0;i<segments;i++) {
+			const uint32_t a = j*segments + i, b = j*segments + (i + 1)%segments;
+			const uint32_t quad[6] = { a, b, b + segments, a, b + segments, a + segments };
+			mesh->indices.insert(mesh->indices.end(), quad, quad + 6);
+		}
+	}
+	mesh->normal_indices = mesh->indices;
+	mesh->build_bvh(Thread_Pool::shared());
+	return Mesh_Handle(mesh);
+}
+
+/* Directions towards the -z half space, the same on every run */
+static vector<Vector> bench_directions(uint32_t count, double spread)
+{
+	vector<Vector> directions;
+	for(uint32_t i=0;i<count;i++) {
+		Vector d(spread*(2.0*sample_uniform(i, 0, 1) - 1.0), spread*(2.0*sample_uniform(i, 0, 2) - 1.0), -1.0);
+		directions.push_back(d.unit_vector());
+	}
+	return directions;
+}
+
+/* One closest hit test per direction against a single object */
+static Bench_Result bench_intersect(const string& name, Object* object, const Vector& origin, double spread)
+{
+	const vector<Vector> directions = bench_directions(1024, spread);
+	Object* volatile target = object;
+
+	return run_bench(name, "ray", directions.size(), [&]() {
+		Object* obj = target;
+		double sum = 0.0;
+		for(size_t i=0;i<directions.size();i++) {
+			double t;
+			uint32_t part;
+			if(obj->check_Intersection(origin, directions[i], DBL_MAX, t, part)) {
+				sum += t;
+			}
+		}
+		bench_sink = sum;
+	});
+}
+
+/* sphere_intersect's rays straight through the templated test at scalar type
+   T, so both precisions can be compared from one build */
+template<typename T>
+static Bench_Result bench_sphere_kernel(const string& name)
+{
+	const vector<Vector> directions = bench_directions(1024, 0.28);
+	vector<Vector_T<T> > dirs(directions.begin(), directions.end());
+	const Vector_T<T> origin(0.0,0.0,0.0);
+	const Vector_T<T> center(0.0,0.0,-5.0);
+	volatile T radius = 1.0;
+
+	return run_bench(name, "ray", dirs.size(), [&]() {
+		const T r = radius;
+		double sum = 0.0;
+		for(size_t i=0;i<dirs.size();i++) {
+			double t;
+			if(sphere_intersect(origin, dirs[i], center, r, DBL_MAX, t)) {
+				sum += t;
+			}
+		}
+		bench_sink = sum;
+	});
+}
+
+static Bench_Result bench_pixel_vector()
+{
+	Camera_Setup camera = cube_face_camera(0, BENCH_FRAME_DIM);
+
+	return run_bench("camera_pixel_vector", "ray", 64*64, [&]() {
+		double sum = 0.0;
+		for(uint32_t row=0;row<64;row++) {
+			for(uint32_t col=0;col<64;col++) {
+				sum += camera.compute_pixel_vector(row*8, col*8).x;
+			}
+		}
+		bench_sink = sum;
+	});
+}
+
+/* Camera ray hits of a 64 x 64 pixel grid spread over the front face */
+static void bench_hits(Scene& scene, vector<Intersection>& hits, vector<Vector>& directions)
+{
+	Camera_Setup camera = cube_face_camera(0, BENCH_FRAME_DIM);
+	const Ray_Cone cone(0.0, camera.get_pixel_spread());
+
+	for(uint32_t row=0;row<64;row++) {
+		for(uint32_t col=0;col<64;col++) {
+			const Vector dir = camera.compute_pixel_vector(row*8 + 4, col*8 + 4);
+			Intersection inter;
+			if(scene.find_nearest_Intersection(camera.get_camera_center(), dir, inter) == 1) {
+				inter.set_cone(cone, dir);
+				hits.push_back(inter);
+				directions.push_back(dir);
+			}
+		}
+	}
+}
+
+/* Local lighting of camera ray hits: shadow rays to every light, no reflections */
+static Bench_Result bench_shade(const string& name, Scene& scene)
+{
+	vector<Intersection> hits;
+	vector<Vector> directions;
+	bench_hits(scene, hits, directions);
+
+	return run_bench(name, "hit", hits.size(), [&]() {
+		Color ray_intensity(1.0,1.0,1.0);
+		double sum = 0.0;
+		for(size_t i=0;i<hits.size();i++) {
+			sum += scene.GetColor(hits[i], directions[i], ray_intensity, MAX_RECURSION + 1).r;
+		}
+		bench_sink = sum;
+	});
+}
+
+/* Whole camera rays through TraceRay on one thread, reflections included */
+static Bench_Result bench_trace(const string& name, Scene& scene)
+{
+	Camera_Setup camera = cube_face_camera(0, BENCH_FRAME_DIM);
+	const Ray_Cone cone(0.0, camera.get_pixel_spread());
+	vector<Vector> directions;
+	for(uint32_t row=0;row<64;row++) {
+		for(uint32_t col=0;col<64;col++) {
+			directions.push_back(camera.compute_pixel_vector(row*8 + 4, col*8 + 4));
+		}
+	}
+
+	return run_bench(name, "ray", directions.size(), [&]() {
+		Color ray_intensity(1.0,1.0,1.0);
+		double sum = 0.0;
+		for(size_t i=0;i<directions.size();i++) {
+			sum += scene.TraceRay(camera.get_camera_center(), directions[i], cone, ray_intensity, 0).r;
+		}
+		bench_sink = sum;
+	});
+}
+
+/* The front cube face rendered in tiles on every thread, as a render would.
+   With blur the face is traced with depth into a float image and made into
+   the 8 bit image by the depth of field blur; otherwise traced straight to 8 bit. */
+static Bench_Result bench_frame(const string& name, Scene& scene, bool blur)
+{
+	const uint32_t dim = BENCH_FRAME_DIM;
+	const uint32_t tiles = ((dim + TILE_SIZE - 1)/TILE_SIZE) * ((dim + TILE_SIZE - 1)/TILE_SIZE);
+	Camera_Setup camera = cube_face_camera(0, dim);
+	Framebuffer image(dim, dim);
+	Framebuffer_RGB8 output(dim, dim);
+	vector<double> depth(dim*dim);
+	Thread_Pool& pool = Thread_Pool::shared();
+
+	Bench_Result result = run_bench(name, "ray", (uint64_t)dim*dim, [&]() {
+		if(blur) {
+			pool.parallel_for(tiles, [&](uint32_t tile) {
+				scene.render_tile(camera, image, &depth[0], NULL, tile, dim, dim, dof_val);
+			});
+			depth_of_field_blur(image, depth, output, dim, dim, dof_val, dof_lens_scale(camera), pool);
+		}
+		else {
+			pool.parallel_for(tiles, [&](uint32_t tile) {
+				scene.render_tile(camera, output, NULL, NULL, tile, dim, dim, dof_val);
+			});
+		}
+		bench_sink = output.get_pixel_data(dim/2, dim/2).r;
+	});
+
+	result.frames_per_sec = result.ops_per_sec / ((double)dim*dim);
+	return result;
+}
+
+static string bench_json_line(const Bench_Result& result)
+{
+	char line[512];
+	snprintf(line, sizeof(line), "{\"name\": \"%s\", \"unit\": \"%s\", \"ns_per_op\": %.4f, \"min_ns_per_op\": %.4f, \"ops_per_sec\": %.1f, \"frames_per_sec\": %.3f}",
+		result.name.c_str(), result.unit.c_str(), result.ns_per_op, result.min_ns_per_op, result.ops_per_sec, result.frames_per_sec);
+	return line;
+}
+
+static bool write_json(const char* filename, const vector<Bench_Result>& results)
+{
+	FILE* fp = fopen(filename, "w");
+	if(fp == NULL) {
+		cerr << "Unable to open " << filename << " for writing" << endl;
+		return false;
+	}
+
+	static const char* const simd_names[] = { "scalar", "avx2", "avx512" };
+	fprintf(fp, "{\n\"revision\": \"%s\",\n\"compiler\": \"%s\",\n\"simd\": \"%s\",\n\"precision\": \"%s\",\n\"threads\": %u,\n\"frame_dim\": %d,\n\"benchmarks\": [\n",
+		BENCH_REVISION, __VERSION__, simd_names[detect_simd_level()], Precision_Traits<Real>::name(), Thread_Pool::shared().size(), BENCH_FRAME_DIM);
+	for(size_t i=0;i<results.size();i++) {
+		fprintf(fp, "%s%s\n", bench_json_line(results[i]).c_str(), (i + 1 < results.size()) ? "," : "");
+	}
+	fprintf(fp, "]\n}\n");
+
+	return fclose(fp) == 0;
+}
+
+/* name -> ns_per_op of a file written by write_json, one benchmark per line */
+/* false if the file can not be read */
+static bool read_baseline(const char* filename, map<string, double>& baseline)
+{
+	ifstream file(filename);
+	string line;
+
+	if(!file) {
+		return false;
+	}
+
+	while(getline(file, line)) {
+		const size_t name = line.find("\"name\": \"");
+		const size_t ns = line.find("\"ns_per_op\": ");
+		if(name == string::npos || ns == string::npos) {
+			continue;
+		}
+		const size_t name_begin = name + 9;
+		baseline[line.substr(name_begin, line.find('"', name_begin) - name_begin)] = atof(line.c_str() + ns + 13);
+	}
+
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* output = "bench.json";
+	const char* baseline_file = NULL;
+	const char* filter = NULL;
+	double threshold = BENCH_THRESHOLD;
+
+	for(int i=1;i<argc;i++) {
+		if(strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			output = argv[++i];
+		}
+		else if(strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+			baseline_file = argv[++i];
+		}
+		else if(strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+			threshold = atof(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+			filter = argv[++i];
+		}
+		else {
+			cout << "Usage: " << argv[0] << " [-o results.json] [--filter name] [--baseline old.json [--threshold percent]]" << endl;
+			return 2;
+		}
+	}
+
+	/* A baseline that can not be read would compare nothing and pass, read it before the runs */
+	map<string, double> baseline;
+	if(baseline_file != NULL && !read_baseline(baseline_file, baseline)) {
+		cerr << "Unable to read baseline " << baseline_file << endl;
+		return 2;
+	}
+
+	Scene_Description basic_desc, grid_desc, mirror_desc;
+	basic_scene(basic_desc);
+	grid_scene(grid_desc);
+	mirror_scene(mirror_desc);
+
+	/* The basic scene with a mirror ball of 131072 triangles next to the sphere in front */
+	const Mesh_Handle ball = sphere_mesh(256);
+
+	Scene basic(cube_face_camera(0, BENCH_FRAME_DIM), Color(0.0,0.0,0.0));
+	Scene grid(cube_face_camera(0, BENCH_FRAME_DIM), Color(0.0,0.0,0.0));
+	Scene mirrors(cube_face_camera(0, BENCH_FRAME_DIM), Color(0.0,0.0,0.0));
+	Scene meshes(cube_face_camera(0, BENCH_FRAME_DIM), Color(0.0,0.0,0.0));
+	build_scene(basic_desc, basic);
+	build_scene(grid_desc, grid);
+	build_scene(mirror_desc, mirrors);
+	build_scene(basic_desc, meshes);
+	meshes.add_Object(new Mesh(ball, Vector(-2.5,0.0,-4.0), 1.0, Color(0.8,0.8,0.8), 0.8, meshes.obj_list.size() + 1));
+	basic.build_acceleration();
+	grid.build_acceleration();
+	mirrors.build_acceleration();
+	meshes.build_acceleration();
+
+	Sphere sphere(Vector(0.0,0.0,-5.0), 1.0, Color(1.0,1.0,1.0), 0.5, 1);
+	Plane plane(Vector(0.0,-1.0,-5.0), 4.0, 4.0, Vector(0.0,1.0,0.0), Vector(0.0,0.0,1.0), Color(1.0,1.0,1.0), 0.0, 2);
+	Mesh mesh(ball, Vector(0.0,0.0,-5.0), 1.0, Color(1.0,1.0,1.0), 0.5, 3);
+
+	vector<Bench_Result> results;
+	const auto selected = [&](const char* name) { return filter == NULL || strstr(name, filter) != NULL; };
+
+	/* Spreads chosen so that part of the rays hit and the rest miss */
+	if(selected("sphere_intersect")) results.push_back(bench_intersect("sphere_intersect", &sphere, Vector(0.0,0.0,0.0), 0.28));
+	if(selected("plane_intersect")) results.push_back(bench_intersect("plane_intersect", &plane, Vector(0.0,0.0,0.0), 0.4));
+	if(selected("mesh_intersect")) results.push_back(bench_intersect("mesh_intersect", &mesh, Vector(0.0,0.0,0.0), 0.28));
+	if(selected("sphere_kernel_double")) results.push_back(bench_sphere_kernel<double>("sphere_kernel_double"));
+	if(selected("sphere_kernel_float")) results.push_back(bench_sphere_kernel<float>("sphere_kernel_float"));
+	if(selected("camera_pixel_vector")) results.push_back(bench_pixel_vector());
+	if(selected("shade_basic")) results.push_back(bench_shade("shade_basic", basic));
+	if(selected("trace_basic")) results.push_back(bench_trace("trace_basic", basic));
+	if(selected("trace_grid")) results.push_back(bench_trace("trace_grid", grid));
+	if(selected("frame_basic")) results.push_back(bench_frame("frame_basic", basic, false));
+	if(selected("frame_basic_dof")) results.push_back(bench_frame("frame_basic_dof", basic, true));
+	if(selected("frame_grid")) results.push_back(bench_frame("frame_grid", grid, false));
+	if(selected("frame_mirrors")) results.push_back(bench_frame("frame_mirrors", mirrors, false));
+	if(selected("frame_mesh")) results.push_back(bench_frame("frame_mesh", meshes, false));
+
+	if(!write_json(output, results)) {
+		return 2;
+	}
+
+	bool regressed = false;
+	size_t compared = 0;
+	printf("%-22s %12s %14s %10s", "benchmark", "ns/op", "ops/sec", "frames/s");
+	printf(baseline_file ? " %12s %8s\n" : "\n", "baseline", "change");
+
+	for(size_t i=0;i<results.size();i++) {
+		const Bench_Result& r = results[i];
+		printf("%-22s %12.2f %14.0f %10.2f", r.name.c_str(), r.ns_per_op, r.ops_per_sec, r.frames_per_sec);
+
+		if(baseline.count(r.name)) {
+			const double change = 100.0 * (r.ns_per_op / baseline[r.name] - 1.0);
+			const bool slower = change > threshold;
+			regressed = regressed || slower;
+			compared++;
+			printf(" %12.2f %+7.1f%%%s", baseline[r.name], change, slower ? "  REGRESSION" : "");
+		}
+		printf("\n");
+	}
+
+	cout << "Results written to " << output << endl;
+
+	if(baseline_file != NULL && compared == 0) {
+		cerr << "Baseline " << baseline_file << " has none of these benchmarks, nothing was compared" << endl;
+		return 2;
+	}
+
+	return regressed ? 1 : 0;
+}
@@ -0,0 +1,363 @@
+#ifndef _bvh_h
+#define _bvh_h
+
+#include "vector.hpp"
+#include "aabb.hpp"
+#include "thread_pool.hpp"
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+#define BVH_NUM_BINS 16
+#define BVH_MAX_LEAF_SIZE 4
+#define BVH_MAX_DEPTH 64
+#define BVH_STACK_SIZE (BVH_MAX_DEPTH + 2)
+#define BVH_PARALLEL_BIN_SIZE 65536
+#define BVH_MIN_TASK_SIZE 256
+
+using namespace std;
+
+/* Interior nodes store the index of their left child in left_first, the right
+   child always follows it. Leaves store the first entry of prim_indices. */
+struct BVH_Node
+{
+	AABB bounds;
+	uint32_t left_first;
+	uint32_t count;
+
+	BVH_Node() : bounds(), left_first(0), count(0) {}
+	bool is_leaf() const { return count != 0; }
+};
+
+class BVH
+{
+
+	private:
+	std::vector<AABB> prim_bounds;
+	std::vector<Vector_T<double> > prim_centroids;
+
+	struct Build_Task
+	{
+		uint32_t node;
+		uint32_t first;
+		uint32_t count;
+		uint32_t depth;
+	};
+
+	struct Bin
+	{
+		AABB bounds;
+		uint32_t count;
+		Bin() : bounds(), count(0) {}
+	};
+
+	void update_bounds(BVH_Node& node, AABB& centroid_bounds);
+	void compute_bins(uint32_t first, uint32_t count, const AABB& centroid_bounds, Bin bins[3][BVH_NUM_BINS], Thread_Pool* pool);
+	bool find_split(const BVH_Node& node, uint32_t first, uint32_t count, const AABB& centroid_bounds, Thread_Pool* pool, uint32_t& mid);
+	void build_recursive(std::vector<BVH_Node>& out, uint32_t node_index, uint32_t first, uint32_t count, uint32_t depth, uint32_t task_limit, Thread_Pool* pool, std::vector<Build_Task>* tasks);
+
+	public:
+	std::vector<BVH_Node> nodes;
+	std::vector<uint32_t> prim_indices;
+
+	BVH() {}
+
+	void build(const std::vector<AABB>& bounds, Thread_Pool& pool);
+	void clear() { nodes.clear(); prim_indices.clear(); }
+	bool empty() const { return nodes.empty(); }
+
+	/* Visits leaves front to back. leaf_func(prim, t_max) may shrink t_max to
+	   prune farther nodes, and returns true to stop the traversal early. */
+	template<typename Leaf_Func>
+	bool traverse(const Vector_T<double>& vec_origin, const Vector_T<double>& vec_dir, double& t_max, Leaf_Func leaf_func, uint32_t root = 0) const;
+};
+
+void BVH::update_bounds(BVH_Node& node, AABB& centroid_bounds)
+{
+	node.bounds = AABB();
+	centroid_bounds = AABB();
+
+	for(uint32_t i=0;i<node.count;i++) {
+		uint32_t prim = prim_indices[node.left_first + i];
+		node.bounds.grow(prim_bounds[prim]);
+		centroid_bounds.grow(prim_centroids[prim]);
+	}
+}
+
+static inline double vector_axis(const Vector_T<double>& vec, int axis)
+{
+	return (axis == 0) ? vec.x : ((axis == 1) ? vec.y : vec.z);
+}
+
+void BVH::compute_bins(uint32_t first, uint32_t count, const AABB& centroid_bounds, Bin bins[3][BVH_NUM_BINS], Thread_Pool* pool)
+{
+	double scale[3];
+	for(int axis=0;axis<3;axis++) {
+		double extent = centroid_bounds.axis_max(axis) - centroid_bounds.axis_min(axis);
+		scale[axis] = (extent > 0.0) ? BVH_NUM_BINS / extent : 0.0;
+	}
+
+	auto bin_range = [&](uint32_t begin, uint32_t end, Bin local[3][BVH_NUM_BINS]) {
+		for(uint32_t i=begin;i<end;i++) {
+			uint32_t prim = prim_indices[i];
+			for(int axis=0;axis<3;axis++) {
+				int b = (int)((vector_axis(prim_centroids[prim],axis) - centroid_bounds.axis_min(axis)) * scale[axis]);
+				b = min(max(b,0),BVH_NUM_BINS-1);
+				local[axis][b].count++;
+				local[axis][b].bounds.grow(prim_bounds[prim]);
+			}
+		}
+	};
+
+	if(pool == NULL || count < BVH_PARALLEL_BIN_SIZE) {
+		bin_range(first, first + count, bins);
+		return;
+	}
+
+	/* Large nodes near the root: bin chunks in parallel and merge */
+	const uint32_t num_chunks = pool->size() * 4;
+	const uint32_t chunk_size = (count + num_chunks - 1) / num_chunks;
+	std::vector<Bin> chunk_bins(num_chunks * 3 * BVH_NUM_BINS);
+
+	pool->parallel_for(num_chunks, [&](uint32_t chunk) {
+		uint32_t begin = first + min(count, chunk * chunk_size);
+		uint32_t end = first + min(count, (chunk + 1) * chunk_size);
+		bin_range(begin, end, (Bin (*)[BVH_NUM_BINS]) &chunk_bins[chunk * 3 * BVH_NUM_BINS]);
+	});
+
+	for(uint32_t chunk=0;chunk<num_chunks;chunk++) {
+		for(int axis=0;axis<3;axis++) {
+			for(int b=0;b<BVH_NUM_BINS;b++) {
+				const Bin& src = chunk_bins[(chunk * 3 + axis) * BVH_NUM_BINS + b];
+				bins[axis][b].count += src.count;
+				bins[axis][b].bounds.grow(src.bounds);
+			}
+		}
+	}
+}
+
+/* Binned SAH over all three axes, partitions prim_indices when splitting pays off */
+bool BVH::find_split(const BVH_Node& node, uint32_t first, uint32_t count, const AABB& centroid_bounds, Thread_Pool* pool, uint32_t& mid)
+{
+	Bin bins[3][BVH_NUM_BINS];
+	compute_bins(first, count, centroid_bounds, bins, pool);
+
+	double best_cost = DBL_MAX;
+	int best_axis = -1;
+	int best_bin = 0;
+
+	for(int axis=0;axis<3;axis++) {
+
+		if(centroid_bounds.axis_max(axis) <= centroid_bounds.axis_min(axis)) {
+			continue;
+		}
+
+		/* Sweep from the right to get the cost of every right side */
+		double right_area[BVH_NUM_BINS];
+		uint32_t right_count[BVH_NUM_BINS];
+		AABB right_box;
+		uint32_t right_sum = 0;
+		for(int b=BVH_NUM_BINS-1;b>0;b--) {
+			right_box.grow(bins[axis][b].bounds);
+			right_sum += bins[axis][b].count;
+			right_area[b] = right_box.surface_area();
+			right_count[b] = right_sum;
+		}
+
+		AABB left_box;
+		uint32_t left_sum = 0;
+		for(int b=0;b<BVH_NUM_BINS-1;b++) {
+			left_box.grow(bins[axis][b].bounds);
+			left_sum += bins[axis][b].count;
+			if(left_sum == 0 || right_count[b+1] == 0) {
+				continue;
+			}
+			double cost = left_sum * left_box.surface_area() + right_count[b+1] * right_area[b+1];
+			if(cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = b;
+			}
+		}
+	}
+
+	if(best_axis < 0) {
+		return false;
+	}
+
+	/* Traversal step costs about as much as one primitive test */
+	double leaf_cost = count * node.bounds.surface_area();
+	double split_cost = node.bounds.surface_area() + best_cost;
+	if(count <= BVH_MAX_LEAF_SIZE && split_cost >= leaf_cost) {
+		return false;
+	}
+
+	double extent = centroid_bounds.axis_max(best_axis) - centroid_bounds.axis_min(best_axis);
+	double scale = BVH_NUM_BINS / extent;
+	double axis_min = centroid_bounds.axis_min(best_axis);
+
+	uint32_t* begin = &prim_indices[0] + first;
+	uint32_t* split = std::partition(begin, begin + count, [&](uint32_t prim) {
+		int b = (int)((vector_axis(prim_centroids[prim],best_axis) - axis_min) * scale);
+		return min(max(b,0),BVH_NUM_BINS-1) <= best_bin;
+	});
+
+	mid = split - &prim_indices[0];
+	return (mid != first) && (mid != first + count);
+}
+
+void BVH::build_recursive(std::vector<BVH_Node>& out, uint32_t node_index, uint32_t first, uint32_t count, uint32_t depth, uint32_t task_limit, Thread_Pool* pool, std::vector<Build_Task>* tasks)
+{
+	BVH_Node& node = out[node_index];
+	node.left_first = first;
+	node.count = count;
+
+	AABB centroid_bounds;
+	update_bounds(node, centroid_bounds);
+
+	if(tasks != NULL && count <= task_limit) {
+		/* Small enough, finish this subtree later on a worker */
+		Build_Task task = { node_index, first, count, depth };
+		tasks->push_back(task);
+		return;
+	}
+
+	uint32_t mid;
+	if(count <= 1 || depth >= BVH_MAX_DEPTH || !find_split(node, first, count, centroid_bounds, pool, mid)) {
+		return;
+	}
+
+	uint32_t left = out.size();
+	out.push_back(BVH_Node());
+	out.push_back(BVH_Node());
+	out[node_index].left_first = left;
+	out[node_index].count = 0;
+
+	build_recursive(out, left, first, mid - first, depth + 1, task_limit, pool, tasks);
+	build_recursive(out, left + 1, mid, first + count - mid, depth + 1, task_limit, pool, tasks);
+}
+
+void BVH::build(const std::vector<AABB>& bounds, Thread_Pool& pool)
+{
+	clear();
+
+	const uint32_t num_prims = bounds.size();
+	if(num_prims == 0) {
+		return;
+	}
+
+	prim_bounds = bounds;
+	prim_centroids.resize(num_prims);
+	prim_indices.resize(num_prims);
+	for(uint32_t i=0;i<num_prims;i++) {
+		prim_centroids[i] = prim_bounds[i].centroid();
+		prim_indices[i] = i;
+	}
+
+	nodes.reserve(2 * num_prims);
+	nodes.push_back(BVH_Node());
+
+	/* Split the top levels here, then build the remaining subtrees in parallel */
+	std::vector<Build_Task> tasks;
+	uint32_t task_limit = max((uint32_t)BVH_MIN_TASK_SIZE, num_prims / (pool.size() * 8));
+	build_recursive(nodes, 0, 0, num_prims, 0, task_limit, &pool, &tasks);
+
+	std::vector< std::vector<BVH_Node> > subtrees(tasks.size());
+	pool.parallel_for(tasks.size(), [&](uint32_t t) {
+		subtrees[t].reserve(2 * tasks[t].count);
+		subtrees[t].push_back(BVH_Node());
+		build_recursive(subtrees[t], 0, tasks[t].first, tasks[t].count, tasks[t].depth, 0, NULL, NULL);
+	});
+
+	/* Stitch the subtrees into the node array, their roots replace the placeholders */
+	for(size_t t=0;t<tasks.size();t++) {
+		const std::vector<BVH_Node>& sub = subtrees[t];
+		const uint32_t offset = nodes.size() - 1;
+
+		for(size_t i=1;i<sub.size();i++) {
+			nodes.push_back(sub[i]);
+			if(!sub[i].is_leaf()) {
+				nodes.back().left_first += offset;
+			}
+		}
+
+		nodes[tasks[t].node] = sub[0];
+		if(!sub[0].is_leaf()) {
+			nodes[tasks[t].node].left_first += offset;
+		}
+	}
+
+	prim_centroids.clear();
+	prim_bounds.clear();
+}
+
+/* root lets a caller restart the search inside a subtree */
+template<typename Leaf_Func>
+bool BVH::traverse(const Vector_T<double>& vec_origin, const Vector_T<double>& vec_dir, double& t_max, Leaf_Func leaf_func, uint32_t root) const
+{
+	if(nodes.empty()) {
+		return false;
+	}
+
+	const Vector_T<double> inv_dir(1.0/vec_dir.x, 1.0/vec_dir.y, 1.0/vec_dir.z);
+
+	/* Each entry keeps the distance at which the ray enters the node */
+	uint32_t stack[BVH_STACK_SIZE];
+	double stack_t[BVH_STACK_SIZE];
+	int stack_size = 0;
+	double t_entry;
+
+	if(!nodes[root].bounds.intersect(vec_origin, inv_dir, t_max, t_entry)) {
+		return false;
+	}
+	stack[stack_size] = root;
+	stack_t[stack_size++] = t_entry;
+
+	while(stack_size > 0) {
+
+		stack_size--;
+		if(stack_t[stack_size] > t_max) {
+			continue;
+		}
+		const BVH_Node& node = nodes[stack[stack_size]];
+
+		if(node.is_leaf()) {
+			for(uint32_t i=0;i<node.count;i++) {
+				if(leaf_func(prim_indices[node.left_first + i], t_max)) {
+					return true;
+				}
+			}
+			continue;
+		}
+
+		uint32_t near_child = node.left_first;
+		uint32_t far_child = node.left_first + 1;
+		double t_near, t_far;
+		bool hit_near = nodes[near_child].bounds.intersect(vec_origin, inv_dir, t_max, t_near);
+		bool hit_far = nodes[far_child].bounds.intersect(vec_origin, inv_dir, t_max, t_far);
+
+		if(!hit_near) {
+			near_child = far_child;
+			t_near = t_far;
+			hit_near = hit_far;
+			hit_far = false;
+		} else if(hit_far && t_far < t_near) {
+			swap(near_child, far_child);
+			swap(t_near, t_far);
+		}
+
+		/* Push the farther child first so the nearer one is popped next */
+		if(hit_far) {
+			stack[stack_size] = far_child;
+			stack_t[stack_size++] = t_far;
+		}
+		if(hit_near) {
+			stack[stack_size] = near_child;
+			stack_t[stack_size++] = t_near;
+		}
+	}
+
+	return false;
+}
+
+#endif
@@ -8,33 +8,41 @@
 #define DEBUG
 #define PI 3.14159
 
-class Camera_Setup 
+/* Pinhole camera, templated on the scalar type like Vector_T */
+template<typename T>
+class Camera_Setup_T 
 {
 
 private:
-	Vector camera_center;
-	Vector UP_VEC;
-	Vector W;  /* Towards Image plane */
-	Vector U;  /* 3rd vector perpendicular to W & U */
-	Vector V;  /* Head direction */
-	double distance;  /*Distance from image plane*/
+	Vector_T<T> camera_center;
+	Vector_T<T> UP_VEC;
+	Vector_T<T> W;  /* Towards Image plane */
+	Vector_T<T> U;  /* 3rd vector perpendicular to W & U */
+	Vector_T<T> V;  /* Head direction */
+	T distance;  /*Distance from image plane*/
 	int im_plane_width;
 	int im_plane_height;
-	double aspect_ratio;
-	double theta_u;
-	double theta_v;
+	T aspect_ratio;
+	T theta_u;
+	T theta_v;
 
 public:
-	Camera_Setup():camera_center(),UP_VEC(Vector(0.0,1.0,0.0)),W(Vector(0.0,0.0,-1.0)),distance(1.0),im_plane_width(640),im_plane_height(640),theta_u(90),theta_v(90){} 
-	Camera_Setup(const Vector& center,const Vector& up_vec, const Vector& w, double dist,int img_w, int img_h, double theta_u, double theta_v);
+	Camera_Setup_T():camera_center(),UP_VEC(Vector_T<T>(0.0,1.0,0.0)),W(Vector_T<T>(0.0,0.0,-1.0)),distance(1.0),im_plane_width(640),im_plane_height(640),theta_u(90),theta_v(90){} 
+	Camera_Setup_T(const Vector_T<T>& center,const Vector_T<T>& up_vec, const Vector_T<T>& w, T dist,int img_w, int img_h, T theta_u, T theta_v);
 	void camera_initialization();
-	Vector compute_pixel_vector(uint32_t row, uint32_t col);
-	Vector get_camera_center();
-	double get_pixel_height();
+	Vector_T<T> compute_pixel_vector(uint32_t row, uint32_t col);
+	Vector_T<T> get_camera_center();
+	T get_pixel_height();
+	T get_pixel_spread();
+	Vector_T<T> get_head_vector() { return V; }
+	T get_distance() { return distance; }
 
 };
 
-Camera_Setup::Camera_Setup(const Vector& center,const Vector& up_vec, const Vector& w, double dist,int img_w, int img_h, double theta_u, double theta_v)
+typedef Camera_Setup_T<Real> Camera_Setup;
+
+template<typename T>
+Camera_Setup_T<T>::Camera_Setup_T(const Vector_T<T>& center,const Vector_T<T>& up_vec, const Vector_T<T>& w, T dist,int img_w, int img_h, T theta_u, T theta_v)
 {
 
 	camera_center = center;
@@ -48,7 +56,8 @@ Camera_Setup::Camera_Setup(const Vector& center,const Vector& up_vec, const Vect
 	camera_initialization();
 }
 
-void Camera_Setup::camera_initialization() 
+template<typename T>
+void Camera_Setup_T<T>::camera_initialization() 
 {
 	aspect_ratio = im_plane_width/im_plane_height;
 	U = U.CrossProduct(W,UP_VEC);
@@ -64,27 +73,37 @@ void Camera_Setup::camera_initialization()
 	#endif
 }
 
-Vector Camera_Setup::compute_pixel_vector(uint32_t row, uint32_t col)
+template<typename T>
+Vector_T<T> Camera_Setup_T<T>::compute_pixel_vector(uint32_t row, uint32_t col)
 {
-	double pix_w = (2*tan((PI*theta_u/180)/2)*distance)/im_plane_width;
-	double pix_h = (2*tan((PI*theta_v/180)/2)*distance)/im_plane_height;
+	T pix_w = (2*tan((PI*theta_u/180)/2)*distance)/im_plane_width;
+	T pix_h = (2*tan((PI*theta_v/180)/2)*distance)/im_plane_height;
 
-	Vector pix_loc = camera_center + W - U*((im_plane_width/2.0)*pix_w) + V*((im_plane_height/2.0)*pix_h) + U*(pix_w/2.0) - V*(pix_h/2.0) + U*(pix_w*col) - V*(pix_h*row);
-	Vector vec_dir = pix_loc - camera_center;
+	Vector_T<T> pix_loc = camera_center + W - U*((im_plane_width/2.0)*pix_w) + V*((im_plane_height/2.0)*pix_h) + U*(pix_w/2.0) - V*(pix_h/2.0) + U*(pix_w*col) - V*(pix_h*row);
+	Vector_T<T> vec_dir = pix_loc - camera_center;
 	vec_dir = vec_dir.unit_vector();
 	//vec_dir.display_vector();
 	return vec_dir;
 }
 
-Vector Camera_Setup::get_camera_center()
+template<typename T>
+Vector_T<T> Camera_Setup_T<T>::get_camera_center()
 {
 	return camera_center;
 }
 
-double Camera_Setup::get_pixel_height()
+template<typename T>
+T Camera_Setup_T<T>::get_pixel_height()
 {
-	double pix_h = (2*tan((PI*theta_v/180)/2)*distance)/im_plane_height;
+	T pix_h = (2*tan((PI*theta_v/180)/2)*distance)/im_plane_height;
 	return pix_h;
 }
 
+/* Angle between the rays of neighbouring pixels at the center of the image */
+template<typename T>
+T Camera_Setup_T<T>::get_pixel_spread()
+{
+	return get_pixel_height()/distance;
+}
+
 #endif
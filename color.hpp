@@ -1,44 +1,52 @@
 #ifndef _color_h
 #define _color_h
 
+#include "precision.hpp"
+#include <stdint.h>
 #include <iostream>
 
 using namespace std;
 
-class Color
+/* RGBA color of any scalar type, Color is the renderer's */
+template<typename T>
+class Color_T
 {
 
 public:
-double r,g,b,a;
+T r,g,b,a;
  
-Color() : r(0.0),g(0.0),b(0.0) {
+Color_T() : r(0.0),g(0.0),b(0.0) {
 	a = 1.0;
 }
 
-Color(double r, double g, double b) 
+Color_T(T r, T g, T b) 
 {
 	 this->r = r; this->g = g; this->b = b; this->a = 1.0;
 }
 
- Color operator+ (const Color& col2) 
+/* From a color of another precision */
+template<typename U>
+Color_T(const Color_T<U>& col) : r(col.r), g(col.g), b(col.b), a(col.a) {}
+
+ Color_T operator+ (const Color_T& col2) 
  {
-    Color col1(0.0,0.0,0.0);
+    Color_T col1(0.0,0.0,0.0);
     col1.r = this->r + col2.r;
     col1.g = this->g + col2.g;
     col1.b = this->b + col2.b;
     return col1;
  }
 
- Color operator- (const Color& col2)
+ Color_T operator- (const Color_T& col2)
  {
-    Color col1(0.0,0.0,0.0);
+    Color_T col1(0.0,0.0,0.0);
     col1.r = this->r - col2.r;
     col1.g = this->g - col2.g;
     col1.b = this->b - col2.b;
     return col1;
  }     
 
- Color& operator= (const Color& col)
+ Color_T& operator= (const Color_T& col)
  {
 	this->r = col.r;
     this->g = col.g;
@@ -46,18 +54,18 @@ Color(double r, double g, double b)
     return *this; 
  }    
 
- Color operator/ (const double& k)
+ Color_T operator/ (const T& k)
  {
- 	Color col(0.0,0.0,0.0);
+ 	Color_T col(0.0,0.0,0.0);
     col.r = this->r/k;
     col.g = this->g/k;
     col.b = this->b/k;
     return col;
  }        
 
- Color operator* (const double& k)
+ Color_T operator* (const T& k)
  {
- 	Color col(0.0,0.0,0.0);
+ 	Color_T col(0.0,0.0,0.0);
     col.r = this->r * k;
     col.g = this->g * k;
     col.b = this->b * k;
@@ -72,7 +80,7 @@ Color(double r, double g, double b)
  //            k * col.b);
  // }
 
- Color& operator *= (const double& k)
+ Color_T& operator *= (const T& k)
  {
     this->r *= k;
     this->g *= k;
@@ -80,7 +88,7 @@ Color(double r, double g, double b)
     return *this;
  }
 
- Color& operator /= (const double& k)
+ Color_T& operator /= (const T& k)
  {
     this->r /= k;
     this->g /= k;
@@ -88,7 +96,7 @@ Color(double r, double g, double b)
     return *this;
  }
 
- Color& operator += (const Color& col)
+ Color_T& operator += (const Color_T& col)
  {
     this->r += col.r;
     this->g += col.g;
@@ -96,7 +104,7 @@ Color(double r, double g, double b)
     return *this;
  }
 
- Color& operator -= (const Color& col)
+ Color_T& operator -= (const Color_T& col)
  {
     this->r -= col.r;
     this->g -= col.g;
@@ -119,7 +127,7 @@ Color(double r, double g, double b)
 	return (A << 24) | (R << 16) | (G << 8) | B;
  } 	
 
- void ColorProduct (const Color& col1, const Color& col2) 
+ void ColorProduct (const Color_T& col1, const Color_T& col2) 
  {
     this->r = col1.r * col2.r;
     this->g = col1.g * col2.g;
@@ -129,4 +137,6 @@ Color(double r, double g, double b)
 
 };
 
+typedef Color_T<Real> Color;
+
 #endif
@@ -0,0 +1,85 @@
+#ifndef _depth_of_field_h
+#define _depth_of_field_h
+
+#include "color.hpp"
+#include "framebuffer.hpp"
+#include "thread_pool.hpp"
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#define DOF_LENS_RADIUS 30.0       /* DOF_TraceRay moves the eye up to 30 pixel heights along world up */
+#define DOF_MAX_BLUR_RADIUS 64     /* blur radius cap in pixels */
+
+using namespace std;
+
+/* Post-process depth of field: the image is traced once through a pinhole
+   and every focal distance is synthesized from its color and depth buffers.
+
+   A lens offset of k pixel heights aimed at the focal point moves a point at
+   depth z by k*distance*(1/z - 1/f) pixels on the image plane. The eye only
+   moves along world up, so the blur runs along the image columns and is
+   scaled by how much of world up the camera's head vector sees. */
+
+static inline double dof_blur_radius(double depth, double focal_distance, double lens_scale)
+{
+	const double inv_depth = (depth < DBL_MAX) ? 1.0/depth : 0.0;
+	return min(lens_scale * fabs(inv_depth - 1.0/focal_distance), (double)DOF_MAX_BLUR_RADIUS);
+}
+
+/* Depth aware gather: each pixel averages the column samples whose circle of
+   confusion reaches it. A sample behind the pixel may not spread further than
+   the pixel's own blur, so out of focus background stays behind sharp edges.
+   depth is row major, DBL_MAX where the ray escaped. result may have any
+   channel type, an 8 bit result is rounded once from the full sum. */
+template<typename Result_Channel>
+void depth_of_field_blur(const Framebuffer& image, const std::vector<double>& depth, Framebuffer_T<Result_Channel>& result, uint32_t width, uint32_t height, double focal_distance, double lens_scale, Thread_Pool& pool)
+{
+	std::vector<double> radius(width*height);
+	double max_radius = 0.0;
+
+	for(uint32_t i=0;i<width*height;i++) {
+		radius[i] = dof_blur_radius(depth[i], focal_distance, lens_scale);
+		max_radius = max(max_radius, radius[i]);
+	}
+
+	const int reach = (int)ceil(max_radius);
+
+	pool.parallel_for(height, [&](uint32_t row) {
+
+		for(uint32_t col=0;col<width;col++) {
+
+			const uint32_t center = row*width + col;
+			const int row_begin = max((int)row - reach, 0);
+			const int row_end = min((int)row + reach, (int)height - 1);
+
+			Color sum(0.0,0.0,0.0);
+			double weight_sum = 0.0;
+
+			for(int r=row_begin;r<=row_end;r++) {
+
+				const uint32_t sample = r*width + col;
+				double sample_radius = radius[sample];
+				if(depth[sample] > depth[center]) {
+					sample_radius = min(sample_radius, radius[center]);
+				}
+
+				/* Soft edge over the last pixel of the circle, weights spread the sample evenly */
+				const double coverage = min(max(sample_radius - fabs((double)r - (double)row) + 1.0, 0.0), 1.0);
+				if(coverage <= 0.0) {
+					continue;
+				}
+
+				const double weight = coverage/(2.0*sample_radius + 1.0);
+				sum += image.get_pixel_data(r,col) * weight;
+				weight_sum += weight;
+			}
+
+			result.set_pixel_data(row, col, sum/weight_sum);
+		}
+	});
+}
+
+#endif
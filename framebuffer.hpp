@@ -1,50 +1,193 @@
+#ifndef _framebuffer_h
+#define _framebuffer_h
+
 #include <iostream>
 #include <stdint.h>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <math.h>
 #include "color.hpp"
+#include "aligned_allocator.hpp"
+
+#define ACCUM_MAGIC "RTACCUM1"     /* first bytes of an accumulation checkpoint */
+#define FRAMEBUFFER_TILE_SHIFT 4   /* stored tiles of 16x16 pixels, the renderer's TILE_SIZE */
+#define FRAMEBUFFER_TILE (1 << FRAMEBUFFER_TILE_SHIFT)
 
 using namespace std;
 
-struct PixelData
+/* IEEE 754 binary16, stored as bits and converted to float on access.
+   Conversion rounds to nearest even like the hardware instructions do. */
+struct Half
 {
-    Color color;
-    //PixelData():color() {}
+	uint16_t bits;
+
+	Half() : bits(0) {}
+	Half(float value) : bits(from_float(value)) {}
+	operator float() const { return to_float(bits); }
+
+	static uint16_t from_float(float value)
+	{
+		uint32_t f;
+		memcpy(&f, &value, 4);
+		const uint16_t sign = (f >> 16) & 0x8000;
+		f &= 0x7fffffff;
+
+		/* Too large for a half, or infinity and NaN */
+		if(f >= 0x47800000) {
+			return sign | ((f > 0x7f800000) ? 0x7e00 : 0x7c00);
+		}
+
+		/* Below the smallest normal half, counted in steps of 2^-24 */
+		if(f < 0x38800000) {
+			float magnitude;
+			memcpy(&magnitude, &f, 4);
+			return sign | (uint16_t)lrintf(magnitude * 16777216.0f);
+		}
+
+		/* Rebias the exponent from 127 to 15 and round the mantissa to 10 bits */
+		uint32_t h = (f - 0x38000000) >> 13;
+		const uint32_t rest = f & 0x1fff;
+		if(rest > 0x1000 || (rest == 0x1000 && (h & 1))) {
+			h++;
+		}
+		return sign | h;
+	}
+
+	static float to_float(uint16_t h)
+	{
+		const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+		const uint32_t exponent = (h >> 10) & 0x1f;
+		const uint32_t mantissa = h & 0x3ff;
+
+		if(exponent == 0) {
+			const float magnitude = mantissa * (1.0f/16777216.0f);
+			return sign ? -magnitude : magnitude;
+		}
+
+		const uint32_t f = sign | ((exponent == 31) ? (0x7f800000 | (mantissa << 13)) : (((exponent + 112) << 23) | (mantissa << 13)));
+		float value;
+		memcpy(&value, &f, 4);
+		return value;
+	}
 };
 
-class Framebuffer
+/* Row major keeps whole rows contiguous, for output. Tiled stores every
+   FRAMEBUFFER_TILE square as one cache line aligned block, so a render tile
+   is contiguous and threads on neighbouring tiles never write the same line. */
+enum Framebuffer_Layout
 {
+	FB_ROW_MAJOR,
+	FB_TILED
+};
+
+/* How a channel type stores a color component. unsigned char holds the
+   final 8 bit value, truncated exactly like Color::ToUInt32. */
+template<typename Channel>
+struct Channel_Traits
+{
+	static const Framebuffer_Layout default_layout = FB_TILED;
+	static const bool output_bytes = false;
+	static Channel encode(double value) { return (Channel)value; }
+	static double decode(Channel value) { return (float)value; }
+};
+
+template<>
+struct Channel_Traits<unsigned char>
+{
+	static const Framebuffer_Layout default_layout = FB_ROW_MAJOR;
+	static const bool output_bytes = true;
+	static unsigned char encode(double value) { return (uint32_t)(value * 255.0) & 0xFF; }
+	static double decode(unsigned char value) { return value / 255.0; }
+};
+
+/* RGB only, alpha is always 1 */
+template<typename Channel>
+struct Pixel_T
+{
+	Channel r, g, b;
+
+	Pixel_T() : r(), g(), b() {}
+};
+
+template<typename Channel>
+class Framebuffer_T
+{
+
+	public:
+	typedef Pixel_T<Channel> Pixel;
+	typedef Channel_Traits<Channel> Traits;
 
 	private:        
         uint32_t  p_width;    
         uint32_t  p_height;     
         uint32_t  num_pixels;      
-        PixelData*  pixel_array;     
+        uint32_t  tiles_x;
+        Framebuffer_Layout  layout;
+        typename Aligned_Vector<Pixel>::type  pixel_array;     
+
+        /* Progressive accumulation, row major: running mean and sum of squared
+           deviations per channel (Welford) and the samples each pixel took */
+        std::vector<float> accum_mean;
+        std::vector<float> accum_sq_dev;
+        std::vector<uint32_t> accum_samples;
+
+        size_t index(uint32_t row, uint32_t col) const
+        {
+            if(layout == FB_ROW_MAJOR) {
+                return (size_t)row*p_width + col;
+            }
+
+            const size_t tile = (size_t)(row >> FRAMEBUFFER_TILE_SHIFT)*tiles_x + (col >> FRAMEBUFFER_TILE_SHIFT);
+            return (tile << (2*FRAMEBUFFER_TILE_SHIFT)) + ((row & (FRAMEBUFFER_TILE - 1)) << FRAMEBUFFER_TILE_SHIFT) + (col & (FRAMEBUFFER_TILE - 1));
+        }
 
     public:
-    Framebuffer (uint32_t w, uint32_t h) : p_width(w), p_height(h), num_pixels(w * h)
+    Framebuffer_T (uint32_t w, uint32_t h, Framebuffer_Layout l = Traits::default_layout) : p_width(w), p_height(h), num_pixels(w * h), tiles_x((w + FRAMEBUFFER_TILE - 1) >> FRAMEBUFFER_TILE_SHIFT), layout(l)
     {
-        pixel_array = new PixelData[num_pixels];
+        if(layout == FB_ROW_MAJOR) {
+            pixel_array.resize(num_pixels);
+        }
+        else {
+            const size_t tiles_y = (h + FRAMEBUFFER_TILE - 1) >> FRAMEBUFFER_TILE_SHIFT;
+            pixel_array.resize((tiles_x * tiles_y) << (2*FRAMEBUFFER_TILE_SHIFT));
+        }
     }
 
-    virtual ~Framebuffer()
+    virtual ~Framebuffer_T() {}
+
+    uint32_t get_width() const { return p_width; }
+    uint32_t get_height() const { return p_height; }
+    Framebuffer_Layout get_layout() const { return layout; }
+
+    /* Bytes held by the pixels, tiles on the right and bottom edge are padded */
+    size_t get_pixel_bytes() const { return pixel_array.size() * sizeof(Pixel); }
+
+    Color get_pixel_data(uint32_t row, uint32_t col) const
     {
-        delete[] pixel_array;
-        pixel_array = NULL;
-        p_width = p_height = num_pixels = 0;
+        const Pixel& pixel = pixel_array[index(row,col)];
+        return Color(Traits::decode(pixel.r), Traits::decode(pixel.g), Traits::decode(pixel.b));
     }
 
-    Color& get_pixel_data(uint32_t row, uint32_t col)
+    /* Pixel (row,col) and how many pixels of the row follow it contiguously */
+    const Pixel* get_span(uint32_t row, uint32_t col, uint32_t& count) const
     {
-        
-        return (pixel_array[row + col*p_width]).color;
-        
+        const uint32_t span_end = (layout == FB_ROW_MAJOR) ? p_width : min((col | (FRAMEBUFFER_TILE - 1)) + 1, p_width);
+        count = span_end - col;
+        return &pixel_array[index(row,col)];
     }
 
     void set_pixel_data(uint32_t row, uint32_t col, const Color& color)
 	{
 		if ((row < p_height) && (col < p_width))
         {
-            pixel_array[row + col*p_width].color = color;
+            Pixel& pixel = pixel_array[index(row,col)];
+            pixel.r = Traits::encode(color.r);
+            pixel.g = Traits::encode(color.g);
+            pixel.b = Traits::encode(color.b);
         }
         else
         {
@@ -53,12 +196,122 @@ class Framebuffer
 	
 	}
 
-	void clear_framebuffer()
+	/* Allocates the accumulation buffer on first use and empties it */
+	void reset_accumulation()
+	{
+		accum_mean.assign(3*num_pixels, 0.0f);
+		accum_sq_dev.assign(3*num_pixels, 0.0f);
+		accum_samples.assign(num_pixels, 0);
+	}
+
+	void accumulate(uint32_t row, uint32_t col, const Color& color)
+	{
+		const uint32_t pixel = row*p_width + col;
+		const float value[3] = { (float)color.r, (float)color.g, (float)color.b };
+		const uint32_t n = ++accum_samples[pixel];
+
+		for(int c=0;c<3;c++) {
+			float& mean = accum_mean[3*pixel + c];
+			const float delta = value[c] - mean;
+			mean += delta / n;
+			accum_sq_dev[3*pixel + c] += delta * (value[c] - mean);
+		}
+	}
+
+	uint32_t get_accumulated_samples(uint32_t row, uint32_t col) const
+	{
+		return accum_samples[row*p_width + col];
+	}
+
+	Color get_accumulated_mean(uint32_t row, uint32_t col) const
+	{
+		const float* mean = &accum_mean[3*(row*p_width + col)];
+		return Color(mean[0], mean[1], mean[2]);
+	}
+
+	/* Sum of squared deviations from the mean, divide by samples-1 for the variance */
+	Color get_accumulated_sq_dev(uint32_t row, uint32_t col) const
+	{
+		const float* sq_dev = &accum_sq_dev[3*(row*p_width + col)];
+		return Color(sq_dev[0], sq_dev[1], sq_dev[2]);
+	}
+
+	/* Checkpoints hold the accumulation buffer and the number of passes done.
+	   The file is written beside its final name and renamed into place, so a
+	   job killed while saving still leaves the previous checkpoint intact. */
+	bool save_accumulation(const char* filename, uint32_t passes) const
+	{
+		const std::string temp_name = std::string(filename) + ".tmp";
+		FILE* fp = fopen(temp_name.c_str(), "wb");
+
+		if(fp == NULL) {
+			cerr << "Unable to open " << temp_name << " for writing" << endl;
+			return false;
+		}
+
+		const uint32_t header[3] = { p_width, p_height, passes };
+		bool ok = fwrite(ACCUM_MAGIC, 1, 8, fp) == 8;
+		ok = ok && fwrite(header, sizeof(uint32_t), 3, fp) == 3;
+		ok = ok && fwrite(&accum_mean[0], sizeof(float), accum_mean.size(), fp) == accum_mean.size();
+		ok = ok && fwrite(&accum_sq_dev[0], sizeof(float), accum_sq_dev.size(), fp) == accum_sq_dev.size();
+		ok = ok && fwrite(&accum_samples[0], sizeof(uint32_t), accum_samples.size(), fp) == accum_samples.size();
+		ok = (fclose(fp) == 0) && ok;
+
+		if(!ok || rename(temp_name.c_str(), filename) != 0) {
+			cerr << "Unable to write checkpoint " << filename << endl;
+			remove(temp_name.c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+	/* Returns false, leaving the buffer empty, if there is no usable checkpoint */
+	bool load_accumulation(const char* filename, uint32_t& passes)
 	{
-		//memset(pixel_array, Color(), sizeof(PixelData) * p_width * p_height);
-		for (int i=0; i<sizeof(PixelData);i++) {
-			pixel_array[i].color = Color();
+		reset_accumulation();
+		passes = 0;
+
+		FILE* fp = fopen(filename, "rb");
+		if(fp == NULL) {
+			return false;
+		}
+
+		char magic[8];
+		uint32_t header[3];
+		bool ok = fread(magic, 1, 8, fp) == 8 && memcmp(magic, ACCUM_MAGIC, 8) == 0;
+		ok = ok && fread(header, sizeof(uint32_t), 3, fp) == 3 && header[0] == p_width && header[1] == p_height;
+		ok = ok && fread(&accum_mean[0], sizeof(float), accum_mean.size(), fp) == accum_mean.size();
+		ok = ok && fread(&accum_sq_dev[0], sizeof(float), accum_sq_dev.size(), fp) == accum_sq_dev.size();
+		ok = ok && fread(&accum_samples[0], sizeof(uint32_t), accum_samples.size(), fp) == accum_samples.size();
+		fclose(fp);
+
+		if(!ok) {
+			cerr << "Ignoring unreadable checkpoint " << filename << endl;
+			reset_accumulation();
+			return false;
 		}
+
+		passes = header[2];
+		return true;
+	}
+
+	void clear_framebuffer()
+	{
+		std::fill(pixel_array.begin(), pixel_array.end(), Pixel());
 	}
 
 };
+
+/* Images traced for further processing keep float channels, define
+   FRAMEBUFFER_HALF to halve their memory again at 11 bits of precision */
+#ifdef FRAMEBUFFER_HALF
+typedef Framebuffer_T<Half> Framebuffer;
+#else
+typedef Framebuffer_T<float> Framebuffer;
+#endif
+
+/* Final 8 bit pixels in row major order, exactly the bytes of a PPM image */
+typedef Framebuffer_T<unsigned char> Framebuffer_RGB8;
+
+#endif
@@ -0,0 +1,543 @@
+#ifndef _mesh_h
+#define _mesh_h
+
+#include "vector.hpp"
+#include "color.hpp"
+#include "objects.hpp"
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "thread_pool.hpp"
+#include "render_stats.hpp"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <charconv>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#define MESH_READ_BUFFER 65536     /* bytes of an OBJ file held at a time, also the longest line */
+
+using namespace std;
+
+/* A triangle mesh as read from one OBJ file, in the file's coordinates.
+   Vertices and normals are stored once, as floats, and the triangles refer
+   to them by 32 bit index, so a shared vertex costs 12 bytes and a triangle
+   12 more (24 with normals) besides its share of the BVH. The triangles are
+   kept in the order of the BVH's leaves, so a leaf reads consecutive ones. */
+struct Mesh_Data
+{
+	std::vector<float> positions;            /* x y z per vertex */
+	std::vector<float> normals;              /* x y z per normal, empty to shade with face normals */
+	std::vector<uint32_t> indices;           /* three vertices per triangle */
+	std::vector<uint32_t> normal_indices;    /* three normals per triangle, empty without normals */
+	BVH bvh;
+
+	uint32_t num_triangles() const { return indices.size() / 3; }
+
+	Vector_T<double> vertex(uint32_t index) const
+	{
+		return Vector_T<double>(positions[3*index], positions[3*index + 1], positions[3*index + 2]);
+	}
+
+	AABB get_bounds() const { return bvh.empty() ? AABB() : bvh.nodes[0].bounds; }
+
+	void build_bvh(Thread_Pool& pool);
+	static Mesh_Data* load(const char* filename);
+};
+
+typedef std::shared_ptr<const Mesh_Data> Mesh_Handle;
+
+void Mesh_Data::build_bvh(Thread_Pool& pool)
+{
+	const uint32_t count = num_triangles();
+	std::vector<AABB> bounds(count);
+	for(uint32_t i=0;i<count;i++) {
+		bounds[i].grow(vertex(indices[3*i]));
+		bounds[i].grow(vertex(indices[3*i + 1]));
+		bounds[i].grow(vertex(indices[3*i + 2]));
+	}
+	bvh.build(bounds, pool);
+
+	/* Store the triangles in leaf order, the BVH then indexes them directly */
+	std::vector<uint32_t> sorted(indices.size());
+	std::vector<uint32_t> sorted_normals(normal_indices.size());
+	for(uint32_t i=0;i<count;i++) {
+		const uint32_t tri = bvh.prim_indices[i];
+		for(int k=0;k<3;k++) {
+			sorted[3*i + k] = indices[3*tri + k];
+			if(!normal_indices.empty()) {
+				sorted_normals[3*i + k] = normal_indices[3*tri + k];
+			}
+		}
+		bvh.prim_indices[i] = i;
+	}
+	indices.swap(sorted);
+	normal_indices.swap(sorted_normals);
+}
+
+/* Reads a Wavefront OBJ file into its lines a buffer at a time, so memory
+   goes to the mesh and not to the file. v, vn and f are read; f takes v,
+   v/vt, v//vn and v/vt/vn corners, negative indices counting back from the
+   last vertex, and splits polygons into fans. Texture coordinates, groups,
+   materials and anything else are skipped. If not every face has normals
+   the mesh is shaded with face normals. */
+class Obj_Reader
+{
+
+	private:
+	const char* filename;
+	Mesh_Data& mesh;
+	int line;
+	bool all_normals;
+	std::vector<uint32_t> face;
+	std::vector<uint32_t> face_normals;
+
+	bool error(const char* message)
+	{
+		cerr << filename << ":" << line << ": " << message << endl;
+		return false;
+	}
+
+	static const char* skip_space(const char* p, const char* end)
+	{
+		while(p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+			p++;
+		}
+		return p;
+	}
+
+	bool read_floats(const char* p, const char* end, std::vector<float>& out)
+	{
+		for(int i=0;i<3;i++) {
+			p = skip_space(p, end);
+			float value;
+			const std::from_chars_result result = std::from_chars(p, end, value);
+			if(result.ec != std::errc()) {
+				return error("expected three numbers");
+			}
+			out.push_back(value);
+			p = result.ptr;
+		}
+		return true;
+	}
+
+	/* OBJ indices start at 1, negative ones count back from count */
+	bool resolve(long long index, size_t count, uint32_t& out)
+	{
+		const long long resolved = (index < 0) ? (long long)count + index : index - 1;
+		if(index == 0 || resolved < 0 || resolved >= (long long)count || resolved > UINT32_MAX) {
+			return error("face refers to a missing vertex or normal");
+		}
+		out = resolved;
+		return true;
+	}
+
+	bool read_face(const char* p, const char* end)
+	{
+		face.clear();
+		face_normals.clear();
+		bool normals = true;
+
+		for(;;) {
+			p = skip_space(p, end);
+			if(p == end) {
+				break;
+			}
+
+			long long v = 0, vn = 0;
+			std::from_chars_result result = std::from_chars(p, end, v);
+			if(result.ec != std::errc()) {
+				return error("expected a face corner");
+			}
+			p = result.ptr;
+
+			if(p < end && *p == '/') {
+				p++;
+				if(p < end && *p != '/') {
+					long long vt;
+					result = std::from_chars(p, end, vt);
+					p = result.ptr;
+				}
+				if(p < end && *p == '/') {
+					p++;
+					result = std::from_chars(p, end, vn);
+					if(result.ec != std::errc()) {
+						return error("expected a normal index");
+					}
+					p = result.ptr;
+				}
+			}
+			if(p < end && *p != ' ' && *p != '\t' && *p != '\r') {
+				return error("malformed face corner");
+			}
+
+			uint32_t index;
+			if(!resolve(v, mesh.positions.size()/3, index)) {
+				return false;
+			}
+			face.push_back(index);
+
+			if(vn != 0) {
+				if(!resolve(vn, mesh.normals.size()/3, index)) {
+					return false;
+				}
+				face_normals.push_back(index);
+			}
+			else {
+				normals = false;
+			}
+		}
+
+		if(face.size() < 3) {
+			return error("face with fewer than three corners");
+		}
+
+		all_normals = all_normals && normals;
+		for(size_t i=1;i+1<face.size();i++) {
+			mesh.indices.push_back(face[0]);
+			mesh.indices.push_back(face[i]);
+			mesh.indices.push_back(face[i + 1]);
+			if(all_normals) {
+				mesh.normal_indices.push_back(face_normals[0]);
+				mesh.normal_indices.push_back(face_normals[i]);
+				mesh.normal_indices.push_back(face_normals[i + 1]);
+			}
+		}
+		return true;
+	}
+
+	bool read_line(const char* p, const char* end)
+	{
+		p = skip_space(p, end);
+		if(end - p >= 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+			return read_floats(p + 2, end, mesh.positions);
+		}
+		if(end - p >= 3 && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t')) {
+			return read_floats(p + 3, end, mesh.normals);
+		}
+		if(end - p >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+			return read_face(p + 2, end);
+		}
+		return true;
+	}
+
+	public:
+	Obj_Reader(const char* file, Mesh_Data& data) : filename(file), mesh(data), line(0), all_normals(true) {}
+
+	bool read()
+	{
+		const int fd = open(filename, O_RDONLY);
+		if(fd < 0) {
+			perror(filename);
+			return false;
+		}
+
+		std::vector<char> buffer(MESH_READ_BUFFER);
+		size_t filled = 0;
+		bool at_eof = false;
+		bool ok = true;
+
+		while(ok && !at_eof) {
+			const ssize_t bytes = ::read(fd, &buffer[filled], buffer.size() - filled);
+			if(bytes < 0 && errno == EINTR) {
+				continue;
+			}
+			if(bytes <= 0) {
+				at_eof = true;
+			}
+			filled += max<ssize_t>(bytes, 0);
+
+			/* Every complete line, and at the end of the file the last one */
+			size_t begin = 0;
+			for(size_t i=0;ok && i<filled;i++) {
+				if(buffer[i] == '\n') {
+					line++;
+					ok = read_line(&buffer[begin], &buffer[i]);
+					begin = i + 1;
+				}
+			}
+			if(ok && at_eof && begin < filled) {
+				line++;
+				ok = read_line(&buffer[begin], &buffer[filled]);
+				begin = filled;
+			}
+
+			memmove(&buffer[0], &buffer[begin], filled - begin);
+			filled -= begin;
+			if(ok && filled == buffer.size()) {
+				line++;
+				ok = error("line too long");
+			}
+		}
+		close(fd);
+
+		if(!all_normals) {
+			mesh.normal_indices.clear();
+			mesh.normals.clear();
+		}
+		if(ok && mesh.indices.empty()) {
+			ok = error("no faces");
+		}
+
+		/* The buffers grew as the file was read, give back what is left over */
+		mesh.positions.shrink_to_fit();
+		mesh.normals.shrink_to_fit();
+		mesh.indices.shrink_to_fit();
+		mesh.normal_indices.shrink_to_fit();
+		return ok;
+	}
+
+};
+
+/* NULL after reporting why, if the file is not a usable OBJ mesh */
+Mesh_Data* Mesh_Data::load(const char* filename)
+{
+	STAT_TIMER(STAT_SCENE_LOAD);
+
+	Mesh_Data* mesh = new Mesh_Data();
+	Obj_Reader reader(filename, *mesh);
+	if(!reader.read()) {
+		delete mesh;
+		return NULL;
+	}
+
+	mesh->build_bvh(Thread_Pool::shared());
+	return mesh;
+}
+
+/* Meshes by canonical path, like Texture_Cache, so every Mesh naming one
+   file shares its buffers and BVH */
+class Mesh_Cache
+{
+
+	private:
+	std::mutex cache_mutex;
+	std::map<std::string, std::weak_ptr<const Mesh_Data> > meshes;
+
+	public:
+	static Mesh_Cache& shared()
+	{
+		static Mesh_Cache cache;
+		return cache;
+	}
+
+	Mesh_Handle load(const char* filename)
+	{
+		char resolved[PATH_MAX];
+		const std::string key = (realpath(filename, resolved) != NULL) ? std::string(resolved) : std::string(filename);
+
+		std::lock_guard<std::mutex> lock(cache_mutex);
+
+		Mesh_Handle mesh = meshes[key].lock();
+		if(!mesh) {
+			mesh = Mesh_Handle(Mesh_Data::load(filename));
+			if(mesh) {
+				meshes[key] = mesh;
+			}
+		}
+
+		return mesh;
+	}
+};
+
+/* A ray sheared so that it runs along +z from the origin, after Woop, Benthin
+   and Wald, "Watertight Ray/Triangle Intersection". Every triangle is tested
+   in these coordinates with edge functions that are evaluated the same way
+   for both triangles sharing an edge, so a ray can not slip between them. */
+struct Watertight_Ray
+{
+	Vector_T<double> origin;
+	int kx, ky, kz;
+	double sx, sy, sz;
+
+	Watertight_Ray(const Vector_T<double>& vec_origin, const Vector_T<double>& vec_dir) : origin(vec_origin)
+	{
+		const double d[3] = { vec_dir.x, vec_dir.y, vec_dir.z };
+		kz = (fabs(d[0]) > fabs(d[1])) ? ((fabs(d[0]) > fabs(d[2])) ? 0 : 2) : ((fabs(d[1]) > fabs(d[2])) ? 1 : 2);
+		kx = (kz + 1) % 3;
+		ky = (kx + 1) % 3;
+		if(d[kz] < 0.0) {
+			std::swap(kx, ky);
+		}
+		sx = d[kx] / d[kz];
+		sy = d[ky] / d[kz];
+		sz = 1.0 / d[kz];
+	}
+
+	/* Hit with t in (0,t_max), either side of the triangle; b0..b2 weigh its corners */
+	bool intersect(const Vector_T<double>& p0, const Vector_T<double>& p1, const Vector_T<double>& p2, double t_max, double& t, double& b0, double& b1, double& b2) const
+	{
+		const double a[3] = { p0.x - origin.x, p0.y - origin.y, p0.z - origin.z };
+		const double b[3] = { p1.x - origin.x, p1.y - origin.y, p1.z - origin.z };
+		const double c[3] = { p2.x - origin.x, p2.y - origin.y, p2.z - origin.z };
+
+		const double ax = a[kx] - sx*a[kz], ay = a[ky] - sy*a[kz];
+		const double bx = b[kx] - sx*b[kz], by = b[ky] - sy*b[kz];
+		const double cx = c[kx] - sx*c[kz], cy = c[ky] - sy*c[kz];
+
+		const double u = cx*by - cy*bx;
+		const double v = ax*cy - ay*cx;
+		const double w = bx*ay - by*ax;
+
+		if((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0)) {
+			return false;
+		}
+
+		const double det = u + v + w;
+		if(det == 0.0) {
+			return false;
+		}
+
+		const double scaled_t = u*sz*a[kz] + v*sz*b[kz] + w*sz*c[kz];
+		const double hit = scaled_t / det;
+		if(hit <= 0.0 || hit >= t_max) {
+			return false;
+		}
+
+		t = hit;
+		b0 = u / det;
+		b1 = v / det;
+		b2 = w / det;
+		return true;
+	}
+};
+
+/* An instance of a Mesh_Data, moved to center and scaled uniformly. Rays are
+   taken into the mesh's coordinates instead, which leaves their t as it is,
+   so any number of instances share the one copy of the triangles. Shaded
+   from both sides. Unlike spheres and planes a mesh can shadow itself, so
+   its shadow rays test its own triangles too. */
+class Mesh final : public Object
+{
+	private:
+	Mesh_Handle mesh;
+	Real scale;
+
+	/* Closest triangle under ray in mesh coordinates, -1 if none is before t_max */
+	int64_t closest_triangle(const Vector_T<double>& vec_origin, const Vector_T<double>& vec_dir, double& t_max, double bary[3]) const
+	{
+		const Watertight_Ray ray(vec_origin, vec_dir);
+		const Mesh_Data& data = *mesh;
+		int64_t closest = -1;
+
+		data.bvh.traverse(vec_origin, vec_dir, t_max, [&](uint32_t tri, double& t_limit) {
+			double t, b0, b1, b2;
+			if(ray.intersect(data.vertex(data.indices[3*tri]), data.vertex(data.indices[3*tri + 1]), data.vertex(data.indices[3*tri + 2]), t_limit, t, b0, b1, b2)) {
+				t_limit = t;
+				closest = tri;
+				bary[0] = b0; bary[1] = b1; bary[2] = b2;
+			}
+			return false;
+		});
+		return closest;
+	}
+
+	Vector_T<double> to_mesh(const Vector& point) const
+	{
+		return Vector_T<double>((point.x - center.x)/scale, (point.y - center.y)/scale, (point.z - center.z)/scale);
+	}
+
+	public:
+	Mesh(const Mesh_Handle& data, const Vector& pos, const Real& s, const Color& col, const double& ref, const int& id) : Object(pos,col,ref), mesh(data), scale(s) {
+		object_id = id;
+		self_shadowing = true;
+	}
+
+	bool check_Intersection(const Vector& vec_origin,const Vector& vec_dir,double t_max,double& t,uint32_t& part);
+	bool check_Occlusion(const Vector& vec_origin,const Vector& unit_dir,double max_distance);
+	AABB get_bounds();
+	void surface_attributes(const Vector& vec_origin, const Vector& vec_dir, double t, Intersection& inter);
+	Color gettexel(const Intersection& inter);
+
+	const Mesh_Data& get_data() const { return *mesh; }
+};
+
+AABB Mesh::get_bounds()
+{
+	const AABB box = mesh->get_bounds();
+	const Vector_T<double> lo(center.x + box.min_pt.x*scale, center.y + box.min_pt.y*scale, center.z + box.min_pt.z*scale);
+	const Vector_T<double> hi(center.x + box.max_pt.x*scale, center.y + box.max_pt.y*scale, center.z + box.max_pt.z*scale);
+	return AABB(lo, hi);
+}
+
+/* The part is the triangle */
+bool Mesh::check_Intersection(const Vector& vec_origin,const Vector& vec_dir,double t_max,double& t,uint32_t& part)
+{
+	const Vector_T<double> dir(vec_dir.x/scale, vec_dir.y/scale, vec_dir.z/scale);
+	double bary[3];
+	const int64_t tri = closest_triangle(to_mesh(vec_origin), dir, t_max, bary);
+	if(tri < 0) {
+		return false;
+	}
+	t = t_max;
+	part = (uint32_t)tri;
+	return true;
+}
+
+/* Stops at the first triangle in (0,max_distance) */
+bool Mesh::check_Occlusion(const Vector& vec_origin,const Vector& unit_dir,double max_distance)
+{
+	const Vector_T<double> origin = to_mesh(vec_origin);
+	const Vector_T<double> dir(unit_dir.x/scale, unit_dir.y/scale, unit_dir.z/scale);
+	const Watertight_Ray ray(origin, dir);
+	const Mesh_Data& data = *mesh;
+	double t_max = max_distance;
+
+	return data.bvh.traverse(origin, dir, t_max, [&](uint32_t tri, double& t_limit) {
+		double t, b0, b1, b2;
+		return ray.intersect(data.vertex(data.indices[3*tri]), data.vertex(data.indices[3*tri + 1]), data.vertex(data.indices[3*tri + 2]), max_distance, t, b0, b1, b2);
+	});
+}
+
+/* The ray is tested once more against the triangle it hit, inter.part, for
+   the weights of the corners. Normals are interpolated when the file has
+   them and turned to face the ray. */
+void Mesh::surface_attributes(const Vector& vec_origin, const Vector& vec_dir, double t, Intersection& inter)
+{
+	const Vector_T<double> dir(vec_dir.x/scale, vec_dir.y/scale, vec_dir.z/scale);
+	const Watertight_Ray ray(to_mesh(vec_origin), dir);
+	const Mesh_Data& data = *mesh;
+	const uint32_t tri = inter.part;
+	double hit_t, bary[3] = { 1.0, 0.0, 0.0 };
+	ray.intersect(data.vertex(data.indices[3*tri]), data.vertex(data.indices[3*tri + 1]), data.vertex(data.indices[3*tri + 2]), DBL_MAX, hit_t, bary[0], bary[1], bary[2]);
+
+	Vector_T<double> normal(0.0,0.0,0.0);
+	if(!data.normal_indices.empty()) {
+		for(int k=0;k<3;k++) {
+			const uint32_t n = data.normal_indices[3*tri + k];
+			normal += Vector_T<double>(data.normals[3*n], data.normals[3*n + 1], data.normals[3*n + 2]) * bary[k];
+		}
+	}
+	else {
+		Vector_T<double> p0 = data.vertex(data.indices[3*tri]);
+		Vector_T<double> edge1 = data.vertex(data.indices[3*tri + 1]) - p0;
+		Vector_T<double> edge2 = data.vertex(data.indices[3*tri + 2]) - p0;
+		normal = normal.CrossProduct(edge1, edge2);
+	}
+	inter.u = bary[1];
+	inter.v = bary[2];
+
+	normal = normal.unit_vector();
+	if(normal.x*vec_dir.x + normal.y*vec_dir.y + normal.z*vec_dir.z > 0.0) {
+		normal = normal * -1.0;
+	}
+	inter.surfaceNormal = normal;
+}
+
+/* Meshes carry no texture coordinates, u and v are the hit's place in its triangle */
+Color Mesh::gettexel(const Intersection& inter)
+{
+	return color;
+}
+
+#endif
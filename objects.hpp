@@ -3,66 +3,34 @@
 
 #include "vector.hpp"
 #include "color.hpp"
+#include "aabb.hpp"
+#include "texture_cache.hpp"
 #include <math.h>
 #include <vector>
 #include <cmath>
+#include <cstring>
 
 #define DEBUG
 #define PI 3.14159
 
-unsigned char* Read_PPM(const char*, int*, int*);
-
-unsigned char* Read_PPM(const char* filename, int* width, int* height)
-{
-    FILE* fp;
-    int i, w, h, d;
-    unsigned char* image;
-    char head[70];          /* max line <= 70 in PPM (per spec). */
-    
-    fp = fopen(filename, "rb");
-    if (!fp) {
-        perror(filename);
-        return NULL;
-    }
-    
-    /* grab first two chars of the file and make sure that it has the
-       correct magic cookie for a raw PPM file. */
-    fgets(head, 70, fp);
-    if (strncmp(head, "P6", 2)) {
-        fprintf(stderr, "%s: Not a raw PPM file\n", filename);
-        return NULL;
-    }
-    
-    /* grab the three elements in the header (width, height, maxval). */
-    i = 0;
-    while(i < 3) {
-        fgets(head, 70, fp);
-        if (head[0] == '#')     /* skip comments. */
-            continue;
-        if (i == 0)
-            i += sscanf(head, "%d %d %d", &w, &h, &d);
-        else if (i == 1)
-            i += sscanf(head, "%d %d", &h, &d);
-        else if (i == 2)
-            i += sscanf(head, "%d", &d);
-    }
-    
-    /* grab all the image data in one fell swoop. */
-    image = (unsigned char*)malloc(sizeof(unsigned char)*w*h*3);
-    fread(image, sizeof(unsigned char), w*h*3, fp);
-    fclose(fp);
-    
-    *width = w;
-    *height = h;
-
-    cout << "Read " << filename << " , width = " << w << ", height = " << h << std::endl; 
+class Object;
 
-    return image;
-}
+#define RAY_CONE_MIN_COSINE 0.01   /* grazing hits stretch the footprint at most 100 times */
 
+/* How wide a ray is, for texture filtering: its width where it starts and
+   how much that grows per unit of distance. Camera rays start as a point
+   spreading by one pixel's angle; reflections keep the spread, as if every
+   mirror were flat. */
+struct Ray_Cone
+{
+        double width;
+        double spread;
+        Ray_Cone(double w = 0.0, double s = 0.0) : width(w), spread(s) {}
 
-class Object;
+        Ray_Cone at(double distance) const { return Ray_Cone(width + spread*distance, spread); }
+};
 
+/* Full hit record, filled in once for the closest hit of a ray */
 struct Intersection
 {
         
@@ -70,11 +38,198 @@ struct Intersection
         double distanceSquared;
         Vector point;
         Vector surfaceNormal;
-        Intersection() : obj(NULL),distanceSquared(1.0e+5),point(),surfaceNormal(){}
+        double u,v;
+        Ray_Cone cone;      /* of the ray, arrived at the hit */
+        double footprint;   /* width of the cone on the surface, larger at grazing angles */
+        int prim;           /* obj in the scene's Primitive_Set, -1 when found without it */
+        uint32_t part;      /* of obj that was hit, a mesh's triangle; unused by objects in one piece */
+        Intersection() : obj(NULL),distanceSquared(1.0e+5),point(),surfaceNormal(),u(0.0),v(0.0),cone(),footprint(0.0),prim(-1),part(0){}
+
+        /* Once the hit is filled in, for the ray vec_dir (unit) carrying ray_cone */
+        void set_cone(const Ray_Cone& ray_cone, const Vector& vec_dir)
+        {
+                cone = ray_cone.at(sqrt(distanceSquared));
+                const double cosine = fabs(surfaceNormal.x*vec_dir.x + surfaceNormal.y*vec_dir.y + surfaceNormal.z*vec_dir.z);
+                footprint = cone.width / max(cosine, RAY_CONE_MIN_COSINE);
+        }
         
 };
 
-typedef std::vector<Intersection> Intersection_List;
+/* What traversal carries around: the ray parameter, the index of the object
+   and the part of it that was hit */
+struct Hit
+{
+        double t;
+        int prim;
+        uint32_t part;
+        Hit() : t(DBL_MAX),prim(-1),part(0){}
+};
+
+/* The ray-primitive tests on any scalar type; Sphere and Plane run them at
+   Real. The ray parameter stays double so traversal is the same in both
+   precisions. */
+template<typename T>
+static inline bool sphere_intersect(const Vector_T<T>& vec_origin, const Vector_T<T>& vec_dir, const Vector_T<T>& center, T radius, double t_max, double& t)
+{
+
+	/* Solve quadratic equation */
+	Vector_T<T> new_vec; 
+	new_vec = vec_origin;
+	new_vec -= center;
+	
+	Vector_T<T> new_vec_dir = vec_dir;
+
+	T a = new_vec_dir.mag_square();
+	Vector_T<T> temp;
+	T b = T(2.0) * temp.DotProduct(new_vec_dir,new_vec);
+	T D;
+
+	/* b*b - 4*a*c cancels to nothing when the sphere is far away compared to
+	   its size. The same value as 4*a*(radius^2 - |l|^2), with l the offset of
+	   the center from the ray, keeps the precision where T is too short. */
+	if(Precision_Traits<T>::stable_discriminant) {
+		Vector_T<T> l = new_vec - new_vec_dir*(b/(T(2.0)*a));
+		D = T(4.0)*a*(radius*radius - l.mag_square());
+	}
+	else {
+		T c = new_vec.mag_square() - radius*radius;
+		D = b*b - T(4.0)*a*c;
+	}
+
+	if(D < T(0.0)) {
+		return false;
+	}
+
+	/* Roots behind the origin are rejected, the near root wins when both are ahead */
+	T root = sqrt(D);
+	T sol_near = (-b - root)/(T(2.0)*a);
+	T sol_far = (-b + root)/(T(2.0)*a);
+	T sol = (sol_near > T(0.0)) ? sol_near : sol_far;
+
+	if(sol <= T(0.0) || sol >= t_max) {
+		return false;
+	}
+
+	t = sol;
+	return true;
+}
+
+/* Any-hit test for shadow rays: only asks whether a root lies in (0,max_distance) */
+template<typename T>
+static inline bool sphere_occluded(const Vector_T<T>& vec_origin, const Vector_T<T>& unit_dir, const Vector_T<T>& center, T radius, double max_distance)
+{
+	const T ox = vec_origin.x - center.x;
+	const T oy = vec_origin.y - center.y;
+	const T oz = vec_origin.z - center.z;
+
+	/* unit_dir has length 1, so a = 1 in the quadratic */
+	const T half_b = ox*unit_dir.x + oy*unit_dir.y + oz*unit_dir.z;
+	T D;
+
+	/* See sphere_intersect */
+	if(Precision_Traits<T>::stable_discriminant) {
+		const T lx = ox - half_b*unit_dir.x;
+		const T ly = oy - half_b*unit_dir.y;
+		const T lz = oz - half_b*unit_dir.z;
+		D = radius*radius - (lx*lx + ly*ly + lz*lz);
+	}
+	else {
+		const T c = ox*ox + oy*oy + oz*oz - radius*radius;
+		D = half_b*half_b - c;
+	}
+
+	if(D < T(0.0)) {
+		return false;
+	}
+
+	const T root = sqrt(D);
+	const T t_far = -half_b + root;
+	if(t_far <= T(0.0)) {
+		return false;
+	}
+
+	const T t_near = -half_b - root;
+	const T t = (t_near > T(0.0)) ? t_near : t_far;
+	return t < max_distance;
+}
+
+/* Rectangle of length along headup and width along normal x headup */
+template<typename T>
+static inline bool plane_intersect(const Vector_T<T>& vec_origin, const Vector_T<T>& vec_dir, const Vector_T<T>& center, const Vector_T<T>& normal, const Vector_T<T>& headup, T length, T width, double t_max, double& t)
+{
+
+	Vector_T<T> temp;
+	Vector_T<T> vec_direction = vec_dir;
+	T denom = temp.DotProduct(normal,vec_direction); 
+
+    if (fabs(denom) <= T(1e-6)) { 
+    	return false;
+    }
+        
+    Vector_T<T> v;
+    v += vec_origin;
+    v -= center;
+    T numer = v.DotProduct(normal,v);
+    T sol = (-numer)/denom; 
+
+    if (sol <= T(0.0) || sol >= t_max) {
+    	return false;
+    }
+        
+    /* Offsets of the hit point along headup and normal x headup from the center */
+    Vector_T<T> new_vec = vec_direction * sol;
+    new_vec += v;
+    T up_val = temp.DotProduct(headup,new_vec);
+
+    if (up_val > (length/T(2.0)) || up_val < (-length/T(2.0))) {
+    	return false;
+    }
+
+    Vector_T<T> right_vec;
+    right_vec = right_vec.CrossProduct(normal,headup);
+    T right_val = temp.DotProduct(right_vec,new_vec);
+
+    if (right_val > (width/T(2.0)) || right_val < (-width/T(2.0))) {
+    	return false;
+    }
+
+    t = sol;
+    return true; 
+
+}
+
+template<typename T>
+static inline bool plane_occluded(const Vector_T<T>& vec_origin, const Vector_T<T>& unit_dir, const Vector_T<T>& center, const Vector_T<T>& normal, const Vector_T<T>& headup, T length, T width, double max_distance)
+{
+	const T denom = normal.x*unit_dir.x + normal.y*unit_dir.y + normal.z*unit_dir.z;
+	if(fabs(denom) <= T(1e-6)) {
+		return false;
+	}
+
+	const T ox = vec_origin.x - center.x;
+	const T oy = vec_origin.y - center.y;
+	const T oz = vec_origin.z - center.z;
+	const T t = -(normal.x*ox + normal.y*oy + normal.z*oz)/denom;
+
+	if(t <= T(0.0) || t >= max_distance) {
+		return false;
+	}
+
+	/* Hit point relative to the center, then check it lies inside the rectangle */
+	const T px = ox + unit_dir.x*t;
+	const T py = oy + unit_dir.y*t;
+	const T pz = oz + unit_dir.z*t;
+
+	const T up_val = headup.x*px + headup.y*py + headup.z*pz;
+	if(up_val > (length/T(2.0)) || up_val < (-length/T(2.0))) {
+		return false;
+	}
+
+	Vector_T<T> right_vec;
+	right_vec = right_vec.CrossProduct(normal,headup);
+	const T right_val = right_vec.x*px + right_vec.y*py + right_vec.z*pz;
+	return (right_val <= (width/T(2.0)) && right_val >= (-width/T(2.0)));
+}
 
 class Object 
 {
@@ -83,41 +238,44 @@ class Object
 	Vector center;
 	Color color;
 	double reflectivity;
-	Intersection_List obj_inter_list;
 	
 	public:
 	int object_id;	
 	bool texture_flag;
+	bool self_shadowing;    /* can block light from its own surface, see Scene::shadow_start */
 
-	struct texture_obj {
-		unsigned char* image_data;
-		int tex_width;
-		int tex_height;
-	} tex_obj;
+	/* Shared with every object using the same file, see Texture_Cache */
+	Texture_Handle texture;
 
-	Object() : center(0.0,0.0,-10.0), color(0.0,0.0,0.0) , reflectivity(0.5) {}
+	Object() : center(0.0,0.0,-10.0), color(0.0,0.0,0.0) , reflectivity(0.5), texture_flag(false), self_shadowing(false) {}
 	Object(const Vector& pos, const Color& col, const double& ref) :  center(pos), 
 										    						  color(col),
-																	  reflectivity(ref){}
+																	  reflectivity(ref),
+																	  texture_flag(false),
+																	  self_shadowing(false){}
 																						
 
 	virtual ~Object(){}
 	void addTexture(const char*);	
-	virtual void check_Intersection(const Vector& vec_origin,const Vector& vec_dir,Intersection_List& list) = 0;
-	int find_nearest_Intersection(const Vector& vec_origin,const Vector& vec_dir,Intersection& inter)
-    {
-        obj_inter_list.clear();
-        check_Intersection(vec_origin,vec_dir,obj_inter_list);
-        int result = select_closest_point(obj_inter_list, inter);
-        return result;
-    }
 
-    int select_closest_point(const Intersection_List& obj_inter_list, Intersection& inter);    
+	/* Closest hit with t in (0,t_max), only the ray parameter is returned and,
+	   by objects made of parts, the part that was hit */
+	virtual bool check_Intersection(const Vector& vec_origin,const Vector& vec_dir,double t_max,double& t,uint32_t& part) = 0;
+	virtual bool check_Occlusion(const Vector& vec_origin,const Vector& unit_dir,double max_distance) = 0;
+	virtual AABB get_bounds() = 0;
+
+	/* Normal and texture coordinates at inter.point, the hit of the ray at t */
+	virtual void surface_attributes(const Vector& vec_origin,const Vector& vec_dir,double t,Intersection& inter) = 0;
+	void fill_Intersection(const Vector& vec_origin,const Vector& vec_dir,double t,uint32_t part,Intersection& inter);
 
     Color getcolor() {
     	return this->color;
     }    
 
+    Vector getcenter() {
+    	return this->center;
+    }
+
     virtual Color gettexel(const Intersection& inter) = 0;
 
     double getreflectivity() {
@@ -128,285 +286,166 @@ class Object
 void Object::addTexture(const char* filename)
 {
 
-	int w, h;
-    tex_obj.image_data = Read_PPM(filename,&w,&h);
+    texture = Texture_Cache::shared().load(filename);
     
-    if(tex_obj.image_data == NULL) {
+    if(!texture) {
     	cerr << "File type or data is invalid! Adding texture Failed!" << endl;
     }
 
-    texture_flag = true;
-    tex_obj.tex_width = w;
-    tex_obj.tex_height = h;
+    texture_flag = (texture != NULL);
 }
 
-int Object::select_closest_point(const Intersection_List& obj_inter_list, Intersection& inter) 
+void Object::fill_Intersection(const Vector& vec_origin,const Vector& vec_dir,double t,uint32_t part,Intersection& inter)
 {
-		int size = obj_inter_list.size();
-
-		switch(size) {
-
-			case 0: /*No intersection*/
-					return 0;
-
-			case 1: /*Only one point detected with intersection*/
-					inter = obj_inter_list[0];
-					return 1;
-
-			default: /* More point or objects detected need to select closest */
-					//cout << "Came here!" << endl;
-					int begin = 0;
-					int end = obj_inter_list.size();
-					int closest_index = begin;
-        			begin++;
-
-        			while(begin!=end) {
-
-        				if(obj_inter_list[begin].distanceSquared < obj_inter_list[closest_index].distanceSquared) 
-        				{
-        					closest_index = begin;
-        				}
-
-        				begin++;		
-        			}
-
-        			inter = obj_inter_list[closest_index];
-        			return 1;
-		}
-
+	Vector dir = vec_dir;
+	Vector vec_to_point = dir*t;
+
+	inter.obj = this;
+	inter.part = part;
+	inter.distanceSquared = vec_to_point.mag_square();
+	inter.point = vec_origin; inter.point += vec_to_point;
+	surface_attributes(vec_origin,vec_dir,t,inter);
 }
 
-class Sphere : public Object
+class Sphere final : public Object
 {
 	private:
-	double radius;
+	Real radius;
 	
 	public:	
 	Sphere() : Object(), radius(1.0) {
 		object_id = 1;
-		texture_flag = false;
-		tex_obj.image_data = NULL;
-		tex_obj.tex_height = 0;
-		tex_obj.tex_width = 0;
 	}
 
-	Sphere(const Vector& pos, const double& rad, const Color& col, const double& ref, const int& id) : Object(pos,col,ref) , radius(rad) {
+	Sphere(const Vector& pos, const Real& rad, const Color& col, const double& ref, const int& id) : Object(pos,col,ref) , radius(rad) {
 		object_id = id;
-		texture_flag = false;
-		tex_obj.image_data = NULL;
-		tex_obj.tex_height = 0;
-		tex_obj.tex_width = 0;
 	}
 	
-	void check_Intersection(const Vector& vec_origin,const Vector& vec_dir,Intersection_List& list);
+	bool check_Intersection(const Vector& vec_origin,const Vector& vec_dir,double t_max,double& t,uint32_t& part);
+	bool check_Occlusion(const Vector& vec_origin,const Vector& unit_dir,double max_distance);
+	AABB get_bounds();
+	void surface_attributes(const Vector& vec_origin,const Vector& vec_dir,double t,Intersection& inter);
 	Color gettexel(const Intersection& inter);
+
+	Real getradius() { return radius; }
 };
 
-void Sphere::check_Intersection(const Vector& vec_origin,const Vector& vec_dir,Intersection_List& list)
+AABB Sphere::get_bounds()
 {
+	Vector extent(radius,radius,radius);
+	return AABB(center - extent, center + extent);
+}
 
-	/* Solve quadratic equation */
-	Vector new_vec; 
-	new_vec = vec_origin;
-	new_vec -= center;
-	
-	Vector new_vec_dir = vec_dir;
-
-	double a = new_vec_dir.mag_square();
-	Vector temp;
-	double b = 2.0 * temp.DotProduct(new_vec_dir,new_vec);
-	double c = new_vec.mag_square() - radius*radius;
-
-	double D = b*b - 4.0*a*c;
-
-	double sol[2];
-
-	if(D >= 0.0) {
-
-	  sol[0] = (-b + sqrt(D))/(2.0*a);
-	  sol[1] = (-b - sqrt(D))/(2.0*a);  
-
-	  for(int i=0;i<2;i++) {
-
-		Intersection new_intersect;	
-		Vector vec_to_point = new_vec_dir*sol[i];
-
-		/* Populate the struct */
-		new_intersect.obj = this;
-		new_intersect.distanceSquared = vec_to_point.mag_square();
-		new_intersect.point = vec_origin; new_intersect.point += vec_to_point;
-		new_intersect.surfaceNormal = (new_intersect.point - center).unit_vector();
-
-		//Debug: Fixed bug - Ray may trace backwards and intersect with objects. 
-		// Found myself : Check the dot product of the ray direction and the vector between the point of intersection & point of origin
-		// If the dotproduct is positive then they point in same direction which is wrong behavior!
-		Vector check_vec(0.0,0.0,0.0); 
-		check_vec -= new_intersect.point;
-		check_vec += vec_origin; 
-		check_vec = check_vec.unit_vector();
-		Vector check_vec_2 = vec_dir;
-
-		Vector check_vec_3;
-		double check_param = check_vec_3.DotProduct(check_vec,check_vec_2);
-
-		// if(new_intersect.point.z < 0 && (check_param < 0)) {
-		// 	list.push_back(new_intersect);			
-		// }
-
-		if(check_param < 0) {
-			list.push_back(new_intersect);			
-		}
+bool Sphere::check_Intersection(const Vector& vec_origin,const Vector& vec_dir,double t_max,double& t,uint32_t& part)
+{
+	return sphere_intersect(vec_origin, vec_dir, center, radius, t_max, t);
+}
 
-		if(sol[0] == sol[1] && D == 0) { /*Just one unique solution*/
-				break;
-		}	
-	  }
-		
-	} else {
-		return;
-	}
+void Sphere::surface_attributes(const Vector& vec_origin,const Vector& vec_dir,double t,Intersection& inter)
+{
+	Vector normal = (inter.point - center).unit_vector();
+	inter.surfaceNormal = normal;
+	inter.u = atan2(normal.z,normal.x)/(2.0*PI) + 0.5;
+	inter.v = 0.5 - asin(normal.y)/PI;
+}
 
+/* Any-hit test for shadow rays: only asks whether a root lies in (0,max_distance) */
+bool Sphere::check_Occlusion(const Vector& vec_origin,const Vector& unit_dir,double max_distance)
+{
+	return sphere_occluded(vec_origin, unit_dir, center, radius, max_distance);
 }
 
+/* The footprint turns into texture coordinates by how far u and v move per
+   unit length on the surface. u goes once around a ring of the sphere,
+   2*PI*radius at the equator and shorter towards the poles, where no ring is
+   taken as narrower than one texel. v goes from pole to pole over PI*radius. */
 Color Sphere::gettexel(const Intersection& inter)
 {
+	const double ring = max(sqrt(max(1.0 - inter.surfaceNormal.y*inter.surfaceNormal.y, 0.0)), 1.0/texture->get_width());
+	const double du = inter.footprint / (2.0*PI*radius*ring);
+	const double dv = inter.footprint / (PI*radius);
 
-	Vector normal = inter.surfaceNormal;
-	
-	int u = ((atan2(normal.z,normal.x))/2*PI + 0.5 ) * tex_obj.tex_width;
-	int v = (0.5 - (asin(normal.y)/PI)) * tex_obj.tex_height;
-
-	Color tex_color(0.0,0.0,0.0);
-	int index = (v*tex_obj.tex_width + u)*3;
-
-	if(index < tex_obj.tex_width*tex_obj.tex_height*3) {
-		tex_color.r = (tex_obj.image_data[index])/255.0; 
-		tex_color.g = (tex_obj.image_data[index+1])/255.0; 
-		tex_color.b = (tex_obj.image_data[index+2])/255.0;
-	}
-
-	return tex_color; 
+	return texture->sample(inter.u, inter.v, du, dv);
 }
 
-class Plane : public Object
+class Plane final : public Object
 {
 	private:
-	double length;
-	double width;
+	Real length;
+	Real width;
 	Vector normal;
 	Vector headup;
 
 	public:	
 	Plane() : Object(), length(10.0), width(10.0), normal(Vector(0.0,1.0,0.0)),headup(Vector(0.0,1.0,0.0)) {
 		object_id = 1;
-		texture_flag = false;
-		tex_obj.image_data = NULL;
-		tex_obj.tex_height = 0;
-		tex_obj.tex_width = 0;
 	}
 
-	Plane(const Vector& pos, const double& l, const double& w, const Vector& Normal, const Vector& Headup, const Color& col, const double& ref, const int& id) : Object(pos,col,ref) , length(l), width(w), normal(Normal), headup(Headup) {
+	Plane(const Vector& pos, const Real& l, const Real& w, const Vector& Normal, const Vector& Headup, const Color& col, const double& ref, const int& id) : Object(pos,col,ref) , length(l), width(w), normal(Normal), headup(Headup) {
 		object_id = id;
-		texture_flag = false;
-		tex_obj.image_data = NULL;
-		tex_obj.tex_height = 0;
-		tex_obj.tex_width = 0;
 	}
 	
-	void check_Intersection(const Vector& vec_origin,const Vector& vec_dir,Intersection_List& list);
+	bool check_Intersection(const Vector& vec_origin,const Vector& vec_dir,double t_max,double& t,uint32_t& part);
+	bool check_Occlusion(const Vector& vec_origin,const Vector& unit_dir,double max_distance);
+	AABB get_bounds();
+	void surface_attributes(const Vector& vec_origin,const Vector& vec_dir,double t,Intersection& inter);
 	Color gettexel(const Intersection& inter);
+
+	Real getlength() { return length; }
+	Real getwidth() { return width; }
+	Vector getnormal() { return normal; }
+	Vector getheadup() { return headup; }
 };
 
-void Plane::check_Intersection(const Vector& vec_origin,const Vector& vec_dir,Intersection_List& list)
+AABB Plane::get_bounds()
 {
+	/* Half edges of the rectangle, check_Intersection measures along headup and normal x headup */
+	Vector right_vec;
+	right_vec = right_vec.CrossProduct(normal,headup);
+	Vector half_up = headup * ((length/2.0)/headup.mag_square());
+	Vector half_right = right_vec * ((width/2.0)/right_vec.mag_square());
 
-	static int count = 0;
-
-	Vector temp;
-	Vector vec_direction = vec_dir;
-	double denom = temp.DotProduct(normal,vec_direction); 
-
-    if (abs(denom) > 1e-6) { 
-        
-        Vector v;
-        v += vec_origin;
-        v -= center;
-        double numer = v.DotProduct(normal,v);
-        double t = (-numer)/denom; 
-        
-        Vector collision_point;
-        collision_point += vec_origin;
-        collision_point += (vec_direction * t);
-
-        Vector up_vec;
-        up_vec += collision_point;
-        up_vec -= center;
-        double up_val = temp.DotProduct(headup,up_vec);
-
-        Vector right_vec;
-        right_vec = right_vec.CrossProduct(normal,headup);
-        Vector new_vec;
-        new_vec += collision_point;
-        new_vec -= center;
-        double right_val = temp.DotProduct(right_vec,new_vec);
-
-        if( (up_val <= (length/2.0) && up_val >= (-length/2.0)) && (right_val <= (width/2.0) && right_val >= (-width/2.0)) )
-        {
-        	Intersection new_intersect;
-        	Vector vec_to_point;
-        	vec_to_point += (vec_direction * t);
-
-        	new_intersect.obj = this;
-			new_intersect.distanceSquared = vec_to_point.mag_square();
-		    new_intersect.point = collision_point;
-		    new_intersect.surfaceNormal = normal;
-
-		    Vector check_vec(0.0,0.0,0.0); 
-			check_vec -= new_intersect.point;
-			check_vec += vec_origin; 
-			check_vec = check_vec.unit_vector();
-			Vector check_vec_2 = vec_dir;
-
-			Vector check_vec_3;
-			double check_param = check_vec_3.DotProduct(check_vec,check_vec_2);
-
-		 //    if(new_intersect.point.z < 0 && (check_param < 0)) {				
-			// list.push_back(new_intersect);			
-			// }
-
-			if(check_param < 0) {				
-			list.push_back(new_intersect);			
-			}
-        }
-
-    } 
- 
-    return; 
+	/* Pad the flat side so the slab test never sees a zero thickness box */
+	double pad = 1e-6 * (length + width);
+	Vector extent(fabs(half_up.x) + fabs(half_right.x) + pad,
+				  fabs(half_up.y) + fabs(half_right.y) + pad,
+				  fabs(half_up.z) + fabs(half_right.z) + pad);
 
+	return AABB(center - extent, center + extent);
 }
 
-
-Color Plane::gettexel(const Intersection& inter)
+bool Plane::check_Intersection(const Vector& vec_origin,const Vector& vec_dir,double t_max,double& t,uint32_t& part)
 {
+	return plane_intersect(vec_origin, vec_dir, center, normal, headup, length, width, t_max, t);
+}
 
-	Vector point = inter.point;
-	Vector vec = point;
+void Plane::surface_attributes(const Vector& vec_origin,const Vector& vec_dir,double t,Intersection& inter)
+{
+	Vector vec = inter.point;
 	vec -= center;
 
 	Vector right_vec;
     right_vec = right_vec.CrossProduct(normal,headup);
 
-	int u = ( (vec.DotProduct(vec,right_vec))/width + 0.5 ) * tex_obj.tex_width;
-	int v = ( (vec.DotProduct(vec,headup))/length + 0.5 ) * tex_obj.tex_height;
+	inter.surfaceNormal = normal;
+	inter.u = (vec.DotProduct(vec,right_vec))/width + 0.5;
+	inter.v = (vec.DotProduct(vec,headup))/length + 0.5;
+}
 
-	Color tex_color(0.0,0.0,0.0);
-	int index = (v*tex_obj.tex_width + u)*3;
+bool Plane::check_Occlusion(const Vector& vec_origin,const Vector& unit_dir,double max_distance)
+{
+	return plane_occluded(vec_origin, unit_dir, center, normal, headup, length, width, max_distance);
+}
 
-	tex_color.r = (tex_obj.image_data[index])/255.0; 
-	tex_color.g = (tex_obj.image_data[index+1])/255.0; 
-	tex_color.b = (tex_obj.image_data[index+2])/255.0;
+/* u and v move by the length of normal x headup over width and of headup over length */
+Color Plane::gettexel(const Intersection& inter)
+{
+	Vector right_vec;
+	right_vec = right_vec.CrossProduct(normal,headup);
+	const double du = inter.footprint * right_vec.mag() / width;
+	const double dv = inter.footprint * headup.mag() / length;
 
-	return tex_color; 
+	return texture->sample(inter.u, inter.v, du, dv);
 }
 
 struct Light_Source
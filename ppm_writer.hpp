@@ -0,0 +1,191 @@
+#ifndef _ppm_writer_h
+#define _ppm_writer_h
+
+#include "color.hpp"
+#include "framebuffer.hpp"
+#include "thread_pool.hpp"
+#include "render_stats.hpp"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <vector>
+
+#define PPM_BAND_ROWS 16           /* rows quantized and written per task by write_ppm */
+
+using namespace std;
+
+/* Output stage: bands of rows are written with positional writes, so any
+   thread can write any band as soon as it is finished and in whatever order.
+   Row major 8 bit framebuffers already hold the file's bytes; other pixels
+   are quantized a row at a time. */
+
+/* count pixels to 3 bytes each, the same truncation as storing the colors
+   in a Framebuffer_RGB8 */
+template<typename Channel>
+static void quantize_span(const Pixel_T<Channel>* pixels, uint32_t count, unsigned char* rgb)
+{
+	typedef Channel_Traits<Channel> Source;
+	typedef Channel_Traits<unsigned char> Target;
+
+	for(uint32_t i=0;i<count;i++) {
+		rgb[3*i] = Target::encode(Source::decode(pixels[i].r));
+		rgb[3*i + 1] = Target::encode(Source::decode(pixels[i].g));
+		rgb[3*i + 2] = Target::encode(Source::decode(pixels[i].b));
+	}
+}
+
+template<>
+void quantize_span<unsigned char>(const Pixel_T<unsigned char>* pixels, uint32_t count, unsigned char* rgb)
+{
+	memcpy(rgb, pixels, 3*(size_t)count);
+}
+
+/* Binary PPM opened once with its header, then filled in row bands from any thread */
+class PPM_Stream
+{
+
+	private:
+	int fd;
+	uint32_t width;
+	uint32_t height;
+	size_t header_size;
+
+	public:
+	PPM_Stream(const char* filename, uint32_t w, uint32_t h) : fd(-1), width(w), height(h), header_size(0)
+	{
+		fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+		if(fd < 0) {
+			cerr << "Unable to open " << filename << " for writing" << endl;
+			return;
+		}
+
+		char header[64];
+		header_size = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+		if(pwrite(fd, header, header_size, 0) != (ssize_t)header_size || ftruncate(fd, header_size + (size_t)width*height*3) != 0) {
+			cerr << "Unable to write " << filename << endl;
+		}
+	}
+
+	virtual ~PPM_Stream()
+	{
+		if(fd >= 0) {
+			close(fd);
+		}
+	}
+
+	bool is_open() const { return fd >= 0; }
+
+	/* Rows [row_begin,row_end) of the framebuffer go to their place in the
+	   file. Row major 8 bit pixels already are the file's bytes and are
+	   written from the framebuffer itself. */
+	template<typename Channel>
+	void write_rows(const Framebuffer_T<Channel>& framebuffer, uint32_t row_begin, uint32_t row_end)
+	{
+		if(fd < 0 || row_begin >= row_end) {
+			return;
+		}
+
+		STAT_TIMER(STAT_IMAGE_WRITE);
+		const size_t size = (size_t)(row_end - row_begin)*width*3;
+		const off_t offset = header_size + (off_t)row_begin*width*3;
+		const void* data = NULL;
+		std::vector<unsigned char> bytes;
+
+		if(Channel_Traits<Channel>::output_bytes && framebuffer.get_layout() == FB_ROW_MAJOR) {
+			uint32_t count = 0;
+			data = framebuffer.get_span(row_begin, 0, count);
+		}
+		else {
+			bytes.resize(size);
+			for(uint32_t row=row_begin;row<row_end;row++) {
+				unsigned char* out = &bytes[(size_t)(row - row_begin)*width*3];
+				for(uint32_t col=0;col<width;) {
+					uint32_t count = 0;
+					const Pixel_T<Channel>* pixels = framebuffer.get_span(row, col, count);
+					quantize_span(pixels, count, out + 3*(size_t)col);
+					col += count;
+				}
+			}
+			data = &bytes[0];
+		}
+
+		if(pwrite(fd, data, size, offset) != (ssize_t)size) {
+			cerr << "Short write of rows " << row_begin << " to " << row_end << endl;
+		}
+	}
+
+};
+
+/* Writes a finished framebuffer, the bands in parallel */
+template<typename Channel>
+static void write_ppm(const char* filename, const Framebuffer_T<Channel>& framebuffer, const uint32_t& width, const uint32_t& height, Thread_Pool& pool)
+{
+	PPM_Stream stream(filename, width, height);
+
+	if(!stream.is_open()) {
+		return;
+	}
+
+	pool.parallel_for((height + PPM_BAND_ROWS - 1)/PPM_BAND_ROWS, [&](uint32_t band) {
+		stream.write_rows(framebuffer, band*PPM_BAND_ROWS, min((band + 1)*PPM_BAND_ROWS, height));
+	});
+}
+
+/* Streams an image while it is rendered: the renderer reports every finished
+   tile and the band of rows it belongs to is written once all of its tiles are
+   done. The same image can go to several files. */
+template<typename Channel>
+class Band_Writer
+{
+
+	private:
+	const Framebuffer_T<Channel>& framebuffer;
+	uint32_t width;
+	uint32_t height;
+	uint32_t band_rows;
+	uint32_t tiles_per_band;
+	std::vector<PPM_Stream*> streams;
+	std::vector< std::atomic<uint32_t> > finished_tiles;
+
+	public:
+	Band_Writer(const Framebuffer_T<Channel>& fb, uint32_t w, uint32_t h, uint32_t rows, uint32_t tiles) : framebuffer(fb), width(w), height(h), band_rows(rows), tiles_per_band(tiles), finished_tiles((h + rows - 1)/rows)
+	{
+		for(size_t i=0;i<finished_tiles.size();i++) {
+			finished_tiles[i] = 0;
+		}
+	}
+
+	virtual ~Band_Writer()
+	{
+		for(size_t i=0;i<streams.size();i++) {
+			delete streams[i];
+		}
+	}
+
+	void add_file(const char* filename)
+	{
+		streams.push_back(new PPM_Stream(filename, width, height));
+	}
+
+	/* Tiles are numbered row major, tiles_per_band to a band */
+	void tile_done(uint32_t tile)
+	{
+		const uint32_t band = tile / tiles_per_band;
+		if(finished_tiles[band].fetch_add(1) + 1 != tiles_per_band) {
+			return;
+		}
+
+		const uint32_t row_begin = band*band_rows;
+		const uint32_t row_end = min(row_begin + band_rows, height);
+		for(size_t i=0;i<streams.size();i++) {
+			streams[i]->write_rows(framebuffer, row_begin, row_end);
+		}
+	}
+
+};
+
+#endif
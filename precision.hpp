@@ -0,0 +1,41 @@
+#ifndef _precision_h
+#define _precision_h
+
+/* Scalar type of the renderer's vectors, colors, camera and intersection
+   tests. Double by default; compile with -DRENDER_FLOAT to render in single
+   precision and compare its speed and images against the double build.
+   Ray parameters, hit distances and the acceleration structures stay double
+   in both builds. */
+#ifdef RENDER_FLOAT
+typedef float Real;
+#else
+typedef double Real;
+#endif
+
+/* Per scalar type constants that must follow the precision of the math */
+template<typename T>
+struct Precision_Traits;
+
+template<>
+struct Precision_Traits<double>
+{
+	static const char* name() { return "double"; }
+	/* Secondary rays start this far along their direction from the hit
+	   point, well above the rounding error of a hit in scenes of unit scale */
+	static double ray_offset() { return 1e-10; }
+	/* b*b - 4*a*c is exact enough, see sphere_intersect */
+	static const bool stable_discriminant = false;
+};
+
+template<>
+struct Precision_Traits<float>
+{
+	static const char* name() { return "float"; }
+	/* A float hit point is only good to about 1e-7 of its coordinates, so a
+	   smaller offset lets reflections hit their own surface again */
+	static float ray_offset() { return 1e-4f; }
+	/* Spheres far from the ray origin lose their hits in b*b - 4*a*c */
+	static const bool stable_discriminant = true;
+};
+
+#endif
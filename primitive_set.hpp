@@ -0,0 +1,189 @@
+#ifndef _primitive_set_h
+#define _primitive_set_h
+
+#include "vector.hpp"
+#include "objects.hpp"
+#include "mesh.hpp"
+#include <stdint.h>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+/* Compile time list of the primitive types a scene is compiled into */
+template<typename... Types>
+struct Primitive_Types {};
+
+/* A new primitive type is a final class derived from Object, added here */
+typedef Primitive_Types<Sphere, Plane, Mesh> Scene_Primitive_Types;
+
+template<typename List>
+class Primitive_Set;
+
+/* The scene's objects by value, in one array per listed type, the types in
+   list order. A primitive is numbered by its place in that order, so its type
+   follows from which range the number falls in and every call on it is bound
+   at compile time to the final class, where it can be inlined. Objects of
+   types not in the list come last and are called through Object. */
+template<typename... Types>
+class Primitive_Set<Primitive_Types<Types...> >
+{
+
+	private:
+	static const size_t NUM_TYPES = sizeof...(Types);
+
+	std::tuple<std::vector<Types>...> arrays;
+	std::vector<Object*> unlisted;
+	uint32_t first[NUM_TYPES + 2];     /* first primitive of each type, of the unlisted ones, and the end */
+
+	template<size_t I, typename Func>
+	auto visit_from(uint32_t prim, Func& func) -> decltype(func(std::declval<Object&>()))
+	{
+		if constexpr (I < NUM_TYPES) {
+			if(prim < first[I + 1]) {
+				return func(std::get<I>(arrays)[prim - first[I]]);
+			}
+			return visit_from<I + 1>(prim, func);
+		}
+		else {
+			return func(*unlisted[prim - first[NUM_TYPES]]);
+		}
+	}
+
+	template<size_t I, typename Func>
+	void for_each_from(Func& func)
+	{
+		if constexpr (I < NUM_TYPES) {
+			std::vector<typename std::tuple_element<I, std::tuple<Types...> >::type>& array = std::get<I>(arrays);
+			for(size_t i=0;i<array.size();i++) {
+				func(array[i], first[I] + i);
+			}
+			for_each_from<I + 1>(func);
+		}
+		else {
+			for(size_t i=0;i<unlisted.size();i++) {
+				func(*unlisted[i], first[NUM_TYPES] + i);
+			}
+		}
+	}
+
+	/* Moves objects[i] into the array of its type, or to unlisted */
+	template<size_t I>
+	void add(std::vector<Object*>& objects, size_t i, bool owned, std::tuple<std::vector<Types>...>& to, std::vector<Object*>& to_unlisted)
+	{
+		if constexpr (I < NUM_TYPES) {
+			typedef typename std::tuple_element<I, std::tuple<Types...> >::type Type;
+			if(Type* obj = dynamic_cast<Type*>(objects[i])) {
+				std::get<I>(to).push_back(std::move(*obj));
+				if(!owned) {
+					delete obj;
+				}
+				return;
+			}
+			add<I + 1>(objects, i, owned, to, to_unlisted);
+		}
+		else {
+			to_unlisted.push_back(objects[i]);
+		}
+	}
+
+	template<size_t I>
+	void link(std::vector<Object*>& objects)
+	{
+		if constexpr (I < NUM_TYPES) {
+			first[I + 1] = first[I] + std::get<I>(arrays).size();
+			for(size_t i=0;i<std::get<I>(arrays).size();i++) {
+				objects[first[I] + i] = &std::get<I>(arrays)[i];
+			}
+			link<I + 1>(objects);
+		}
+	}
+
+	public:
+	Primitive_Set() : first() {}
+
+	virtual ~Primitive_Set()
+	{
+		clear();
+	}
+
+	/* Primitives the set owns, they are the first entries of the object list it was built from */
+	uint32_t size() const { return first[NUM_TYPES + 1]; }
+
+	/* Takes over the objects and sorts them by type, objects then points into
+	   the arrays. Entries beyond size() were allocated with new and are
+	   deleted once moved, earlier ones belong to the set already. */
+	void build(std::vector<Object*>& objects)
+	{
+		std::tuple<std::vector<Types>...> to;
+		std::vector<Object*> to_unlisted;
+
+		for(size_t i=0;i<objects.size();i++) {
+			add<0>(objects, i, i < size(), to, to_unlisted);
+		}
+
+		arrays.swap(to);
+		unlisted.swap(to_unlisted);
+
+		first[0] = 0;
+		link<0>(objects);
+		for(size_t i=0;i<unlisted.size();i++) {
+			objects[first[NUM_TYPES] + i] = unlisted[i];
+		}
+		first[NUM_TYPES + 1] = objects.size();
+	}
+
+	void clear()
+	{
+		for(size_t i=0;i<unlisted.size();i++) {
+			delete unlisted[i];
+		}
+		unlisted.clear();
+		arrays = std::tuple<std::vector<Types>...>();
+		for(size_t k=0;k<NUM_TYPES + 2;k++) {
+			first[k] = 0;
+		}
+	}
+
+	/* func(obj) on primitive prim as its own type */
+	template<typename Func>
+	auto visit(uint32_t prim, Func func) -> decltype(func(std::declval<Object&>()))
+	{
+		return visit_from<0>(prim, func);
+	}
+
+	/* func(obj, prim) on every primitive, one loop per type */
+	template<typename Func>
+	void for_each(Func func)
+	{
+		for_each_from<0>(func);
+	}
+
+	bool intersect(uint32_t prim, const Vector& vec_origin, const Vector& vec_dir, double t_max, double& t, uint32_t& part)
+	{
+		return visit(prim, [&](auto& obj) { return obj.check_Intersection(vec_origin, vec_dir, t_max, t, part); });
+	}
+
+	/* Like Scene::check_Occlusion, the object obj_id never blocks its own shadow rays */
+	bool occluded(uint32_t prim, const Vector& vec_origin, const Vector& unit_dir, double max_distance, int obj_id)
+	{
+		return visit(prim, [&](auto& obj) { return obj.object_id != obj_id && obj.check_Occlusion(vec_origin, unit_dir, max_distance); });
+	}
+
+	void fill(uint32_t prim, const Vector& vec_origin, const Vector& vec_dir, double t, uint32_t part, Intersection& inter)
+	{
+		visit(prim, [&](auto& obj) { obj.fill_Intersection(vec_origin, vec_dir, t, part, inter); });
+		inter.prim = prim;
+	}
+
+	Color texel(const Intersection& inter)
+	{
+		return visit(inter.prim, [&](auto& obj) { return obj.gettexel(inter); });
+	}
+
+};
+
+typedef Primitive_Set<Scene_Primitive_Types> Scene_Primitive_Set;
+
+#endif
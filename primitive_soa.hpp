@@ -0,0 +1,856 @@
+#ifndef _primitive_soa_h
+#define _primitive_soa_h
+
+#include "vector.hpp"
+#include "objects.hpp"
+#include "aligned_allocator.hpp"
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SOA_HAVE_X86
+#endif
+
+using namespace std;
+
+typedef Aligned_Vector<double>::type Double_Array;
+
+/* Structure of arrays copies of the scene primitives. Every array is indexed
+   the same way, prim maps an entry back to its index in Scene::obj_list. */
+struct Sphere_SoA
+{
+	Double_Array cx, cy, cz;
+	Double_Array radius;
+	Double_Array obj_id;
+	std::vector<int> prim;
+
+	size_t size() const { return prim.size(); }
+
+	void clear()
+	{
+		cx.clear(); cy.clear(); cz.clear();
+		radius.clear(); obj_id.clear(); prim.clear();
+	}
+
+	void add(Sphere* sphere, int prim_index)
+	{
+		Vector center = sphere->getcenter();
+		cx.push_back(center.x); cy.push_back(center.y); cz.push_back(center.z);
+		radius.push_back(sphere->getradius());
+		obj_id.push_back(sphere->object_id);
+		prim.push_back(prim_index);
+	}
+};
+
+struct Plane_SoA
+{
+	Double_Array cx, cy, cz;
+	Double_Array nx, ny, nz;
+	Double_Array hx, hy, hz;
+	Double_Array rx, ry, rz;   /* normal x headup, precomputed */
+	Double_Array half_length, half_width;
+	Double_Array obj_id;
+	std::vector<int> prim;
+
+	size_t size() const { return prim.size(); }
+
+	void clear()
+	{
+		cx.clear(); cy.clear(); cz.clear();
+		nx.clear(); ny.clear(); nz.clear();
+		hx.clear(); hy.clear(); hz.clear();
+		rx.clear(); ry.clear(); rz.clear();
+		half_length.clear(); half_width.clear();
+		obj_id.clear(); prim.clear();
+	}
+
+	void add(Plane* plane, int prim_index)
+	{
+		Vector center = plane->getcenter();
+		Vector normal = plane->getnormal();
+		Vector headup = plane->getheadup();
+		Vector right_vec;
+		right_vec = right_vec.CrossProduct(normal,headup);
+
+		cx.push_back(center.x); cy.push_back(center.y); cz.push_back(center.z);
+		nx.push_back(normal.x); ny.push_back(normal.y); nz.push_back(normal.z);
+		hx.push_back(headup.x); hy.push_back(headup.y); hz.push_back(headup.z);
+		rx.push_back(right_vec.x); ry.push_back(right_vec.y); rz.push_back(right_vec.z);
+		half_length.push_back(plane->getlength()/2.0);
+		half_width.push_back(plane->getwidth()/2.0);
+		obj_id.push_back(plane->object_id);
+		prim.push_back(prim_index);
+	}
+};
+
+struct SoA_Ray
+{
+	double ox, oy, oz;
+	double dx, dy, dz;
+
+	SoA_Ray(const Vector& origin, const Vector& dir) : ox(origin.x), oy(origin.y), oz(origin.z), dx(dir.x), dy(dir.y), dz(dir.z) {}
+};
+
+/* Where an object ended up in the SoA arrays */
+enum SoA_Kind
+{
+	SOA_SPHERE,
+	SOA_PLANE,
+	SOA_OTHER
+};
+
+struct SoA_Ref
+{
+	SoA_Kind kind;
+	int slot;
+};
+
+enum SIMD_Level
+{
+	SIMD_SCALAR,
+	SIMD_AVX2,
+	SIMD_AVX512
+};
+
+/* One set of kernels per instruction set. Closest kernels return the entry
+   with the smallest t in (0,t_max) over [begin,end) and lower t_max to it,
+   or -1. Occlusion kernels skip entries whose obj_id equals skip_id. */
+struct SoA_Kernels
+{
+	SIMD_Level level;
+	int lanes;
+	const char* name;
+	int (*closest_spheres)(const Sphere_SoA&, size_t, size_t, const SoA_Ray&, double&);
+	int (*closest_planes)(const Plane_SoA&, size_t, size_t, const SoA_Ray&, double&);
+	bool (*occluded_spheres)(const Sphere_SoA&, size_t, size_t, const SoA_Ray&, double, double);
+	bool (*occluded_planes)(const Plane_SoA&, size_t, size_t, const SoA_Ray&, double, double);
+};
+
+/* ---- Scalar kernels, same arithmetic as Sphere/Plane so every path agrees ---- */
+
+static inline bool sphere_closest_1(const Sphere_SoA& s, size_t i, const SoA_Ray& ray, double a, double t_max, double& t)
+{
+	double ocx = ray.ox - s.cx[i];
+	double ocy = ray.oy - s.cy[i];
+	double ocz = ray.oz - s.cz[i];
+
+	double b = 2.0 * ((ray.dx*ocx) + (ray.dy*ocy) + (ray.dz*ocz));
+	double c = ((ocx*ocx) + (ocy*ocy) + (ocz*ocz)) - s.radius[i]*s.radius[i];
+	double D = b*b - 4.0*a*c;
+
+	if(D < 0.0) {
+		return false;
+	}
+
+	double root = sqrt(D);
+	double sol_near = (-b - root)/(2.0*a);
+	double sol_far = (-b + root)/(2.0*a);
+	double sol = (sol_near > 0.0) ? sol_near : sol_far;
+
+	if(sol <= 0.0 || sol >= t_max) {
+		return false;
+	}
+
+	t = sol;
+	return true;
+}
+
+static inline bool plane_closest_1(const Plane_SoA& p, size_t i, const SoA_Ray& ray, double t_max, double& t)
+{
+	double denom = (p.nx[i]*ray.dx) + (p.ny[i]*ray.dy) + (p.nz[i]*ray.dz);
+	if(fabs(denom) <= 1e-6) {
+		return false;
+	}
+
+	double vx = ray.ox - p.cx[i];
+	double vy = ray.oy - p.cy[i];
+	double vz = ray.oz - p.cz[i];
+	double numer = (p.nx[i]*vx) + (p.ny[i]*vy) + (p.nz[i]*vz);
+	double sol = (-numer)/denom;
+
+	if(sol <= 0.0 || sol >= t_max) {
+		return false;
+	}
+
+	double px = ray.dx*sol + vx;
+	double py = ray.dy*sol + vy;
+	double pz = ray.dz*sol + vz;
+
+	double up_val = (p.hx[i]*px) + (p.hy[i]*py) + (p.hz[i]*pz);
+	if(up_val > p.half_length[i] || up_val < -p.half_length[i]) {
+		return false;
+	}
+
+	double right_val = (p.rx[i]*px) + (p.ry[i]*py) + (p.rz[i]*pz);
+	if(right_val > p.half_width[i] || right_val < -p.half_width[i]) {
+		return false;
+	}
+
+	t = sol;
+	return true;
+}
+
+static inline bool sphere_occluded_1(const Sphere_SoA& s, size_t i, const SoA_Ray& ray, double max_distance)
+{
+	double ox = ray.ox - s.cx[i];
+	double oy = ray.oy - s.cy[i];
+	double oz = ray.oz - s.cz[i];
+
+	double half_b = ox*ray.dx + oy*ray.dy + oz*ray.dz;
+	double c = ox*ox + oy*oy + oz*oz - s.radius[i]*s.radius[i];
+	double D = half_b*half_b - c;
+
+	if(D < 0.0) {
+		return false;
+	}
+
+	double root = sqrt(D);
+	double t_far = -half_b + root;
+	if(t_far <= 0.0) {
+		return false;
+	}
+
+	double t_near = -half_b - root;
+	double t = (t_near > 0.0) ? t_near : t_far;
+	return t < max_distance;
+}
+
+static inline bool plane_occluded_1(const Plane_SoA& p, size_t i, const SoA_Ray& ray, double max_distance)
+{
+	double denom = p.nx[i]*ray.dx + p.ny[i]*ray.dy + p.nz[i]*ray.dz;
+	if(fabs(denom) <= 1e-6) {
+		return false;
+	}
+
+	double ox = ray.ox - p.cx[i];
+	double oy = ray.oy - p.cy[i];
+	double oz = ray.oz - p.cz[i];
+	double t = -(p.nx[i]*ox + p.ny[i]*oy + p.nz[i]*oz)/denom;
+
+	if(t <= 0.0 || t >= max_distance) {
+		return false;
+	}
+
+	double px = ox + ray.dx*t;
+	double py = oy + ray.dy*t;
+	double pz = oz + ray.dz*t;
+
+	double up_val = p.hx[i]*px + p.hy[i]*py + p.hz[i]*pz;
+	if(up_val > p.half_length[i] || up_val < -p.half_length[i]) {
+		return false;
+	}
+
+	double right_val = p.rx[i]*px + p.ry[i]*py + p.rz[i]*pz;
+	return (right_val <= p.half_width[i] && right_val >= -p.half_width[i]);
+}
+
+static int closest_spheres_scalar(const Sphere_SoA& s, size_t begin, size_t end, const SoA_Ray& ray, double& t_max)
+{
+	const double a = (ray.dx*ray.dx) + (ray.dy*ray.dy) + (ray.dz*ray.dz);
+	int best = -1;
+	for(size_t i=begin;i<end;i++) {
+		double t;
+		if(sphere_closest_1(s, i, ray, a, t_max, t)) {
+			t_max = t;
+			best = i;
+		}
+	}
+	return best;
+}
+
+static int closest_planes_scalar(const Plane_SoA& p, size_t begin, size_t end, const SoA_Ray& ray, double& t_max)
+{
+	int best = -1;
+	for(size_t i=begin;i<end;i++) {
+		double t;
+		if(plane_closest_1(p, i, ray, t_max, t)) {
+			t_max = t;
+			best = i;
+		}
+	}
+	return best;
+}
+
+static bool occluded_spheres_scalar(const Sphere_SoA& s, size_t begin, size_t end, const SoA_Ray& ray, double max_distance, double skip_id)
+{
+	for(size_t i=begin;i<end;i++) {
+		if(s.obj_id[i] != skip_id && sphere_occluded_1(s, i, ray, max_distance)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool occluded_planes_scalar(const Plane_SoA& p, size_t begin, size_t end, const SoA_Ray& ray, double max_distance, double skip_id)
+{
+	for(size_t i=begin;i<end;i++) {
+		if(p.obj_id[i] != skip_id && plane_occluded_1(p, i, ray, max_distance)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Picks the smallest t among the lanes, the lower index on ties, like the scalar loop */
+static inline int reduce_lanes(const double* lane_t, const double* lane_index, int lanes, double& t_max)
+{
+	int best = -1;
+	for(int l=0;l<lanes;l++) {
+		if(lane_index[l] < 0.0) {
+			continue;
+		}
+		if(best < 0 || lane_t[l] < t_max || (lane_t[l] == t_max && lane_index[l] < best)) {
+			t_max = lane_t[l];
+			best = (int)lane_index[l];
+		}
+	}
+	return best;
+}
+
+#ifdef SOA_HAVE_X86
+
+/* Kernels are compiled for their instruction set only, the runtime dispatch
+   below decides which one runs. FMA contraction stays off so every level
+   rounds exactly like the scalar code and images do not depend on the host.
+   Each kernel clears the upper register halves before its scalar tail;
+   GCC does not always do it before a call out of a target function, and
+   the tail's SSE code would run with them dirty. */
+#define SOA_AVX2_KERNEL __attribute__((target("avx2"), optimize("fp-contract=off")))
+#define SOA_AVX512_KERNEL __attribute__((target("avx512f"), optimize("fp-contract=off")))
+
+/* ---- AVX2: one ray against 4 primitives ---- */
+
+SOA_AVX2_KERNEL
+static int closest_spheres_avx2(const Sphere_SoA& s, size_t begin, size_t end, const SoA_Ray& ray, double& t_max)
+{
+	const double a_s = (ray.dx*ray.dx) + (ray.dy*ray.dy) + (ray.dz*ray.dz);
+	const __m256d ox = _mm256_set1_pd(ray.ox), oy = _mm256_set1_pd(ray.oy), oz = _mm256_set1_pd(ray.oz);
+	const __m256d dx = _mm256_set1_pd(ray.dx), dy = _mm256_set1_pd(ray.dy), dz = _mm256_set1_pd(ray.dz);
+	const __m256d two = _mm256_set1_pd(2.0);
+	const __m256d four_a = _mm256_set1_pd(4.0*a_s);
+	const __m256d two_a = _mm256_set1_pd(2.0*a_s);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d sign = _mm256_set1_pd(-0.0);
+	const __m256d step = _mm256_set1_pd(4.0);
+
+	__m256d best_t = _mm256_set1_pd(t_max);
+	__m256d best_i = _mm256_set1_pd(-1.0);
+	__m256d lane_i = _mm256_setr_pd(begin, begin+1, begin+2, begin+3);
+
+	size_t i = begin;
+	for(; i + 4 <= end; i += 4) {
+		__m256d ocx = _mm256_sub_pd(ox, _mm256_loadu_pd(&s.cx[i]));
+		__m256d ocy = _mm256_sub_pd(oy, _mm256_loadu_pd(&s.cy[i]));
+		__m256d ocz = _mm256_sub_pd(oz, _mm256_loadu_pd(&s.cz[i]));
+		__m256d r = _mm256_loadu_pd(&s.radius[i]);
+
+		__m256d b = _mm256_mul_pd(two, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx,ocx), _mm256_mul_pd(dy,ocy)), _mm256_mul_pd(dz,ocz)));
+		__m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx,ocx), _mm256_mul_pd(ocy,ocy)), _mm256_mul_pd(ocz,ocz)), _mm256_mul_pd(r,r));
+		__m256d D = _mm256_sub_pd(_mm256_mul_pd(b,b), _mm256_mul_pd(four_a,c));
+
+		/* Negative discriminants turn into NaN here and fail every compare below */
+		__m256d root = _mm256_sqrt_pd(D);
+		__m256d neg_b = _mm256_xor_pd(b, sign);
+		__m256d sol_near = _mm256_div_pd(_mm256_sub_pd(neg_b, root), two_a);
+		__m256d sol_far = _mm256_div_pd(_mm256_add_pd(neg_b, root), two_a);
+		__m256d sol = _mm256_blendv_pd(sol_far, sol_near, _mm256_cmp_pd(sol_near, zero, _CMP_GT_OQ));
+
+		__m256d hit = _mm256_and_pd(_mm256_cmp_pd(sol, zero, _CMP_GT_OQ), _mm256_cmp_pd(sol, best_t, _CMP_LT_OQ));
+		best_t = _mm256_blendv_pd(best_t, sol, hit);
+		best_i = _mm256_blendv_pd(best_i, lane_i, hit);
+		lane_i = _mm256_add_pd(lane_i, step);
+	}
+
+	double lane_t[4], lane_index[4];
+	_mm256_storeu_pd(lane_t, best_t);
+	_mm256_storeu_pd(lane_index, best_i);
+	int best = reduce_lanes(lane_t, lane_index, 4, t_max);
+
+	_mm256_zeroupper();
+	int tail = closest_spheres_scalar(s, i, end, ray, t_max);
+	return (tail >= 0) ? tail : best;
+}
+
+SOA_AVX2_KERNEL
+static int closest_planes_avx2(const Plane_SoA& p, size_t begin, size_t end, const SoA_Ray& ray, double& t_max)
+{
+	const __m256d ox = _mm256_set1_pd(ray.ox), oy = _mm256_set1_pd(ray.oy), oz = _mm256_set1_pd(ray.oz);
+	const __m256d dx = _mm256_set1_pd(ray.dx), dy = _mm256_set1_pd(ray.dy), dz = _mm256_set1_pd(ray.dz);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d sign = _mm256_set1_pd(-0.0);
+	const __m256d min_denom = _mm256_set1_pd(1e-6);
+	const __m256d step = _mm256_set1_pd(4.0);
+
+	__m256d best_t = _mm256_set1_pd(t_max);
+	__m256d best_i = _mm256_set1_pd(-1.0);
+	__m256d lane_i = _mm256_setr_pd(begin, begin+1, begin+2, begin+3);
+
+	size_t i = begin;
+	for(; i + 4 <= end; i += 4) {
+		__m256d nx = _mm256_loadu_pd(&p.nx[i]), ny = _mm256_loadu_pd(&p.ny[i]), nz = _mm256_loadu_pd(&p.nz[i]);
+
+		__m256d denom = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx,dx), _mm256_mul_pd(ny,dy)), _mm256_mul_pd(nz,dz));
+		__m256d ok = _mm256_cmp_pd(_mm256_andnot_pd(sign, denom), min_denom, _CMP_GT_OQ);
+
+		__m256d vx = _mm256_sub_pd(ox, _mm256_loadu_pd(&p.cx[i]));
+		__m256d vy = _mm256_sub_pd(oy, _mm256_loadu_pd(&p.cy[i]));
+		__m256d vz = _mm256_sub_pd(oz, _mm256_loadu_pd(&p.cz[i]));
+		__m256d numer = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx,vx), _mm256_mul_pd(ny,vy)), _mm256_mul_pd(nz,vz));
+		__m256d sol = _mm256_div_pd(_mm256_xor_pd(numer, sign), denom);
+
+		ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(sol, zero, _CMP_GT_OQ), _mm256_cmp_pd(sol, best_t, _CMP_LT_OQ)));
+
+		__m256d px = _mm256_add_pd(_mm256_mul_pd(dx,sol), vx);
+		__m256d py = _mm256_add_pd(_mm256_mul_pd(dy,sol), vy);
+		__m256d pz = _mm256_add_pd(_mm256_mul_pd(dz,sol), vz);
+
+		__m256d half_l = _mm256_loadu_pd(&p.half_length[i]);
+		__m256d up_val = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(&p.hx[i]),px), _mm256_mul_pd(_mm256_loadu_pd(&p.hy[i]),py)), _mm256_mul_pd(_mm256_loadu_pd(&p.hz[i]),pz));
+		ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(up_val, half_l, _CMP_LE_OQ), _mm256_cmp_pd(up_val, _mm256_xor_pd(half_l, sign), _CMP_GE_OQ)));
+
+		__m256d half_w = _mm256_loadu_pd(&p.half_width[i]);
+		__m256d right_val = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(&p.rx[i]),px), _mm256_mul_pd(_mm256_loadu_pd(&p.ry[i]),py)), _mm256_mul_pd(_mm256_loadu_pd(&p.rz[i]),pz));
+		ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(right_val, half_w, _CMP_LE_OQ), _mm256_cmp_pd(right_val, _mm256_xor_pd(half_w, sign), _CMP_GE_OQ)));
+
+		best_t = _mm256_blendv_pd(best_t, sol, ok);
+		best_i = _mm256_blendv_pd(best_i, lane_i, ok);
+		lane_i = _mm256_add_pd(lane_i, step);
+	}
+
+	double lane_t[4], lane_index[4];
+	_mm256_storeu_pd(lane_t, best_t);
+	_mm256_storeu_pd(lane_index, best_i);
+	int best = reduce_lanes(lane_t, lane_index, 4, t_max);
+
+	_mm256_zeroupper();
+	int tail = closest_planes_scalar(p, i, end, ray, t_max);
+	return (tail >= 0) ? tail : best;
+}
+
+SOA_AVX2_KERNEL
+static bool occluded_spheres_avx2(const Sphere_SoA& s, size_t begin, size_t end, const SoA_Ray& ray, double max_distance, double skip_id)
+{
+	const __m256d ox = _mm256_set1_pd(ray.ox), oy = _mm256_set1_pd(ray.oy), oz = _mm256_set1_pd(ray.oz);
+	const __m256d dx = _mm256_set1_pd(ray.dx), dy = _mm256_set1_pd(ray.dy), dz = _mm256_set1_pd(ray.dz);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d sign = _mm256_set1_pd(-0.0);
+	const __m256d max_t = _mm256_set1_pd(max_distance);
+	const __m256d skip = _mm256_set1_pd(skip_id);
+
+	size_t i = begin;
+	for(; i + 4 <= end; i += 4) {
+		__m256d cx = _mm256_sub_pd(ox, _mm256_loadu_pd(&s.cx[i]));
+		__m256d cy = _mm256_sub_pd(oy, _mm256_loadu_pd(&s.cy[i]));
+		__m256d cz = _mm256_sub_pd(oz, _mm256_loadu_pd(&s.cz[i]));
+		__m256d r = _mm256_loadu_pd(&s.radius[i]);
+
+		__m256d half_b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(cx,dx), _mm256_mul_pd(cy,dy)), _mm256_mul_pd(cz,dz));
+		__m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(cx,cx), _mm256_mul_pd(cy,cy)), _mm256_mul_pd(cz,cz)), _mm256_mul_pd(r,r));
+		__m256d root = _mm256_sqrt_pd(_mm256_sub_pd(_mm256_mul_pd(half_b,half_b), c));
+
+		__m256d neg_b = _mm256_xor_pd(half_b, sign);
+		__m256d t_near = _mm256_sub_pd(neg_b, root);
+		__m256d t_far = _mm256_add_pd(neg_b, root);
+		__m256d t = _mm256_blendv_pd(t_far, t_near, _mm256_cmp_pd(t_near, zero, _CMP_GT_OQ));
+
+		__m256d hit = _mm256_and_pd(_mm256_cmp_pd(t_far, zero, _CMP_GT_OQ), _mm256_cmp_pd(t, max_t, _CMP_LT_OQ));
+		hit = _mm256_and_pd(hit, _mm256_cmp_pd(_mm256_loadu_pd(&s.obj_id[i]), skip, _CMP_NEQ_OQ));
+
+		if(_mm256_movemask_pd(hit) != 0) {
+			return true;
+		}
+	}
+
+	_mm256_zeroupper();
+	return occluded_spheres_scalar(s, i, end, ray, max_distance, skip_id);
+}
+
+SOA_AVX2_KERNEL
+static bool occluded_planes_avx2(const Plane_SoA& p, size_t begin, size_t end, const SoA_Ray& ray, double max_distance, double skip_id)
+{
+	const __m256d ox = _mm256_set1_pd(ray.ox), oy = _mm256_set1_pd(ray.oy), oz = _mm256_set1_pd(ray.oz);
+	const __m256d dx = _mm256_set1_pd(ray.dx), dy = _mm256_set1_pd(ray.dy), dz = _mm256_set1_pd(ray.dz);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d sign = _mm256_set1_pd(-0.0);
+	const __m256d min_denom = _mm256_set1_pd(1e-6);
+	const __m256d max_t = _mm256_set1_pd(max_distance);
+	const __m256d skip = _mm256_set1_pd(skip_id);
+
+	size_t i = begin;
+	for(; i + 4 <= end; i += 4) {
+		__m256d nx = _mm256_loadu_pd(&p.nx[i]), ny = _mm256_loadu_pd(&p.ny[i]), nz = _mm256_loadu_pd(&p.nz[i]);
+
+		__m256d denom = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx,dx), _mm256_mul_pd(ny,dy)), _mm256_mul_pd(nz,dz));
+		__m256d ok = _mm256_cmp_pd(_mm256_andnot_pd(sign, denom), min_denom, _CMP_GT_OQ);
+
+		__m256d vx = _mm256_sub_pd(ox, _mm256_loadu_pd(&p.cx[i]));
+		__m256d vy = _mm256_sub_pd(oy, _mm256_loadu_pd(&p.cy[i]));
+		__m256d vz = _mm256_sub_pd(oz, _mm256_loadu_pd(&p.cz[i]));
+		__m256d numer = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx,vx), _mm256_mul_pd(ny,vy)), _mm256_mul_pd(nz,vz));
+		__m256d t = _mm256_div_pd(_mm256_xor_pd(numer, sign), denom);
+
+		ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(t, zero, _CMP_GT_OQ), _mm256_cmp_pd(t, max_t, _CMP_LT_OQ)));
+		ok = _mm256_and_pd(ok, _mm256_cmp_pd(_mm256_loadu_pd(&p.obj_id[i]), skip, _CMP_NEQ_OQ));
+		if(_mm256_movemask_pd(ok) == 0) {
+			continue;
+		}
+
+		__m256d px = _mm256_add_pd(vx, _mm256_mul_pd(dx,t));
+		__m256d py = _mm256_add_pd(vy, _mm256_mul_pd(dy,t));
+		__m256d pz = _mm256_add_pd(vz, _mm256_mul_pd(dz,t));
+
+		__m256d half_l = _mm256_loadu_pd(&p.half_length[i]);
+		__m256d up_val = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(&p.hx[i]),px), _mm256_mul_pd(_mm256_loadu_pd(&p.hy[i]),py)), _mm256_mul_pd(_mm256_loadu_pd(&p.hz[i]),pz));
+		ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(up_val, half_l, _CMP_LE_OQ), _mm256_cmp_pd(up_val, _mm256_xor_pd(half_l, sign), _CMP_GE_OQ)));
+
+		__m256d half_w = _mm256_loadu_pd(&p.half_width[i]);
+		__m256d right_val = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(&p.rx[i]),px), _mm256_mul_pd(_mm256_loadu_pd(&p.ry[i]),py)), _mm256_mul_pd(_mm256_loadu_pd(&p.rz[i]),pz));
+		ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(right_val, half_w, _CMP_LE_OQ), _mm256_cmp_pd(right_val, _mm256_xor_pd(half_w, sign), _CMP_GE_OQ)));
+
+		if(_mm256_movemask_pd(ok) != 0) {
+			return true;
+		}
+	}
+
+	_mm256_zeroupper();
+	return occluded_planes_scalar(p, i, end, ray, max_distance, skip_id);
+}
+
+/* ---- AVX-512: one ray against 8 primitives ---- */
+
+SOA_AVX512_KERNEL
+static int closest_spheres_avx512(const Sphere_SoA& s, size_t begin, size_t end, const SoA_Ray& ray, double& t_max)
+{
+	const double a_s = (ray.dx*ray.dx) + (ray.dy*ray.dy) + (ray.dz*ray.dz);
+	const __m512d ox = _mm512_set1_pd(ray.ox), oy = _mm512_set1_pd(ray.oy), oz = _mm512_set1_pd(ray.oz);
+	const __m512d dx = _mm512_set1_pd(ray.dx), dy = _mm512_set1_pd(ray.dy), dz = _mm512_set1_pd(ray.dz);
+	const __m512d two = _mm512_set1_pd(2.0);
+	const __m512d four_a = _mm512_set1_pd(4.0*a_s);
+	const __m512d two_a = _mm512_set1_pd(2.0*a_s);
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d step = _mm512_set1_pd(8.0);
+
+	__m512d best_t = _mm512_set1_pd(t_max);
+	__m512d best_i = _mm512_set1_pd(-1.0);
+	__m512d lane_i = _mm512_setr_pd(begin, begin+1, begin+2, begin+3, begin+4, begin+5, begin+6, begin+7);
+
+	size_t i = begin;
+	for(; i + 8 <= end; i += 8) {
+		__m512d ocx = _mm512_sub_pd(ox, _mm512_loadu_pd(&s.cx[i]));
+		__m512d ocy = _mm512_sub_pd(oy, _mm512_loadu_pd(&s.cy[i]));
+		__m512d ocz = _mm512_sub_pd(oz, _mm512_loadu_pd(&s.cz[i]));
+		__m512d r = _mm512_loadu_pd(&s.radius[i]);
+
+		__m512d b = _mm512_mul_pd(two, _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx,ocx), _mm512_mul_pd(dy,ocy)), _mm512_mul_pd(dz,ocz)));
+		__m512d c = _mm512_sub_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx,ocx), _mm512_mul_pd(ocy,ocy)), _mm512_mul_pd(ocz,ocz)), _mm512_mul_pd(r,r));
+		__m512d D = _mm512_sub_pd(_mm512_mul_pd(b,b), _mm512_mul_pd(four_a,c));
+
+		__mmask8 valid = _mm512_cmp_pd_mask(D, zero, _CMP_GE_OQ);
+		__m512d root = _mm512_sqrt_pd(D);
+		__m512d neg_b = _mm512_sub_pd(zero, b);
+		__m512d sol_near = _mm512_div_pd(_mm512_sub_pd(neg_b, root), two_a);
+		__m512d sol_far = _mm512_div_pd(_mm512_add_pd(neg_b, root), two_a);
+		__m512d sol = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(sol_near, zero, _CMP_GT_OQ), sol_far, sol_near);
+
+		__mmask8 hit = valid & _mm512_cmp_pd_mask(sol, zero, _CMP_GT_OQ) & _mm512_cmp_pd_mask(sol, best_t, _CMP_LT_OQ);
+		best_t = _mm512_mask_blend_pd(hit, best_t, sol);
+		best_i = _mm512_mask_blend_pd(hit, best_i, lane_i);
+		lane_i = _mm512_add_pd(lane_i, step);
+	}
+
+	double lane_t[8], lane_index[8];
+	_mm512_storeu_pd(lane_t, best_t);
+	_mm512_storeu_pd(lane_index, best_i);
+	int best = reduce_lanes(lane_t, lane_index, 8, t_max);
+
+	_mm256_zeroupper();
+	int tail = closest_spheres_scalar(s, i, end, ray, t_max);
+	return (tail >= 0) ? tail : best;
+}
+
+SOA_AVX512_KERNEL
+static int closest_planes_avx512(const Plane_SoA& p, size_t begin, size_t end, const SoA_Ray& ray, double& t_max)
+{
+	const __m512d ox = _mm512_set1_pd(ray.ox), oy = _mm512_set1_pd(ray.oy), oz = _mm512_set1_pd(ray.oz);
+	const __m512d dx = _mm512_set1_pd(ray.dx), dy = _mm512_set1_pd(ray.dy), dz = _mm512_set1_pd(ray.dz);
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d min_denom = _mm512_set1_pd(1e-6);
+	const __m512d step = _mm512_set1_pd(8.0);
+
+	__m512d best_t = _mm512_set1_pd(t_max);
+	__m512d best_i = _mm512_set1_pd(-1.0);
+	__m512d lane_i = _mm512_setr_pd(begin, begin+1, begin+2, begin+3, begin+4, begin+5, begin+6, begin+7);
+
+	size_t i = begin;
+	for(; i + 8 <= end; i += 8) {
+		__m512d nx = _mm512_loadu_pd(&p.nx[i]), ny = _mm512_loadu_pd(&p.ny[i]), nz = _mm512_loadu_pd(&p.nz[i]);
+
+		__m512d denom = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(nx,dx), _mm512_mul_pd(ny,dy)), _mm512_mul_pd(nz,dz));
+		__mmask8 ok = _mm512_cmp_pd_mask(_mm512_abs_pd(denom), min_denom, _CMP_GT_OQ);
+
+		__m512d vx = _mm512_sub_pd(ox, _mm512_loadu_pd(&p.cx[i]));
+		__m512d vy = _mm512_sub_pd(oy, _mm512_loadu_pd(&p.cy[i]));
+		__m512d vz = _mm512_sub_pd(oz, _mm512_loadu_pd(&p.cz[i]));
+		__m512d numer = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(nx,vx), _mm512_mul_pd(ny,vy)), _mm512_mul_pd(nz,vz));
+		__m512d sol = _mm512_div_pd(_mm512_sub_pd(zero, numer), denom);
+
+		ok &= _mm512_cmp_pd_mask(sol, zero, _CMP_GT_OQ) & _mm512_cmp_pd_mask(sol, best_t, _CMP_LT_OQ);
+
+		__m512d px = _mm512_add_pd(_mm512_mul_pd(dx,sol), vx);
+		__m512d py = _mm512_add_pd(_mm512_mul_pd(dy,sol), vy);
+		__m512d pz = _mm512_add_pd(_mm512_mul_pd(dz,sol), vz);
+
+		__m512d half_l = _mm512_loadu_pd(&p.half_length[i]);
+		__m512d up_val = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(_mm512_loadu_pd(&p.hx[i]),px), _mm512_mul_pd(_mm512_loadu_pd(&p.hy[i]),py)), _mm512_mul_pd(_mm512_loadu_pd(&p.hz[i]),pz));
+		ok &= _mm512_cmp_pd_mask(up_val, half_l, _CMP_LE_OQ) & _mm512_cmp_pd_mask(up_val, _mm512_sub_pd(zero, half_l), _CMP_GE_OQ);
+
+		__m512d half_w = _mm512_loadu_pd(&p.half_width[i]);
+		__m512d right_val = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(_mm512_loadu_pd(&p.rx[i]),px), _mm512_mul_pd(_mm512_loadu_pd(&p.ry[i]),py)), _mm512_mul_pd(_mm512_loadu_pd(&p.rz[i]),pz));
+		ok &= _mm512_cmp_pd_mask(right_val, half_w, _CMP_LE_OQ) & _mm512_cmp_pd_mask(right_val, _mm512_sub_pd(zero, half_w), _CMP_GE_OQ);
+
+		best_t = _mm512_mask_blend_pd(ok, best_t, sol);
+		best_i = _mm512_mask_blend_pd(ok, best_i, lane_i);
+		lane_i = _mm512_add_pd(lane_i, step);
+	}
+
+	double lane_t[8], lane_index[8];
+	_mm512_storeu_pd(lane_t, best_t);
+	_mm512_storeu_pd(lane_index, best_i);
+	int best = reduce_lanes(lane_t, lane_index, 8, t_max);
+
+	_mm256_zeroupper();
+	int tail = closest_planes_scalar(p, i, end, ray, t_max);
+	return (tail >= 0) ? tail : best;
+}
+
+SOA_AVX512_KERNEL
+static bool occluded_spheres_avx512(const Sphere_SoA& s, size_t begin, size_t end, const SoA_Ray& ray, double max_distance, double skip_id)
+{
+	const __m512d ox = _mm512_set1_pd(ray.ox), oy = _mm512_set1_pd(ray.oy), oz = _mm512_set1_pd(ray.oz);
+	const __m512d dx = _mm512_set1_pd(ray.dx), dy = _mm512_set1_pd(ray.dy), dz = _mm512_set1_pd(ray.dz);
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d max_t = _mm512_set1_pd(max_distance);
+	const __m512d skip = _mm512_set1_pd(skip_id);
+
+	size_t i = begin;
+	for(; i + 8 <= end; i += 8) {
+		__m512d cx = _mm512_sub_pd(ox, _mm512_loadu_pd(&s.cx[i]));
+		__m512d cy = _mm512_sub_pd(oy, _mm512_loadu_pd(&s.cy[i]));
+		__m512d cz = _mm512_sub_pd(oz, _mm512_loadu_pd(&s.cz[i]));
+		__m512d r = _mm512_loadu_pd(&s.radius[i]);
+
+		__m512d half_b = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(cx,dx), _mm512_mul_pd(cy,dy)), _mm512_mul_pd(cz,dz));
+		__m512d c = _mm512_sub_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(cx,cx), _mm512_mul_pd(cy,cy)), _mm512_mul_pd(cz,cz)), _mm512_mul_pd(r,r));
+		__m512d D = _mm512_sub_pd(_mm512_mul_pd(half_b,half_b), c);
+		__mmask8 hit = _mm512_cmp_pd_mask(D, zero, _CMP_GE_OQ);
+		__m512d root = _mm512_sqrt_pd(D);
+
+		__m512d neg_b = _mm512_sub_pd(zero, half_b);
+		__m512d t_near = _mm512_sub_pd(neg_b, root);
+		__m512d t_far = _mm512_add_pd(neg_b, root);
+		__m512d t = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(t_near, zero, _CMP_GT_OQ), t_far, t_near);
+
+		hit &= _mm512_cmp_pd_mask(t_far, zero, _CMP_GT_OQ) & _mm512_cmp_pd_mask(t, max_t, _CMP_LT_OQ);
+		hit &= _mm512_cmp_pd_mask(_mm512_loadu_pd(&s.obj_id[i]), skip, _CMP_NEQ_OQ);
+
+		if(hit != 0) {
+			return true;
+		}
+	}
+
+	_mm256_zeroupper();
+	return occluded_spheres_scalar(s, i, end, ray, max_distance, skip_id);
+}
+
+SOA_AVX512_KERNEL
+static bool occluded_planes_avx512(const Plane_SoA& p, size_t begin, size_t end, const SoA_Ray& ray, double max_distance, double skip_id)
+{
+	const __m512d ox = _mm512_set1_pd(ray.ox), oy = _mm512_set1_pd(ray.oy), oz = _mm512_set1_pd(ray.oz);
+	const __m512d dx = _mm512_set1_pd(ray.dx), dy = _mm512_set1_pd(ray.dy), dz = _mm512_set1_pd(ray.dz);
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d min_denom = _mm512_set1_pd(1e-6);
+	const __m512d max_t = _mm512_set1_pd(max_distance);
+	const __m512d skip = _mm512_set1_pd(skip_id);
+
+	size_t i = begin;
+	for(; i + 8 <= end; i += 8) {
+		__m512d nx = _mm512_loadu_pd(&p.nx[i]), ny = _mm512_loadu_pd(&p.ny[i]), nz = _mm512_loadu_pd(&p.nz[i]);
+
+		__m512d denom = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(nx,dx), _mm512_mul_pd(ny,dy)), _mm512_mul_pd(nz,dz));
+		__mmask8 ok = _mm512_cmp_pd_mask(_mm512_abs_pd(denom), min_denom, _CMP_GT_OQ);
+
+		__m512d vx = _mm512_sub_pd(ox, _mm512_loadu_pd(&p.cx[i]));
+		__m512d vy = _mm512_sub_pd(oy, _mm512_loadu_pd(&p.cy[i]));
+		__m512d vz = _mm512_sub_pd(oz, _mm512_loadu_pd(&p.cz[i]));
+		__m512d numer = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(nx,vx), _mm512_mul_pd(ny,vy)), _mm512_mul_pd(nz,vz));
+		__m512d t = _mm512_div_pd(_mm512_sub_pd(zero, numer), denom);
+
+		ok &= _mm512_cmp_pd_mask(t, zero, _CMP_GT_OQ) & _mm512_cmp_pd_mask(t, max_t, _CMP_LT_OQ);
+		ok &= _mm512_cmp_pd_mask(_mm512_loadu_pd(&p.obj_id[i]), skip, _CMP_NEQ_OQ);
+		if(ok == 0) {
+			continue;
+		}
+
+		__m512d px = _mm512_add_pd(vx, _mm512_mul_pd(dx,t));
+		__m512d py = _mm512_add_pd(vy, _mm512_mul_pd(dy,t));
+		__m512d pz = _mm512_add_pd(vz, _mm512_mul_pd(dz,t));
+
+		__m512d half_l = _mm512_loadu_pd(&p.half_length[i]);
+		__m512d up_val = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(_mm512_loadu_pd(&p.hx[i]),px), _mm512_mul_pd(_mm512_loadu_pd(&p.hy[i]),py)), _mm512_mul_pd(_mm512_loadu_pd(&p.hz[i]),pz));
+		ok &= _mm512_cmp_pd_mask(up_val, half_l, _CMP_LE_OQ) & _mm512_cmp_pd_mask(up_val, _mm512_sub_pd(zero, half_l), _CMP_GE_OQ);
+
+		__m512d half_w = _mm512_loadu_pd(&p.half_width[i]);
+		__m512d right_val = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(_mm512_loadu_pd(&p.rx[i]),px), _mm512_mul_pd(_mm512_loadu_pd(&p.ry[i]),py)), _mm512_mul_pd(_mm512_loadu_pd(&p.rz[i]),pz));
+		ok &= _mm512_cmp_pd_mask(right_val, half_w, _CMP_LE_OQ) & _mm512_cmp_pd_mask(right_val, _mm512_sub_pd(zero, half_w), _CMP_GE_OQ);
+
+		if(ok != 0) {
+			return true;
+		}
+	}
+
+	_mm256_zeroupper();
+	return occluded_planes_scalar(p, i, end, ray, max_distance, skip_id);
+}
+
+#endif
+
+/* Best level the CPU and OS support, checked once at runtime */
+static SIMD_Level detect_simd_level()
+{
+#ifdef SOA_HAVE_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f")) {
+		return SIMD_AVX512;
+	}
+	if(__builtin_cpu_supports("avx2")) {
+		return SIMD_AVX2;
+	}
+#endif
+	return SIMD_SCALAR;
+}
+
+static const SoA_Kernels& get_soa_kernels(SIMD_Level level)
+{
+	static const SoA_Kernels scalar_kernels = { SIMD_SCALAR, 1, "scalar", closest_spheres_scalar, closest_planes_scalar, occluded_spheres_scalar, occluded_planes_scalar };
+#ifdef SOA_HAVE_X86
+	static const SoA_Kernels avx2_kernels = { SIMD_AVX2, 4, "avx2", closest_spheres_avx2, closest_planes_avx2, occluded_spheres_avx2, occluded_planes_avx2 };
+	static const SoA_Kernels avx512_kernels = { SIMD_AVX512, 8, "avx512", closest_spheres_avx512, closest_planes_avx512, occluded_spheres_avx512, occluded_planes_avx512 };
+
+	if(level > detect_simd_level()) {
+		level = detect_simd_level();
+	}
+	if(level == SIMD_AVX512) {
+		return avx512_kernels;
+	}
+	if(level == SIMD_AVX2) {
+		return avx2_kernels;
+	}
+#endif
+	return scalar_kernels;
+}
+
+/* Scene primitives sorted into per-type SoA arrays. Objects of other types
+   stay in a short list and are tested through their virtual functions. */
+class Primitive_SoA
+{
+
+	private:
+	Sphere_SoA spheres;
+	Plane_SoA planes;
+	std::vector<int> others;
+	std::vector<SoA_Ref> refs;
+	const SoA_Kernels* kernels;
+
+	public:
+	Primitive_SoA() : kernels(&get_soa_kernels(detect_simd_level())) {}
+
+	void build(const std::vector<Object*>& objects);
+	void clear() { spheres.clear(); planes.clear(); others.clear(); refs.clear(); }
+
+	void set_simd_level(SIMD_Level level) { kernels = &get_soa_kernels(level); }
+	const SoA_Kernels& get_kernels() const { return *kernels; }
+	const Sphere_SoA& get_spheres() const { return spheres; }
+	const Plane_SoA& get_planes() const { return planes; }
+	const SoA_Ref& get_ref(int prim) const { return refs[prim]; }
+
+	bool closest(const std::vector<Object*>& objects, const Vector& vec_origin, const Vector& vec_dir, Hit& hit) const;
+	bool occluded(const std::vector<Object*>& objects, const Vector& vec_origin, const Vector& unit_dir, double max_distance, int obj_id) const;
+};
+
+void Primitive_SoA::build(const std::vector<Object*>& objects)
+{
+	clear();
+	refs.resize(objects.size());
+
+	for(size_t i=0;i<objects.size();i++) {
+		if(Sphere* sphere = dynamic_cast<Sphere*>(objects[i])) {
+			refs[i].kind = SOA_SPHERE;
+			refs[i].slot = spheres.size();
+			spheres.add(sphere, i);
+		} else if(Plane* plane = dynamic_cast<Plane*>(objects[i])) {
+			refs[i].kind = SOA_PLANE;
+			refs[i].slot = planes.size();
+			planes.add(plane, i);
+		} else {
+			refs[i].kind = SOA_OTHER;
+			refs[i].slot = others.size();
+			others.push_back(i);
+		}
+	}
+}
+
+bool Primitive_SoA::closest(const std::vector<Object*>& objects, const Vector& vec_origin, const Vector& vec_dir, Hit& hit) const
+{
+	SoA_Ray ray(vec_origin, vec_dir);
+	bool found = false;
+
+	int best = kernels->closest_spheres(spheres, 0, spheres.size(), ray, hit.t);
+	if(best >= 0) {
+		hit.prim = spheres.prim[best];
+		found = true;
+	}
+
+	best = kernels->closest_planes(planes, 0, planes.size(), ray, hit.t);
+	if(best >= 0) {
+		hit.prim = planes.prim[best];
+		found = true;
+	}
+
+	for(size_t i=0;i<others.size();i++) {
+		double t;
+		if(objects[others[i]]->check_Intersection(vec_origin, vec_dir, hit.t, t, hit.part)) {
+			hit.t = t;
+			hit.prim = others[i];
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+bool Primitive_SoA::occluded(const std::vector<Object*>& objects, const Vector& vec_origin, const Vector& unit_dir, double max_distance, int obj_id) const
+{
+	SoA_Ray ray(vec_origin, unit_dir);
+
+	if(kernels->occluded_spheres(spheres, 0, spheres.size(), ray, max_distance, obj_id)) {
+		return true;
+	}
+
+	if(kernels->occluded_planes(planes, 0, planes.size(), ray, max_distance, obj_id)) {
+		return true;
+	}
+
+	for(size_t i=0;i<others.size();i++) {
+		Object* obj = objects[others[i]];
+		if(obj->object_id != obj_id && obj->check_Occlusion(vec_origin, unit_dir, max_distance)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+#endif
@@ -0,0 +1,815 @@
+#ifndef _ray_packet_h
+#define _ray_packet_h
+
+#include "vector.hpp"
+#include "objects.hpp"
+#include "primitive_set.hpp"
+#include "bvh.hpp"
+#include "primitive_soa.hpp"
+#include "render_stats.hpp"
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+
+#define PACKET_DIM 4               /* primary packets cover PACKET_DIM x PACKET_DIM pixels */
+#define PACKET_MAX_DIM 8
+#define PACKET_MAX_RAYS (PACKET_MAX_DIM*PACKET_MAX_DIM)
+#define PACKET_LANES 8             /* packets are padded to the widest kernel */
+#define PACKET_SPLIT_RAYS 2        /* at or below this many rays in a node, finish the subtree ray by ray */
+
+using namespace std;
+
+/* Rays stored lane by lane. Rays past num_rays up to the next multiple of
+   PACKET_LANES are padding and never active. For closest hit queries t_max
+   holds the best hit so far, for shadow queries the distance to the light. */
+struct Ray_Packet
+{
+	int num_rays;
+	int num_lanes;
+
+	alignas(64) double ox[PACKET_MAX_RAYS];
+	alignas(64) double oy[PACKET_MAX_RAYS];
+	alignas(64) double oz[PACKET_MAX_RAYS];
+	alignas(64) double dx[PACKET_MAX_RAYS];
+	alignas(64) double dy[PACKET_MAX_RAYS];
+	alignas(64) double dz[PACKET_MAX_RAYS];
+	alignas(64) double inv_dx[PACKET_MAX_RAYS];
+	alignas(64) double inv_dy[PACKET_MAX_RAYS];
+	alignas(64) double inv_dz[PACKET_MAX_RAYS];
+	alignas(64) double t_max[PACKET_MAX_RAYS];
+	alignas(64) double skip_id[PACKET_MAX_RAYS];
+	alignas(64) long long active[PACKET_MAX_RAYS];
+	int prim[PACKET_MAX_RAYS];
+	uint32_t part[PACKET_MAX_RAYS];
+
+	void reset(int count)
+	{
+		num_rays = count;
+		num_lanes = ((count + PACKET_LANES - 1)/PACKET_LANES)*PACKET_LANES;
+		for(int i=0;i<num_lanes;i++) {
+			ox[i] = oy[i] = oz[i] = 0.0;
+			dx[i] = dy[i] = dz[i] = 1.0;
+			inv_dx[i] = inv_dy[i] = inv_dz[i] = 1.0;
+			t_max[i] = 0.0;
+			skip_id[i] = -1.0;
+			active[i] = 0;
+			prim[i] = -1;
+			part[i] = 0;
+		}
+	}
+
+	void set_ray(int i, const Vector& origin, const Vector& dir, double t, double skip)
+	{
+		ox[i] = origin.x; oy[i] = origin.y; oz[i] = origin.z;
+		dx[i] = dir.x; dy[i] = dir.y; dz[i] = dir.z;
+		inv_dx[i] = 1.0/dir.x; inv_dy[i] = 1.0/dir.y; inv_dz[i] = 1.0/dir.z;
+		t_max[i] = t;
+		skip_id[i] = skip;
+		active[i] = -1;
+		prim[i] = -1;
+		part[i] = 0;
+	}
+
+	Vector_T<double> origin(int i) const { return Vector_T<double>(ox[i], oy[i], oz[i]); }
+	Vector_T<double> direction(int i) const { return Vector_T<double>(dx[i], dy[i], dz[i]); }
+	SoA_Ray ray(int i) const { return SoA_Ray(origin(i), direction(i)); }
+};
+
+/* Packet kernels turn the SoA kernels around: one primitive against every
+   ray whose mask entry is set. Box tests fill the mask and return how many
+   rays entered the box. Closest kernels shrink t_max and set prim, occlusion
+   kernels clear active for blocked rays. */
+struct Packet_Kernels
+{
+	SIMD_Level level;
+	const char* name;
+	int (*box_test)(const Ray_Packet& packet, const AABB& box, long long* mask);
+	void (*closest_sphere)(Ray_Packet& packet, const long long* mask, const Sphere_SoA& s, int slot, int prim);
+	void (*closest_plane)(Ray_Packet& packet, const long long* mask, const Plane_SoA& p, int slot, int prim);
+	void (*occluded_sphere)(Ray_Packet& packet, const long long* mask, const Sphere_SoA& s, int slot);
+	void (*occluded_plane)(Ray_Packet& packet, const long long* mask, const Plane_SoA& p, int slot);
+};
+
+/* ---- Scalar: ray by ray through the single primitive tests ---- */
+
+static int packet_box_test_scalar(const Ray_Packet& packet, const AABB& box, long long* mask)
+{
+	int count = 0;
+	for(int i=0;i<packet.num_lanes;i++) {
+		double t_entry;
+		mask[i] = (packet.active[i] && box.intersect(packet.origin(i), Vector_T<double>(packet.inv_dx[i], packet.inv_dy[i], packet.inv_dz[i]), packet.t_max[i], t_entry)) ? -1 : 0;
+		count += (mask[i] != 0);
+	}
+	return count;
+}
+
+static void packet_closest_sphere_scalar(Ray_Packet& packet, const long long* mask, const Sphere_SoA& s, int slot, int prim)
+{
+	for(int i=0;i<packet.num_rays;i++) {
+		if(mask[i] == 0) {
+			continue;
+		}
+		SoA_Ray ray = packet.ray(i);
+		const double a = (ray.dx*ray.dx) + (ray.dy*ray.dy) + (ray.dz*ray.dz);
+		double t;
+		if(sphere_closest_1(s, slot, ray, a, packet.t_max[i], t)) {
+			packet.t_max[i] = t;
+			packet.prim[i] = prim;
+		}
+	}
+}
+
+static void packet_closest_plane_scalar(Ray_Packet& packet, const long long* mask, const Plane_SoA& p, int slot, int prim)
+{
+	for(int i=0;i<packet.num_rays;i++) {
+		double t;
+		if(mask[i] != 0 && plane_closest_1(p, slot, packet.ray(i), packet.t_max[i], t)) {
+			packet.t_max[i] = t;
+			packet.prim[i] = prim;
+		}
+	}
+}
+
+static void packet_occluded_sphere_scalar(Ray_Packet& packet, const long long* mask, const Sphere_SoA& s, int slot)
+{
+	for(int i=0;i<packet.num_rays;i++) {
+		if(mask[i] != 0 && packet.active[i] && packet.skip_id[i] != s.obj_id[slot] && sphere_occluded_1(s, slot, packet.ray(i), packet.t_max[i])) {
+			packet.active[i] = 0;
+		}
+	}
+}
+
+static void packet_occluded_plane_scalar(Ray_Packet& packet, const long long* mask, const Plane_SoA& p, int slot)
+{
+	for(int i=0;i<packet.num_rays;i++) {
+		if(mask[i] != 0 && packet.active[i] && packet.skip_id[i] != p.obj_id[slot] && plane_occluded_1(p, slot, packet.ray(i), packet.t_max[i])) {
+			packet.active[i] = 0;
+		}
+	}
+}
+
+#ifdef SOA_HAVE_X86
+
+/* ---- AVX2: one primitive against 4 rays ---- */
+
+SOA_AVX2_KERNEL
+static int packet_box_test_avx2(const Ray_Packet& packet, const AABB& box, long long* mask)
+{
+	int count = 0;
+
+	for(int c=0;c<packet.num_lanes;c+=4) {
+		__m256d live = _mm256_castsi256_pd(_mm256_load_si256((const __m256i*)&packet.active[c]));
+		if(_mm256_movemask_pd(live) == 0) {
+			_mm256_store_si256((__m256i*)&mask[c], _mm256_setzero_si256());
+			continue;
+		}
+
+		/* Operand order reproduces std::min/std::max in AABB::intersect */
+		__m256d inv = _mm256_load_pd(&packet.inv_dx[c]);
+		__m256d o = _mm256_load_pd(&packet.ox[c]);
+		__m256d t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box.min_pt.x), o), inv);
+		__m256d t2 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box.max_pt.x), o), inv);
+		__m256d t_near = _mm256_min_pd(t2, t1);
+		__m256d t_far = _mm256_max_pd(t2, t1);
+
+		inv = _mm256_load_pd(&packet.inv_dy[c]);
+		o = _mm256_load_pd(&packet.oy[c]);
+		t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box.min_pt.y), o), inv);
+		t2 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box.max_pt.y), o), inv);
+		t_near = _mm256_max_pd(_mm256_min_pd(t2, t1), t_near);
+		t_far = _mm256_min_pd(_mm256_max_pd(t2, t1), t_far);
+
+		inv = _mm256_load_pd(&packet.inv_dz[c]);
+		o = _mm256_load_pd(&packet.oz[c]);
+		t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box.min_pt.z), o), inv);
+		t2 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box.max_pt.z), o), inv);
+		t_near = _mm256_max_pd(_mm256_min_pd(t2, t1), t_near);
+		t_far = _mm256_min_pd(_mm256_max_pd(t2, t1), t_far);
+
+		__m256d hit = _mm256_and_pd(live, _mm256_cmp_pd(t_far, t_near, _CMP_GE_OQ));
+		hit = _mm256_and_pd(hit, _mm256_cmp_pd(t_far, _mm256_setzero_pd(), _CMP_GE_OQ));
+		hit = _mm256_and_pd(hit, _mm256_cmp_pd(t_near, _mm256_load_pd(&packet.t_max[c]), _CMP_LE_OQ));
+
+		_mm256_store_si256((__m256i*)&mask[c], _mm256_castpd_si256(hit));
+		count += __builtin_popcount(_mm256_movemask_pd(hit));
+	}
+
+	return count;
+}
+
+SOA_AVX2_KERNEL
+static void packet_closest_sphere_avx2(Ray_Packet& packet, const long long* mask, const Sphere_SoA& s, int slot, int prim)
+{
+	const __m256d cx = _mm256_set1_pd(s.cx[slot]), cy = _mm256_set1_pd(s.cy[slot]), cz = _mm256_set1_pd(s.cz[slot]);
+	const __m256d r = _mm256_set1_pd(s.radius[slot]);
+	const __m256d two = _mm256_set1_pd(2.0);
+	const __m256d four = _mm256_set1_pd(4.0);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d sign = _mm256_set1_pd(-0.0);
+
+	for(int c=0;c<packet.num_lanes;c+=4) {
+		__m256d m = _mm256_castsi256_pd(_mm256_load_si256((const __m256i*)&mask[c]));
+		if(_mm256_movemask_pd(m) == 0) {
+			continue;
+		}
+
+		__m256d dx = _mm256_load_pd(&packet.dx[c]), dy = _mm256_load_pd(&packet.dy[c]), dz = _mm256_load_pd(&packet.dz[c]);
+		__m256d ocx = _mm256_sub_pd(_mm256_load_pd(&packet.ox[c]), cx);
+		__m256d ocy = _mm256_sub_pd(_mm256_load_pd(&packet.oy[c]), cy);
+		__m256d ocz = _mm256_sub_pd(_mm256_load_pd(&packet.oz[c]), cz);
+
+		__m256d a = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx,dx), _mm256_mul_pd(dy,dy)), _mm256_mul_pd(dz,dz));
+		__m256d b = _mm256_mul_pd(two, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx,ocx), _mm256_mul_pd(dy,ocy)), _mm256_mul_pd(dz,ocz)));
+		__m256d cc = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx,ocx), _mm256_mul_pd(ocy,ocy)), _mm256_mul_pd(ocz,ocz)), _mm256_mul_pd(r,r));
+		__m256d D = _mm256_sub_pd(_mm256_mul_pd(b,b), _mm256_mul_pd(_mm256_mul_pd(four,a),cc));
+
+		/* Most rays miss, skip the divisions when none of them has a root */
+		m = _mm256_and_pd(m, _mm256_cmp_pd(D, zero, _CMP_GE_OQ));
+		if(_mm256_movemask_pd(m) == 0) {
+			continue;
+		}
+
+		__m256d root = _mm256_sqrt_pd(D);
+		__m256d neg_b = _mm256_xor_pd(b, sign);
+		__m256d two_a = _mm256_mul_pd(two, a);
+		__m256d sol_near = _mm256_div_pd(_mm256_sub_pd(neg_b, root), two_a);
+		__m256d sol_far = _mm256_div_pd(_mm256_add_pd(neg_b, root), two_a);
+		__m256d sol = _mm256_blendv_pd(sol_far, sol_near, _mm256_cmp_pd(sol_near, zero, _CMP_GT_OQ));
+
+		__m256d t = _mm256_load_pd(&packet.t_max[c]);
+		__m256d hit = _mm256_and_pd(m, _mm256_and_pd(_mm256_cmp_pd(sol, zero, _CMP_GT_OQ), _mm256_cmp_pd(sol, t, _CMP_LT_OQ)));
+		_mm256_store_pd(&packet.t_max[c], _mm256_blendv_pd(t, sol, hit));
+
+		for(int bits = _mm256_movemask_pd(hit); bits != 0; bits &= bits - 1) {
+			packet.prim[c + __builtin_ctz(bits)] = prim;
+		}
+	}
+}
+
+SOA_AVX2_KERNEL
+static void packet_closest_plane_avx2(Ray_Packet& packet, const long long* mask, const Plane_SoA& p, int slot, int prim)
+{
+	const __m256d cx = _mm256_set1_pd(p.cx[slot]), cy = _mm256_set1_pd(p.cy[slot]), cz = _mm256_set1_pd(p.cz[slot]);
+	const __m256d nx = _mm256_set1_pd(p.nx[slot]), ny = _mm256_set1_pd(p.ny[slot]), nz = _mm256_set1_pd(p.nz[slot]);
+	const __m256d hx = _mm256_set1_pd(p.hx[slot]), hy = _mm256_set1_pd(p.hy[slot]), hz = _mm256_set1_pd(p.hz[slot]);
+	const __m256d rx = _mm256_set1_pd(p.rx[slot]), ry = _mm256_set1_pd(p.ry[slot]), rz = _mm256_set1_pd(p.rz[slot]);
+	const __m256d half_l = _mm256_set1_pd(p.half_length[slot]), neg_half_l = _mm256_set1_pd(-p.half_length[slot]);
+	const __m256d half_w = _mm256_set1_pd(p.half_width[slot]), neg_half_w = _mm256_set1_pd(-p.half_width[slot]);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d sign = _mm256_set1_pd(-0.0);
+	const __m256d min_denom = _mm256_set1_pd(1e-6);
+
+	for(int c=0;c<packet.num_lanes;c+=4) {
+		__m256d ok = _mm256_castsi256_pd(_mm256_load_si256((const __m256i*)&mask[c]));
+		if(_mm256_movemask_pd(ok) == 0) {
+			continue;
+		}
+
+		__m256d dx = _mm256_load_pd(&packet.dx[c]), dy = _mm256_load_pd(&packet.dy[c]), dz = _mm256_load_pd(&packet.dz[c]);
+		__m256d denom = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx,dx), _mm256_mul_pd(ny,dy)), _mm256_mul_pd(nz,dz));
+		ok = _mm256_and_pd(ok, _mm256_cmp_pd(_mm256_andnot_pd(sign, denom), min_denom, _CMP_GT_OQ));
+
+		__m256d vx = _mm256_sub_pd(_mm256_load_pd(&packet.ox[c]), cx);
+		__m256d vy = _mm256_sub_pd(_mm256_load_pd(&packet.oy[c]), cy);
+		__m256d vz = _mm256_sub_pd(_mm256_load_pd(&packet.oz[c]), cz);
+		__m256d numer = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx,vx), _mm256_mul_pd(ny,vy)), _mm256_mul_pd(nz,vz));
+		__m256d sol = _mm256_div_pd(_mm256_xor_pd(numer, sign), denom);
+
+		__m256d t = _mm256_load_pd(&packet.t_max[c]);
+		ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(sol, zero, _CMP_GT_OQ), _mm256_cmp_pd(sol, t, _CMP_LT_OQ)));
+
+		__m256d px = _mm256_add_pd(_mm256_mul_pd(dx,sol), vx);
+		__m256d py = _mm256_add_pd(_mm256_mul_pd(dy,sol), vy);
+		__m256d pz = _mm256_add_pd(_mm256_mul_pd(dz,sol), vz);
+
+		__m256d up_val = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(hx,px), _mm256_mul_pd(hy,py)), _mm256_mul_pd(hz,pz));
+		ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(up_val, half_l, _CMP_LE_OQ), _mm256_cmp_pd(up_val, neg_half_l, _CMP_GE_OQ)));
+
+		__m256d right_val = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(rx,px), _mm256_mul_pd(ry,py)), _mm256_mul_pd(rz,pz));
+		ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(right_val, half_w, _CMP_LE_OQ), _mm256_cmp_pd(right_val, neg_half_w, _CMP_GE_OQ)));
+
+		_mm256_store_pd(&packet.t_max[c], _mm256_blendv_pd(t, sol, ok));
+
+		for(int bits = _mm256_movemask_pd(ok); bits != 0; bits &= bits - 1) {
+			packet.prim[c + __builtin_ctz(bits)] = prim;
+		}
+	}
+}
+
+SOA_AVX2_KERNEL
+static void packet_occluded_sphere_avx2(Ray_Packet& packet, const long long* mask, const Sphere_SoA& s, int slot)
+{
+	const __m256d cx = _mm256_set1_pd(s.cx[slot]), cy = _mm256_set1_pd(s.cy[slot]), cz = _mm256_set1_pd(s.cz[slot]);
+	const __m256d r = _mm256_set1_pd(s.radius[slot]);
+	const __m256d id = _mm256_set1_pd(s.obj_id[slot]);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d sign = _mm256_set1_pd(-0.0);
+
+	for(int c=0;c<packet.num_lanes;c+=4) {
+		__m256d live = _mm256_castsi256_pd(_mm256_load_si256((const __m256i*)&packet.active[c]));
+		__m256d m = _mm256_and_pd(live, _mm256_castsi256_pd(_mm256_load_si256((const __m256i*)&mask[c])));
+		m = _mm256_and_pd(m, _mm256_cmp_pd(_mm256_load_pd(&packet.skip_id[c]), id, _CMP_NEQ_OQ));
+		if(_mm256_movemask_pd(m) == 0) {
+			continue;
+		}
+
+		__m256d ox = _mm256_sub_pd(_mm256_load_pd(&packet.ox[c]), cx);
+		__m256d oy = _mm256_sub_pd(_mm256_load_pd(&packet.oy[c]), cy);
+		__m256d oz = _mm256_sub_pd(_mm256_load_pd(&packet.oz[c]), cz);
+
+		__m256d half_b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ox,_mm256_load_pd(&packet.dx[c])), _mm256_mul_pd(oy,_mm256_load_pd(&packet.dy[c]))), _mm256_mul_pd(oz,_mm256_load_pd(&packet.dz[c])));
+		__m256d cc = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ox,ox), _mm256_mul_pd(oy,oy)), _mm256_mul_pd(oz,oz)), _mm256_mul_pd(r,r));
+		__m256d D = _mm256_sub_pd(_mm256_mul_pd(half_b,half_b), cc);
+		m = _mm256_and_pd(m, _mm256_cmp_pd(D, zero, _CMP_GE_OQ));
+		if(_mm256_movemask_pd(m) == 0) {
+			continue;
+		}
+		__m256d root = _mm256_sqrt_pd(D);
+
+		__m256d neg_b = _mm256_xor_pd(half_b, sign);
+		__m256d t_near = _mm256_sub_pd(neg_b, root);
+		__m256d t_far = _mm256_add_pd(neg_b, root);
+		__m256d t = _mm256_blendv_pd(t_far, t_near, _mm256_cmp_pd(t_near, zero, _CMP_GT_OQ));
+
+		__m256d hit = _mm256_and_pd(m, _mm256_cmp_pd(t_far, zero, _CMP_GT_OQ));
+		hit = _mm256_and_pd(hit, _mm256_cmp_pd(t, _mm256_load_pd(&packet.t_max[c]), _CMP_LT_OQ));
+		_mm256_store_si256((__m256i*)&packet.active[c], _mm256_castpd_si256(_mm256_andnot_pd(hit, live)));
+	}
+}
+
+SOA_AVX2_KERNEL
+static void packet_occluded_plane_avx2(Ray_Packet& packet, const long long* mask, const Plane_SoA& p, int slot)
+{
+	const __m256d cx = _mm256_set1_pd(p.cx[slot]), cy = _mm256_set1_pd(p.cy[slot]), cz = _mm256_set1_pd(p.cz[slot]);
+	const __m256d nx = _mm256_set1_pd(p.nx[slot]), ny = _mm256_set1_pd(p.ny[slot]), nz = _mm256_set1_pd(p.nz[slot]);
+	const __m256d hx = _mm256_set1_pd(p.hx[slot]), hy = _mm256_set1_pd(p.hy[slot]), hz = _mm256_set1_pd(p.hz[slot]);
+	const __m256d rx = _mm256_set1_pd(p.rx[slot]), ry = _mm256_set1_pd(p.ry[slot]), rz = _mm256_set1_pd(p.rz[slot]);
+	const __m256d half_l = _mm256_set1_pd(p.half_length[slot]), neg_half_l = _mm256_set1_pd(-p.half_length[slot]);
+	const __m256d half_w = _mm256_set1_pd(p.half_width[slot]), neg_half_w = _mm256_set1_pd(-p.half_width[slot]);
+	const __m256d id = _mm256_set1_pd(p.obj_id[slot]);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d sign = _mm256_set1_pd(-0.0);
+	const __m256d min_denom = _mm256_set1_pd(1e-6);
+
+	for(int c=0;c<packet.num_lanes;c+=4) {
+		__m256d live = _mm256_castsi256_pd(_mm256_load_si256((const __m256i*)&packet.active[c]));
+		__m256d ok = _mm256_and_pd(live, _mm256_castsi256_pd(_mm256_load_si256((const __m256i*)&mask[c])));
+		ok = _mm256_and_pd(ok, _mm256_cmp_pd(_mm256_load_pd(&packet.skip_id[c]), id, _CMP_NEQ_OQ));
+		if(_mm256_movemask_pd(ok) == 0) {
+			continue;
+		}
+
+		__m256d dx = _mm256_load_pd(&packet.dx[c]), dy = _mm256_load_pd(&packet.dy[c]), dz = _mm256_load_pd(&packet.dz[c]);
+		__m256d denom = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx,dx), _mm256_mul_pd(ny,dy)), _mm256_mul_pd(nz,dz));
+		ok = _mm256_and_pd(ok, _mm256_cmp_pd(_mm256_andnot_pd(sign, denom), min_denom, _CMP_GT_OQ));
+
+		__m256d vx = _mm256_sub_pd(_mm256_load_pd(&packet.ox[c]), cx);
+		__m256d vy = _mm256_sub_pd(_mm256_load_pd(&packet.oy[c]), cy);
+		__m256d vz = _mm256_sub_pd(_mm256_load_pd(&packet.oz[c]), cz);
+		__m256d numer = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx,vx), _mm256_mul_pd(ny,vy)), _mm256_mul_pd(nz,vz));
+		__m256d t = _mm256_div_pd(_mm256_xor_pd(numer, sign), denom);
+
+		ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(t, zero, _CMP_GT_OQ), _mm256_cmp_pd(t, _mm256_load_pd(&packet.t_max[c]), _CMP_LT_OQ)));
+
+		__m256d px = _mm256_add_pd(vx, _mm256_mul_pd(dx,t));
+		__m256d py = _mm256_add_pd(vy, _mm256_mul_pd(dy,t));
+		__m256d pz = _mm256_add_pd(vz, _mm256_mul_pd(dz,t));
+
+		__m256d up_val = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(hx,px), _mm256_mul_pd(hy,py)), _mm256_mul_pd(hz,pz));
+		ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(up_val, half_l, _CMP_LE_OQ), _mm256_cmp_pd(up_val, neg_half_l, _CMP_GE_OQ)));
+
+		__m256d right_val = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(rx,px), _mm256_mul_pd(ry,py)), _mm256_mul_pd(rz,pz));
+		ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(right_val, half_w, _CMP_LE_OQ), _mm256_cmp_pd(right_val, neg_half_w, _CMP_GE_OQ)));
+
+		_mm256_store_si256((__m256i*)&packet.active[c], _mm256_castpd_si256(_mm256_andnot_pd(ok, live)));
+	}
+}
+
+/* ---- AVX-512: one primitive against 8 rays ---- */
+
+SOA_AVX512_KERNEL
+static inline __mmask8 packet_load_mask_avx512(const long long* mask)
+{
+	__m512i m = _mm512_load_si512((const void*)mask);
+	return _mm512_test_epi64_mask(m, m);
+}
+
+SOA_AVX512_KERNEL
+static int packet_box_test_avx512(const Ray_Packet& packet, const AABB& box, long long* mask)
+{
+	int count = 0;
+
+	for(int c=0;c<packet.num_lanes;c+=8) {
+		__mmask8 live = packet_load_mask_avx512(&packet.active[c]);
+		if(live == 0) {
+			_mm512_store_si512((void*)&mask[c], _mm512_setzero_si512());
+			continue;
+		}
+
+		/* Operand order reproduces std::min/std::max in AABB::intersect */
+		__m512d inv = _mm512_load_pd(&packet.inv_dx[c]);
+		__m512d o = _mm512_load_pd(&packet.ox[c]);
+		__m512d t1 = _mm512_mul_pd(_mm512_sub_pd(_mm512_set1_pd(box.min_pt.x), o), inv);
+		__m512d t2 = _mm512_mul_pd(_mm512_sub_pd(_mm512_set1_pd(box.max_pt.x), o), inv);
+		__m512d t_near = _mm512_min_pd(t2, t1);
+		__m512d t_far = _mm512_max_pd(t2, t1);
+
+		inv = _mm512_load_pd(&packet.inv_dy[c]);
+		o = _mm512_load_pd(&packet.oy[c]);
+		t1 = _mm512_mul_pd(_mm512_sub_pd(_mm512_set1_pd(box.min_pt.y), o), inv);
+		t2 = _mm512_mul_pd(_mm512_sub_pd(_mm512_set1_pd(box.max_pt.y), o), inv);
+		t_near = _mm512_max_pd(_mm512_min_pd(t2, t1), t_near);
+		t_far = _mm512_min_pd(_mm512_max_pd(t2, t1), t_far);
+
+		inv = _mm512_load_pd(&packet.inv_dz[c]);
+		o = _mm512_load_pd(&packet.oz[c]);
+		t1 = _mm512_mul_pd(_mm512_sub_pd(_mm512_set1_pd(box.min_pt.z), o), inv);
+		t2 = _mm512_mul_pd(_mm512_sub_pd(_mm512_set1_pd(box.max_pt.z), o), inv);
+		t_near = _mm512_max_pd(_mm512_min_pd(t2, t1), t_near);
+		t_far = _mm512_min_pd(_mm512_max_pd(t2, t1), t_far);
+
+		__mmask8 hit = live & _mm512_cmp_pd_mask(t_far, t_near, _CMP_GE_OQ) & _mm512_cmp_pd_mask(t_far, _mm512_setzero_pd(), _CMP_GE_OQ);
+		hit &= _mm512_cmp_pd_mask(t_near, _mm512_load_pd(&packet.t_max[c]), _CMP_LE_OQ);
+
+		_mm512_store_si512((void*)&mask[c], _mm512_maskz_mov_epi64(hit, _mm512_set1_epi64(-1)));
+		count += __builtin_popcount(hit);
+	}
+
+	return count;
+}
+
+SOA_AVX512_KERNEL
+static void packet_closest_sphere_avx512(Ray_Packet& packet, const long long* mask, const Sphere_SoA& s, int slot, int prim)
+{
+	const __m512d cx = _mm512_set1_pd(s.cx[slot]), cy = _mm512_set1_pd(s.cy[slot]), cz = _mm512_set1_pd(s.cz[slot]);
+	const __m512d r = _mm512_set1_pd(s.radius[slot]);
+	const __m512d two = _mm512_set1_pd(2.0);
+	const __m512d four = _mm512_set1_pd(4.0);
+	const __m512d zero = _mm512_setzero_pd();
+
+	for(int c=0;c<packet.num_lanes;c+=8) {
+		__mmask8 m = packet_load_mask_avx512(&mask[c]);
+		if(m == 0) {
+			continue;
+		}
+
+		__m512d dx = _mm512_load_pd(&packet.dx[c]), dy = _mm512_load_pd(&packet.dy[c]), dz = _mm512_load_pd(&packet.dz[c]);
+		__m512d ocx = _mm512_sub_pd(_mm512_load_pd(&packet.ox[c]), cx);
+		__m512d ocy = _mm512_sub_pd(_mm512_load_pd(&packet.oy[c]), cy);
+		__m512d ocz = _mm512_sub_pd(_mm512_load_pd(&packet.oz[c]), cz);
+
+		__m512d a = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx,dx), _mm512_mul_pd(dy,dy)), _mm512_mul_pd(dz,dz));
+		__m512d b = _mm512_mul_pd(two, _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx,ocx), _mm512_mul_pd(dy,ocy)), _mm512_mul_pd(dz,ocz)));
+		__m512d cc = _mm512_sub_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx,ocx), _mm512_mul_pd(ocy,ocy)), _mm512_mul_pd(ocz,ocz)), _mm512_mul_pd(r,r));
+		__m512d D = _mm512_sub_pd(_mm512_mul_pd(b,b), _mm512_mul_pd(_mm512_mul_pd(four,a),cc));
+
+		/* Most rays miss, skip the divisions when none of them has a root */
+		m &= _mm512_cmp_pd_mask(D, zero, _CMP_GE_OQ);
+		if(m == 0) {
+			continue;
+		}
+
+		__m512d root = _mm512_sqrt_pd(D);
+		__m512d neg_b = _mm512_sub_pd(zero, b);
+		__m512d two_a = _mm512_mul_pd(two, a);
+		__m512d sol_near = _mm512_div_pd(_mm512_sub_pd(neg_b, root), two_a);
+		__m512d sol_far = _mm512_div_pd(_mm512_add_pd(neg_b, root), two_a);
+		__m512d sol = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(sol_near, zero, _CMP_GT_OQ), sol_far, sol_near);
+
+		__mmask8 hit = m & _mm512_cmp_pd_mask(sol, zero, _CMP_GT_OQ) & _mm512_cmp_pd_mask(sol, _mm512_load_pd(&packet.t_max[c]), _CMP_LT_OQ);
+		_mm512_mask_store_pd(&packet.t_max[c], hit, sol);
+
+		for(unsigned bits = hit; bits != 0; bits &= bits - 1) {
+			packet.prim[c + __builtin_ctz(bits)] = prim;
+		}
+	}
+}
+
+SOA_AVX512_KERNEL
+static void packet_closest_plane_avx512(Ray_Packet& packet, const long long* mask, const Plane_SoA& p, int slot, int prim)
+{
+	const __m512d cx = _mm512_set1_pd(p.cx[slot]), cy = _mm512_set1_pd(p.cy[slot]), cz = _mm512_set1_pd(p.cz[slot]);
+	const __m512d nx = _mm512_set1_pd(p.nx[slot]), ny = _mm512_set1_pd(p.ny[slot]), nz = _mm512_set1_pd(p.nz[slot]);
+	const __m512d hx = _mm512_set1_pd(p.hx[slot]), hy = _mm512_set1_pd(p.hy[slot]), hz = _mm512_set1_pd(p.hz[slot]);
+	const __m512d rx = _mm512_set1_pd(p.rx[slot]), ry = _mm512_set1_pd(p.ry[slot]), rz = _mm512_set1_pd(p.rz[slot]);
+	const __m512d half_l = _mm512_set1_pd(p.half_length[slot]), neg_half_l = _mm512_set1_pd(-p.half_length[slot]);
+	const __m512d half_w = _mm512_set1_pd(p.half_width[slot]), neg_half_w = _mm512_set1_pd(-p.half_width[slot]);
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d min_denom = _mm512_set1_pd(1e-6);
+
+	for(int c=0;c<packet.num_lanes;c+=8) {
+		__mmask8 ok = packet_load_mask_avx512(&mask[c]);
+		if(ok == 0) {
+			continue;
+		}
+
+		__m512d dx = _mm512_load_pd(&packet.dx[c]), dy = _mm512_load_pd(&packet.dy[c]), dz = _mm512_load_pd(&packet.dz[c]);
+		__m512d denom = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(nx,dx), _mm512_mul_pd(ny,dy)), _mm512_mul_pd(nz,dz));
+		ok &= _mm512_cmp_pd_mask(_mm512_abs_pd(denom), min_denom, _CMP_GT_OQ);
+
+		__m512d vx = _mm512_sub_pd(_mm512_load_pd(&packet.ox[c]), cx);
+		__m512d vy = _mm512_sub_pd(_mm512_load_pd(&packet.oy[c]), cy);
+		__m512d vz = _mm512_sub_pd(_mm512_load_pd(&packet.oz[c]), cz);
+		__m512d numer = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(nx,vx), _mm512_mul_pd(ny,vy)), _mm512_mul_pd(nz,vz));
+		__m512d sol = _mm512_div_pd(_mm512_sub_pd(zero, numer), denom);
+
+		ok &= _mm512_cmp_pd_mask(sol, zero, _CMP_GT_OQ) & _mm512_cmp_pd_mask(sol, _mm512_load_pd(&packet.t_max[c]), _CMP_LT_OQ);
+
+		__m512d px = _mm512_add_pd(_mm512_mul_pd(dx,sol), vx);
+		__m512d py = _mm512_add_pd(_mm512_mul_pd(dy,sol), vy);
+		__m512d pz = _mm512_add_pd(_mm512_mul_pd(dz,sol), vz);
+
+		__m512d up_val = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(hx,px), _mm512_mul_pd(hy,py)), _mm512_mul_pd(hz,pz));
+		ok &= _mm512_cmp_pd_mask(up_val, half_l, _CMP_LE_OQ) & _mm512_cmp_pd_mask(up_val, neg_half_l, _CMP_GE_OQ);
+
+		__m512d right_val = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(rx,px), _mm512_mul_pd(ry,py)), _mm512_mul_pd(rz,pz));
+		ok &= _mm512_cmp_pd_mask(right_val, half_w, _CMP_LE_OQ) & _mm512_cmp_pd_mask(right_val, neg_half_w, _CMP_GE_OQ);
+
+		_mm512_mask_store_pd(&packet.t_max[c], ok, sol);
+
+		for(unsigned bits = ok; bits != 0; bits &= bits - 1) {
+			packet.prim[c + __builtin_ctz(bits)] = prim;
+		}
+	}
+}
+
+SOA_AVX512_KERNEL
+static void packet_occluded_sphere_avx512(Ray_Packet& packet, const long long* mask, const Sphere_SoA& s, int slot)
+{
+	const __m512d cx = _mm512_set1_pd(s.cx[slot]), cy = _mm512_set1_pd(s.cy[slot]), cz = _mm512_set1_pd(s.cz[slot]);
+	const __m512d r = _mm512_set1_pd(s.radius[slot]);
+	const __m512d id = _mm512_set1_pd(s.obj_id[slot]);
+	const __m512d zero = _mm512_setzero_pd();
+
+	for(int c=0;c<packet.num_lanes;c+=8) {
+		__mmask8 m = packet_load_mask_avx512(&mask[c]) & packet_load_mask_avx512(&packet.active[c]);
+		m &= _mm512_cmp_pd_mask(_mm512_load_pd(&packet.skip_id[c]), id, _CMP_NEQ_OQ);
+		if(m == 0) {
+			continue;
+		}
+
+		__m512d ox = _mm512_sub_pd(_mm512_load_pd(&packet.ox[c]), cx);
+		__m512d oy = _mm512_sub_pd(_mm512_load_pd(&packet.oy[c]), cy);
+		__m512d oz = _mm512_sub_pd(_mm512_load_pd(&packet.oz[c]), cz);
+
+		__m512d half_b = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ox,_mm512_load_pd(&packet.dx[c])), _mm512_mul_pd(oy,_mm512_load_pd(&packet.dy[c]))), _mm512_mul_pd(oz,_mm512_load_pd(&packet.dz[c])));
+		__m512d cc = _mm512_sub_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ox,ox), _mm512_mul_pd(oy,oy)), _mm512_mul_pd(oz,oz)), _mm512_mul_pd(r,r));
+		__m512d D = _mm512_sub_pd(_mm512_mul_pd(half_b,half_b), cc);
+		m &= _mm512_cmp_pd_mask(D, zero, _CMP_GE_OQ);
+		if(m == 0) {
+			continue;
+		}
+		__m512d root = _mm512_sqrt_pd(D);
+
+		__m512d neg_b = _mm512_sub_pd(zero, half_b);
+		__m512d t_near = _mm512_sub_pd(neg_b, root);
+		__m512d t_far = _mm512_add_pd(neg_b, root);
+		__m512d t = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(t_near, zero, _CMP_GT_OQ), t_far, t_near);
+
+		__mmask8 hit = m & _mm512_cmp_pd_mask(t_far, zero, _CMP_GT_OQ) & _mm512_cmp_pd_mask(t, _mm512_load_pd(&packet.t_max[c]), _CMP_LT_OQ);
+		_mm512_mask_store_epi64((void*)&packet.active[c], hit, _mm512_setzero_si512());
+	}
+}
+
+SOA_AVX512_KERNEL
+static void packet_occluded_plane_avx512(Ray_Packet& packet, const long long* mask, const Plane_SoA& p, int slot)
+{
+	const __m512d cx = _mm512_set1_pd(p.cx[slot]), cy = _mm512_set1_pd(p.cy[slot]), cz = _mm512_set1_pd(p.cz[slot]);
+	const __m512d nx = _mm512_set1_pd(p.nx[slot]), ny = _mm512_set1_pd(p.ny[slot]), nz = _mm512_set1_pd(p.nz[slot]);
+	const __m512d hx = _mm512_set1_pd(p.hx[slot]), hy = _mm512_set1_pd(p.hy[slot]), hz = _mm512_set1_pd(p.hz[slot]);
+	const __m512d rx = _mm512_set1_pd(p.rx[slot]), ry = _mm512_set1_pd(p.ry[slot]), rz = _mm512_set1_pd(p.rz[slot]);
+	const __m512d half_l = _mm512_set1_pd(p.half_length[slot]), neg_half_l = _mm512_set1_pd(-p.half_length[slot]);
+	const __m512d half_w = _mm512_set1_pd(p.half_width[slot]), neg_half_w = _mm512_set1_pd(-p.half_width[slot]);
+	const __m512d id = _mm512_set1_pd(p.obj_id[slot]);
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d min_denom = _mm512_set1_pd(1e-6);
+
+	for(int c=0;c<packet.num_lanes;c+=8) {
+		__mmask8 ok = packet_load_mask_avx512(&mask[c]) & packet_load_mask_avx512(&packet.active[c]);
+		ok &= _mm512_cmp_pd_mask(_mm512_load_pd(&packet.skip_id[c]), id, _CMP_NEQ_OQ);
+		if(ok == 0) {
+			continue;
+		}
+
+		__m512d dx = _mm512_load_pd(&packet.dx[c]), dy = _mm512_load_pd(&packet.dy[c]), dz = _mm512_load_pd(&packet.dz[c]);
+		__m512d denom = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(nx,dx), _mm512_mul_pd(ny,dy)), _mm512_mul_pd(nz,dz));
+		ok &= _mm512_cmp_pd_mask(_mm512_abs_pd(denom), min_denom, _CMP_GT_OQ);
+
+		__m512d vx = _mm512_sub_pd(_mm512_load_pd(&packet.ox[c]), cx);
+		__m512d vy = _mm512_sub_pd(_mm512_load_pd(&packet.oy[c]), cy);
+		__m512d vz = _mm512_sub_pd(_mm512_load_pd(&packet.oz[c]), cz);
+		__m512d numer = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(nx,vx), _mm512_mul_pd(ny,vy)), _mm512_mul_pd(nz,vz));
+		__m512d t = _mm512_div_pd(_mm512_sub_pd(zero, numer), denom);
+
+		ok &= _mm512_cmp_pd_mask(t, zero, _CMP_GT_OQ) & _mm512_cmp_pd_mask(t, _mm512_load_pd(&packet.t_max[c]), _CMP_LT_OQ);
+		if(ok == 0) {
+			continue;
+		}
+
+		__m512d px = _mm512_add_pd(vx, _mm512_mul_pd(dx,t));
+		__m512d py = _mm512_add_pd(vy, _mm512_mul_pd(dy,t));
+		__m512d pz = _mm512_add_pd(vz, _mm512_mul_pd(dz,t));
+
+		__m512d up_val = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(hx,px), _mm512_mul_pd(hy,py)), _mm512_mul_pd(hz,pz));
+		ok &= _mm512_cmp_pd_mask(up_val, half_l, _CMP_LE_OQ) & _mm512_cmp_pd_mask(up_val, neg_half_l, _CMP_GE_OQ);
+
+		__m512d right_val = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(rx,px), _mm512_mul_pd(ry,py)), _mm512_mul_pd(rz,pz));
+		ok &= _mm512_cmp_pd_mask(right_val, half_w, _CMP_LE_OQ) & _mm512_cmp_pd_mask(right_val, neg_half_w, _CMP_GE_OQ);
+
+		_mm512_mask_store_epi64((void*)&packet.active[c], ok, _mm512_setzero_si512());
+	}
+}
+
+#endif
+
+/* Packets run at the same level the SoA kernels were set to */
+static const Packet_Kernels& get_packet_kernels(SIMD_Level level)
+{
+	static const Packet_Kernels scalar_kernels = { SIMD_SCALAR, "scalar", packet_box_test_scalar, packet_closest_sphere_scalar, packet_closest_plane_scalar, packet_occluded_sphere_scalar, packet_occluded_plane_scalar };
+#ifdef SOA_HAVE_X86
+	static const Packet_Kernels avx2_kernels = { SIMD_AVX2, "avx2", packet_box_test_avx2, packet_closest_sphere_avx2, packet_closest_plane_avx2, packet_occluded_sphere_avx2, packet_occluded_plane_avx2 };
+	static const Packet_Kernels avx512_kernels = { SIMD_AVX512, "avx512", packet_box_test_avx512, packet_closest_sphere_avx512, packet_closest_plane_avx512, packet_occluded_sphere_avx512, packet_occluded_plane_avx512 };
+
+	if(level == SIMD_AVX512) {
+		return avx512_kernels;
+	}
+	if(level == SIMD_AVX2) {
+		return avx2_kernels;
+	}
+#endif
+	return scalar_kernels;
+}
+
+/* Children order for the whole packet, taken from its first live ray along
+   the axis that separates the two child boxes the most */
+static void packet_child_order(const Ray_Packet& packet, const long long* mask, const BVH_Node& left, const BVH_Node& right, bool& left_first)
+{
+	Vector_T<double> lc = left.bounds.centroid();
+	Vector_T<double> rc = right.bounds.centroid();
+	Vector_T<double> sep = rc - lc;
+
+	int ray = 0;
+	while(ray < packet.num_rays && mask[ray] == 0) {
+		ray++;
+	}
+
+	double dir_along;
+	if(fabs(sep.x) >= fabs(sep.y) && fabs(sep.x) >= fabs(sep.z)) {
+		dir_along = packet.dx[ray] * sep.x;
+	} else if(fabs(sep.y) >= fabs(sep.z)) {
+		dir_along = packet.dy[ray] * sep.y;
+	} else {
+		dir_along = packet.dz[ray] * sep.z;
+	}
+
+	left_first = (dir_along >= 0.0);
+}
+
+/* Closest hit for every active ray. prim[i] receives the obj_list index
+   of the hit (or stays -1) and t_max[i] its ray parameter. */
+void trace_packet_closest(const BVH& bvh, const Primitive_SoA& prims, Scene_Primitive_Set& objects, Ray_Packet& packet)
+{
+	if(bvh.empty()) {
+		return;
+	}
+
+	const Packet_Kernels& kernels = get_packet_kernels(prims.get_kernels().level);
+	alignas(64) long long mask[PACKET_MAX_RAYS];
+	uint32_t stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while(stack_size > 0) {
+
+		const uint32_t node_index = stack[--stack_size];
+		const BVH_Node& node = bvh.nodes[node_index];
+
+		int count = kernels.box_test(packet, node.bounds, mask);
+		if(count == 0) {
+			continue;
+		}
+
+		if(node.is_leaf()) {
+			STAT_ADD(primitive_tests, (uint64_t)node.count * count);
+			for(uint32_t i=0;i<node.count;i++) {
+				const uint32_t prim = bvh.prim_indices[node.left_first + i];
+				const SoA_Ref& ref = prims.get_ref(prim);
+
+				if(ref.kind == SOA_SPHERE) {
+					kernels.closest_sphere(packet, mask, prims.get_spheres(), ref.slot, prim);
+				} else if(ref.kind == SOA_PLANE) {
+					kernels.closest_plane(packet, mask, prims.get_planes(), ref.slot, prim);
+				} else {
+					for(int r=0;r<packet.num_rays;r++) {
+						double t;
+						if(mask[r] && objects.intersect(prim, packet.origin(r), packet.direction(r), packet.t_max[r], t, packet.part[r])) {
+							packet.t_max[r] = t;
+							packet.prim[r] = prim;
+						}
+					}
+				}
+			}
+			continue;
+		}
+
+		if(count <= PACKET_SPLIT_RAYS) {
+			/* The packet has fallen apart here, the remaining rays go on alone */
+			for(int r=0;r<packet.num_rays;r++) {
+				if(mask[r] == 0) {
+					continue;
+				}
+				Vector_T<double> origin = packet.origin(r);
+				Vector_T<double> dir = packet.direction(r);
+				bvh.traverse(origin, dir, packet.t_max[r], [&](uint32_t prim, double& t_limit) {
+					STAT_ADD(primitive_tests, 1);
+					double t;
+					if(objects.intersect(prim, origin, dir, t_limit, t, packet.part[r])) {
+						t_limit = t;
+						packet.prim[r] = prim;
+					}
+					return false;
+				}, node_index);
+			}
+			continue;
+		}
+
+		bool left_first;
+		packet_child_order(packet, mask, bvh.nodes[node.left_first], bvh.nodes[node.left_first + 1], left_first);
+
+		/* Far child goes on the stack first */
+		stack[stack_size++] = left_first ? node.left_first + 1 : node.left_first;
+		stack[stack_size++] = left_first ? node.left_first : node.left_first + 1;
+	}
+}
+
+/* Shadow packet: active rays that reach their t_max unblocked stay active,
+   occluded rays are switched off */
+void trace_packet_occluded(const BVH& bvh, const Primitive_SoA& prims, Scene_Primitive_Set& objects, Ray_Packet& packet)
+{
+	if(bvh.empty()) {
+		return;
+	}
+
+	const Packet_Kernels& kernels = get_packet_kernels(prims.get_kernels().level);
+	alignas(64) long long mask[PACKET_MAX_RAYS];
+	uint32_t stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while(stack_size > 0) {
+
+		const uint32_t node_index = stack[--stack_size];
+		const BVH_Node& node = bvh.nodes[node_index];
+
+		int count = kernels.box_test(packet, node.bounds, mask);
+		if(count == 0) {
+			continue;
+		}
+
+		if(node.is_leaf()) {
+			STAT_ADD(primitive_tests, (uint64_t)node.count * count);
+			for(uint32_t i=0;i<node.count;i++) {
+				const uint32_t prim = bvh.prim_indices[node.left_first + i];
+				const SoA_Ref& ref = prims.get_ref(prim);
+
+				if(ref.kind == SOA_SPHERE) {
+					kernels.occluded_sphere(packet, mask, prims.get_spheres(), ref.slot);
+				} else if(ref.kind == SOA_PLANE) {
+					kernels.occluded_plane(packet, mask, prims.get_planes(), ref.slot);
+				} else {
+					for(int r=0;r<packet.num_rays;r++) {
+						if(mask[r] && packet.active[r] && objects.occluded(prim, packet.origin(r), packet.direction(r), packet.t_max[r], packet.skip_id[r])) {
+							packet.active[r] = 0;
+						}
+					}
+				}
+			}
+			continue;
+		}
+
+		if(count <= PACKET_SPLIT_RAYS) {
+			for(int r=0;r<packet.num_rays;r++) {
+				if(mask[r] == 0) {
+					continue;
+				}
+				Vector_T<double> origin = packet.origin(r);
+				Vector_T<double> dir = packet.direction(r);
+				const double max_distance = packet.t_max[r];
+				double t_max = max_distance;
+				bool blocked = bvh.traverse(origin, dir, t_max, [&](uint32_t prim, double& t_limit) {
+					STAT_ADD(primitive_tests, 1);
+					return objects.occluded(prim, origin, dir, max_distance, packet.skip_id[r]);
+				}, node_index);
+				if(blocked) {
+					packet.active[r] = 0;
+				}
+			}
+			continue;
+		}
+
+		stack[stack_size++] = node.left_first + 1;
+		stack[stack_size++] = node.left_first;
+	}
+}
+
+#endif
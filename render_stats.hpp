@@ -0,0 +1,210 @@
+#ifndef _render_stats_h
+#define _render_stats_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <mutex>
+#include <iostream>
+#include <vector>
+
+#define STATS_DEPTH_BINS 16        /* rays per number of reflections before them, the last bin takes the rest */
+
+using namespace std;
+
+/* Instrumentation, compiled in with -DRENDER_STATS. Every thread counts into
+   its own cache line aligned Render_Counters, so counting is a plain add
+   with no atomics or shared lines; the threads' counters are only summed
+   when the statistics are written. Without RENDER_STATS the STAT_ macros
+   expand to nothing and their arguments are not evaluated. */
+enum Stat_Timer_Id
+{
+	STAT_SCENE_LOAD,
+	STAT_TEXTURE_LOAD,
+	STAT_ACCEL_BUILD,          /* from here on the timers are per frame, see Render_Stats::reset */
+	STAT_TRACE,
+	STAT_IMAGE_WRITE,
+	STAT_NUM_TIMERS
+};
+
+struct alignas(64) Render_Counters
+{
+	uint64_t primary_rays;
+	uint64_t reflection_rays;
+	uint64_t shadow_rays;
+	uint64_t primitive_tests;
+	uint64_t hits;             /* primary and reflection rays that hit an object */
+	uint64_t occluded;         /* shadow rays that were blocked */
+	uint64_t depth[STATS_DEPTH_BINS];
+	uint64_t timer_ns[STAT_NUM_TIMERS];
+
+	Render_Counters() { clear(); }
+
+	void clear()
+	{
+		primary_rays = reflection_rays = shadow_rays = primitive_tests = hits = occluded = 0;
+		memset(depth, 0, sizeof(depth));
+		memset(timer_ns, 0, sizeof(timer_ns));
+	}
+
+	void add(const Render_Counters& other)
+	{
+		primary_rays += other.primary_rays;
+		reflection_rays += other.reflection_rays;
+		shadow_rays += other.shadow_rays;
+		primitive_tests += other.primitive_tests;
+		hits += other.hits;
+		occluded += other.occluded;
+		for(int i=0;i<STATS_DEPTH_BINS;i++) {
+			depth[i] += other.depth[i];
+		}
+		for(int i=0;i<STAT_NUM_TIMERS;i++) {
+			timer_ns[i] += other.timer_ns[i];
+		}
+	}
+};
+
+/* The counters of every thread that has counted anything. The lock is only
+   taken when a thread starts or ends and when the counters are read or
+   reset, which the renderer does between frames while its workers wait. */
+class Render_Stats
+{
+
+	private:
+	std::mutex stats_mutex;
+	std::vector<Render_Counters*> threads;
+	Render_Counters retired;
+
+	public:
+	/* Never destroyed, the pool's workers may still end after static destructors ran */
+	static Render_Stats& shared()
+	{
+		static Render_Stats* stats = new Render_Stats();
+		return *stats;
+	}
+
+	void add_thread(Render_Counters* counters)
+	{
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		threads.push_back(counters);
+	}
+
+	/* A finished thread's counts are kept */
+	void remove_thread(Render_Counters* counters)
+	{
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		retired.add(*counters);
+		for(size_t i=0;i<threads.size();i++) {
+			if(threads[i] == counters) {
+				threads.erase(threads.begin() + i);
+				break;
+			}
+		}
+	}
+
+	Render_Counters total()
+	{
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		Render_Counters sum = retired;
+		for(size_t i=0;i<threads.size();i++) {
+			sum.add(*threads[i]);
+		}
+		return sum;
+	}
+
+	/* Start of a frame: counters and frame timers go back to zero, the
+	   scene and texture load times stay as they were measured */
+	void reset()
+	{
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		reset_counters(retired);
+		for(size_t i=0;i<threads.size();i++) {
+			reset_counters(*threads[i]);
+		}
+	}
+
+	/* Totals as JSON, image names the frame they belong to. Times are in
+	   seconds, summed over the threads that spent them: a streamed image is
+	   written by the tracing threads, so its write time is part of trace. */
+	bool write_json(const char* filename, const char* image)
+	{
+		const Render_Counters sum = total();
+
+		FILE* fp = fopen(filename, "w");
+		if(fp == NULL) {
+			cerr << "Unable to open " << filename << " for writing" << endl;
+			return false;
+		}
+
+		static const char* const timer_names[STAT_NUM_TIMERS] = { "scene_load", "texture_load", "accel_build", "trace", "image_write" };
+
+		fprintf(fp, "{\n\"image\": \"%s\",\n\"rays\": {\"primary\": %llu, \"reflection\": %llu, \"shadow\": %llu},\n", image,
+			(unsigned long long)sum.primary_rays, (unsigned long long)sum.reflection_rays, (unsigned long long)sum.shadow_rays);
+		fprintf(fp, "\"primitive_tests\": %llu,\n\"hits\": %llu,\n\"occluded\": %llu,\n\"depth_histogram\": [",
+			(unsigned long long)sum.primitive_tests, (unsigned long long)sum.hits, (unsigned long long)sum.occluded);
+		for(int i=0;i<STATS_DEPTH_BINS;i++) {
+			fprintf(fp, "%s%llu", i ? ", " : "", (unsigned long long)sum.depth[i]);
+		}
+		fprintf(fp, "],\n\"seconds\": {");
+		for(int i=0;i<STAT_NUM_TIMERS;i++) {
+			fprintf(fp, "%s\"%s\": %.6f", i ? ", " : "", timer_names[i], sum.timer_ns[i] * 1e-9);
+		}
+		fprintf(fp, "}\n}\n");
+
+		return fclose(fp) == 0;
+	}
+
+	private:
+	static void reset_counters(Render_Counters& counters)
+	{
+		uint64_t kept[STAT_ACCEL_BUILD];
+		memcpy(kept, counters.timer_ns, sizeof(kept));
+		counters.clear();
+		memcpy(counters.timer_ns, kept, sizeof(kept));
+	}
+
+};
+
+/* Registers itself on a thread's first count */
+struct Thread_Counters : public Render_Counters
+{
+	Thread_Counters() { Render_Stats::shared().add_thread(this); }
+	~Thread_Counters() { Render_Stats::shared().remove_thread(this); }
+};
+
+static Render_Counters& render_stats_local()
+{
+	static thread_local Thread_Counters counters;
+	return counters;
+}
+
+/* Adds the wall clock time until the end of its scope to a timer */
+class Stat_Scope
+{
+
+	private:
+	Stat_Timer_Id timer;
+	std::chrono::steady_clock::time_point start;
+
+	public:
+	Stat_Scope(Stat_Timer_Id id) : timer(id), start(std::chrono::steady_clock::now()) {}
+
+	~Stat_Scope()
+	{
+		render_stats_local().timer_ns[timer] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+
+};
+
+#ifdef RENDER_STATS
+#define STAT_ADD(counter, n) (render_stats_local().counter += (n))
+#define STAT_DEPTH(bounces, n) (render_stats_local().depth[((bounces) < STATS_DEPTH_BINS) ? (bounces) : STATS_DEPTH_BINS - 1] += (n))
+#define STAT_TIMER(id) Stat_Scope stat_scope_##id(id)
+#else
+#define STAT_ADD(counter, n) ((void)0)
+#define STAT_DEPTH(bounces, n) ((void)0)
+#define STAT_TIMER(id)
+#endif
+
+#endif
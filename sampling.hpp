@@ -0,0 +1,63 @@
+#ifndef _sampling_h
+#define _sampling_h
+
+#include <stdint.h>
+
+#define SAMPLE_SEED 0x9e3779b9u    /* change to get a different but equally good noise pattern */
+
+/* Stateless random numbers: a value depends only on (pixel, sample, dimension),
+   never on which thread asks or in which order, so renders are identical at
+   any thread count and no generator state is shared between threads. */
+
+/* Independent random streams per pixel, one per use */
+enum Sample_Dimension
+{
+	SAMPLE_DIM_LENS = 0,
+	SAMPLE_DIM_ROULETTE = 1
+};
+
+/* Integer finalizer with good avalanche, every input bit affects every output bit */
+static inline uint32_t hash_u32(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+static inline uint32_t sample_hash(uint32_t pixel, uint32_t sample, uint32_t dimension)
+{
+	return hash_u32(pixel ^ hash_u32(sample ^ hash_u32(dimension ^ SAMPLE_SEED)));
+}
+
+/* Uniform in [0,1) */
+static inline double sample_uniform(uint32_t pixel, uint32_t sample, uint32_t dimension)
+{
+	return sample_hash(pixel, sample, dimension) * (1.0/4294967296.0);
+}
+
+/* Van der Corput sequence: any prefix of n samples puts one sample in each
+   of n equal strata (for n a power of two), so samples can be added in
+   batches without losing stratification */
+static inline double radical_inverse_2(uint32_t i)
+{
+	i = (i << 16) | (i >> 16);
+	i = ((i & 0x00ff00ffu) << 8) | ((i & 0xff00ff00u) >> 8);
+	i = ((i & 0x0f0f0f0fu) << 4) | ((i & 0xf0f0f0f0u) >> 4);
+	i = ((i & 0x33333333u) << 2) | ((i & 0xccccccccu) >> 2);
+	i = ((i & 0x55555555u) << 1) | ((i & 0xaaaaaaaau) >> 1);
+	return i * (1.0/4294967296.0);
+}
+
+/* Sample i of a 1D low discrepancy pattern in [0,1). Every pixel gets its own
+   random rotation (Cranley-Patterson) so neighbours do not share the pattern
+   and the error turns into fine noise instead of structured artifacts. */
+static inline double low_discrepancy_1d(uint32_t pixel, uint32_t i, uint32_t dimension)
+{
+	double u = radical_inverse_2(i) + sample_uniform(pixel, 0, dimension);
+	return (u >= 1.0) ? u - 1.0 : u;
+}
+
+#endif
@@ -0,0 +1,1468 @@
+#ifndef _scene_h
+#define _scene_h
+
+#include "vector.hpp"
+#include "color.hpp"
+#include "camera_setup.hpp"
+#include "objects.hpp"
+#include "framebuffer.hpp"
+#include "thread_pool.hpp"
+#include "bvh.hpp"
+#include "primitive_soa.hpp"
+#include "primitive_set.hpp"
+#include "ray_packet.hpp"
+#include "wavefront.hpp"
+#include "depth_of_field.hpp"
+#include "sampling.hpp"
+#include "ppm_writer.hpp"
+#include "scene_file.hpp"
+#include "scene_parser.hpp"
+#include "render_stats.hpp"
+#include <iostream>
+#include <string>
+#include <stdint.h>
+#include <cstring>
+
+#define DOF_ENABLED
+#define DOF_POST_PROCESS           /* trace once through a pinhole, blur by depth per focal distance; remove for lens sampled DOF_TraceRay */
+#define DOF_NUM_RAYS 32             /* most lens rays a pixel may take */
+#define DOF_SAMPLE_BATCH 4         /* lens rays traced between convergence checks */
+#define DOF_MAX_ERROR 0.004        /* stop once the standard error is below about one 8 bit level */
+#define DOF_SAMPLE_MAP             /* lens sampling also writes each image's per pixel ray counts to <name>_samples.pgm */
+#define PROGRESSIVE_RENDER         /* lens sampling traces one ray per pixel per pass into an accumulation buffer */
+#define PROGRESSIVE_PREVIEW_PASSES 4       /* rewrite the images every this many passes, 0 for only when done */
+#define PROGRESSIVE_CHECKPOINT_PASSES 8    /* save <name>.accum every this many passes to resume from, 0 for never */
+#define MAX_RECURSION 8
+#define PATH_MIN_THROUGHPUT 0.002  /* stop reflecting once the rest of a path weighs less than this, about half an 8 bit level; 0 for exact */
+#define PATH_ROULETTE 0.0          /* below this throughput reflections go on at random and count more when they do; 0 for off */
+#define MAX_ARGUMENTS 4            /* my_raytracer <scene> or my_raytracer --compile <scene> <compiled scene> */
+#define NUM_CUBE_FACES 6
+#define DEPTH_ITER_LIMIT 3
+#define TILE_SIZE 16
+#define ACCEL_DEFAULT ACCEL_BVH
+#define PACKET_TRACING             /* pinhole primary and shadow rays go through the BVH as packets */
+#define WAVEFRONT_TRACING          /* pinhole tiles go through generate, extend, shadow and shade stages a batch at a time, before PACKET_TRACING */
+#define RAY_SORTING                /* the wavefront sorts reflection rays by direction octant and origin before tracing them */
+
+#if defined(DOF_ENABLED) && !defined(DOF_POST_PROCESS)
+#define DOF_LENS_SAMPLING
+#endif
+
+double dof_val = 3.0;
+const Real epsilon = Precision_Traits<Real>::ray_offset();   /* how far secondary rays start off their surface */
+
+using namespace std;
+
+static void check_color(Color&);
+static bool continue_path(double& throughput, double& weight, const Vector& point, int bounce);
+
+/* How rays find the objects they hit, linear is kept to compare against.
+   ACCEL_SIMD tests every primitive too, several per instruction from SoA arrays. */
+enum Accel_Mode
+{
+	ACCEL_LINEAR,
+	ACCEL_BVH,
+	ACCEL_SIMD
+};
+
+class Scene
+{		
+	private:	
+	Camera_Setup camera;
+	Color backgroundColor;                  
+	Accel_Mode accel_mode;
+	BVH bvh;
+	Primitive_SoA primitives;
+	Scene_Primitive_Set prim_set;
+	bool accel_dirty;
+
+	public:
+
+    typedef std::vector<Object*> Object_List;
+    typedef std::vector<Light_Source> Light_Source_List;
+
+    Object_List obj_list;
+    Light_Source_List light_list;
+
+    Scene(const Camera_Setup& cam, const Color& col) : camera(cam), backgroundColor(col), accel_mode(ACCEL_DEFAULT), accel_dirty(true) {}
+
+    virtual ~Scene()
+    {
+        delete_object();
+    }
+
+        
+    Object& add_Object(Object* new_obj)
+    {
+        obj_list.push_back(new_obj);
+        accel_dirty = true;
+        return *new_obj;
+    }
+
+    void add_Light_Source(const Light_Source& source)
+    {
+        light_list.push_back(source);
+    }
+
+    void delete_object();
+
+    /* Each mode builds its own structures, the next render builds them */
+    void set_accel_mode(Accel_Mode mode)
+    {
+        accel_mode = mode;
+        accel_dirty = true;
+    }
+    Accel_Mode get_accel_mode() const { return accel_mode; }
+    void build_acceleration();
+
+    int find_nearest_Intersection(const Vector& vec_origin,const Vector& vec_dir,Intersection& inter);
+    Color TraceRay(const Vector& vec_origin,const Vector& vec_dir, const Ray_Cone& cone, Color& ray_intensity, int recursion_depth, double* hit_distance = NULL);
+	Color GetColor(const Intersection& inter, const Vector& vec_dir, Color& ray_intensity, int recursion_depth, const char* light_visible = NULL);
+	bool check_Occlusion(const Vector& vec_origin, const Vector& unit_dir, double max_distance, int obj_id);
+	void shadow_start(const Intersection& inter, Vector& origin, int& skip_id);
+	void Reflection(const Intersection& inter, const Vector& incident_dir, Vector& reflect_origin, Vector& reflect_dir);
+	Color getAmbientLighting(const Intersection& inter, const Color& color);
+   	Color getDiffuseAndSpecularLighting(const Intersection& inter, const Vector& vec_dir, const Color& color, const char* light_visible = NULL);
+    void image_ppm(const char* filename, const uint32_t& width, const uint32_t& height);
+    void cube_map_ppm(const char* const filenames[][NUM_CUBE_FACES], const double* focal_distances, int num_focal, const uint32_t& dim);
+    bool progressive_pass_tile(Camera_Setup& cam, Framebuffer_RGB8& framebuffer, uint32_t tile, uint32_t width, uint32_t height, double focal_distance, uint32_t pass);
+    void progressive_cube_map(vector<Camera_Setup>& cameras, Framebuffer_RGB8* const* framebuffers, const char* const* filenames, const uint32_t& dim, double focal_distance);
+    template<typename Image>
+    void render_tile(Camera_Setup& cam, Image& framebuffer, double* depth, int* samples, uint32_t tile, uint32_t width, uint32_t height, double focal_distance);
+    Color DOF_LensSample(const Vector& vec_origin,const Vector& vec_dir, const Ray_Cone& cone, Color& ray_intensity, int recursion_depth, double depth_of_field, double pix_h, uint32_t pixel, uint32_t sample);
+    Color DOF_TraceRay(const Vector& vec_origin,const Vector& vec_dir, const Ray_Cone& cone, Color& ray_intensity, int recursion_depth, double depth_of_field, double pix_h, uint32_t pixel, int* num_samples = NULL);
+    void trace_packet(Camera_Setup& cam, uint32_t row_begin, uint32_t col_begin, uint32_t rows, uint32_t cols, Color& ray_intensity, Color* colors, double* depths = NULL);
+    void trace_wavefront(Camera_Setup& cam, uint32_t row_begin, uint32_t col_begin, uint32_t rows, uint32_t cols, Color& ray_intensity, Color* colors, double* depths = NULL);
+
+};
+
+void Scene::delete_object() 
+{
+
+	/* The first prim_set.size() objects live in prim_set's arrays */
+	Object_List::iterator begin = obj_list.begin() + std::min<size_t>(prim_set.size(), obj_list.size());
+    Object_List::iterator end  = obj_list.end();
+        
+    while(begin!=end)
+    {
+        delete *begin;
+        *begin = NULL;
+        begin++;
+    }
+        
+    obj_list.clear();
+    bvh.clear();
+    primitives.clear();
+    prim_set.clear();
+    accel_dirty = true;
+
+}
+
+void Scene::build_acceleration()
+{
+	STAT_TIMER(STAT_ACCEL_BUILD);
+
+	/* Objects move into per type arrays, obj_list is reordered to point there */
+	prim_set.build(obj_list);
+
+	if(accel_mode == ACCEL_BVH) {
+		std::vector<AABB> bounds(obj_list.size());
+		for(size_t i=0;i<obj_list.size();i++) {
+			bounds[i] = obj_list[i]->get_bounds();
+		}
+		bvh.build(bounds, Thread_Pool::shared());
+
+		/* Packet leaves test spheres and planes straight from the SoA arrays */
+		primitives.build(obj_list);
+	}
+
+	if(accel_mode == ACCEL_SIMD) {
+		primitives.build(obj_list);
+		cout << "Intersection kernels: " << primitives.get_kernels().name << endl;
+	}
+
+	accel_dirty = false;
+}
+
+/* Only t, the object index and the part hit travel through the search, the
+   hit point, normal and texture coordinates are computed once for the winner */
+int Scene::find_nearest_Intersection(const Vector& vec_origin,const Vector& vec_dir,Intersection& inter)
+{
+
+        Hit closest;
+
+        if(accel_mode == ACCEL_BVH && !accel_dirty)
+        {
+            bvh.traverse(vec_origin, vec_dir, closest.t, [&](uint32_t prim, double& t_limit) {
+                STAT_ADD(primitive_tests, 1);
+                double t;
+                if(prim_set.intersect(prim,vec_origin,vec_dir,t_limit,t,closest.part))
+                {
+                    t_limit = t;
+                    closest.prim = prim;
+                }
+                return false;
+            });
+        }
+        else if(accel_mode == ACCEL_SIMD && !accel_dirty)
+        {
+            STAT_ADD(primitive_tests, obj_list.size());
+            primitives.closest(obj_list, vec_origin, vec_dir, closest);
+        }
+        else if(!accel_dirty)
+        {
+            STAT_ADD(primitive_tests, obj_list.size());
+
+            prim_set.for_each([&](auto& obj, uint32_t prim) {
+                double t;
+                if(obj.check_Intersection(vec_origin,vec_dir,closest.t,t,closest.part))
+                {
+                    closest.t = t;
+                    closest.prim = prim;
+                }
+            });
+        }
+        else
+        {
+            /* Objects added since the last build are only reachable through Object */
+            int size = obj_list.size();
+            STAT_ADD(primitive_tests, size);
+
+            for(int i=0;i<size;i++)
+            {
+                double t;
+                if(obj_list[i]->check_Intersection(vec_origin,vec_dir,closest.t,t,closest.part))
+                {
+                    closest.t = t;
+                    closest.prim = i;
+                }
+            }
+        }
+
+        if(closest.prim < 0) {
+            return 0;
+        }
+
+        STAT_ADD(hits, 1);
+        if(accel_dirty) {
+            obj_list[closest.prim]->fill_Intersection(vec_origin,vec_dir,closest.t,closest.part,inter);
+        } else {
+            prim_set.fill(closest.prim,vec_origin,vec_dir,closest.t,closest.part,inter);
+        }
+        return 1;
+
+}
+
+/* Shadow ray query: true as soon as any object other than obj_id (-1 for
+   none) blocks the segment of length max_distance, no hit point or normal
+   is computed */
+bool Scene::check_Occlusion(const Vector& vec_origin, const Vector& unit_dir, double max_distance, int obj_id)
+{
+        STAT_ADD(shadow_rays, 1);
+
+        if(accel_mode == ACCEL_BVH && !accel_dirty)
+        {
+            double t_max = max_distance;
+
+            const bool blocked = bvh.traverse(vec_origin, unit_dir, t_max, [&](uint32_t prim, double& t_limit) {
+                STAT_ADD(primitive_tests, 1);
+                return prim_set.occluded(prim, vec_origin, unit_dir, max_distance, obj_id);
+            });
+            STAT_ADD(occluded, blocked);
+            return blocked;
+        }
+
+        if(accel_mode == ACCEL_SIMD && !accel_dirty)
+        {
+            STAT_ADD(primitive_tests, obj_list.size());
+            const bool blocked = primitives.occluded(obj_list, vec_origin, unit_dir, max_distance, obj_id);
+            STAT_ADD(occluded, blocked);
+            return blocked;
+        }
+
+        int begin = 0;
+        int end  = obj_list.size();
+
+        while(begin!=end)
+        {            
+            STAT_ADD(primitive_tests, 1);
+
+            if(accel_dirty ? (obj_list[begin]->object_id != obj_id && obj_list[begin]->check_Occlusion(vec_origin, unit_dir, max_distance))
+                           : prim_set.occluded(begin, vec_origin, unit_dir, max_distance, obj_id)) {
+                STAT_ADD(occluded, 1);
+                return true;
+            }
+            begin++;
+        }
+
+        /* Path from point to light is clear */
+        return false;  
+}
+
+/* Lens ray number sample of a pixel, aimed at the pixel's point on the focal
+   plane. Lens samples come from a per pixel low discrepancy pattern, so a
+   pixel looks the same whichever thread renders it and in whatever order. */
+Color Scene::DOF_LensSample(const Vector& vec_origin,const Vector& vec_dir, const Ray_Cone& cone, Color& ray_intensity, int recursion_depth, double depth_of_field, double pix_h, uint32_t pixel, uint32_t sample)
+{
+
+	Vector center_dir = vec_dir;
+	Vector dest_point(0.0,0.0,0.0);
+	dest_point += vec_origin;
+	dest_point += (center_dir * depth_of_field); 
+
+	double lens_offset = pix_h * DOF_LENS_RADIUS * (2.0*low_discrepancy_1d(pixel, sample, SAMPLE_DIM_LENS) - 1.0);
+	Vector lens_origin = vec_origin; 
+	lens_origin += Vector(0.0,lens_offset,0.0);
+
+	Vector lens_dir = dest_point;
+	lens_dir -= lens_origin;
+	lens_dir = lens_dir.unit_vector();
+
+    Intersection inter;
+    Color my_color(0.0,0.0,0.0);
+	STAT_ADD(primary_rays, 1);
+	STAT_DEPTH(0, 1);
+	int result = find_nearest_Intersection(lens_origin,lens_dir,inter);
+
+	switch(result) {
+
+		case 0: 	/* No intersecting object found, ray need not be traced anymore*/
+					my_color.ColorProduct(backgroundColor,ray_intensity);
+					break;
+
+		case 1:    /* Compute the color of the pixel */	
+				   inter.set_cone(cone,lens_dir);
+				   my_color = GetColor(inter,vec_dir,ray_intensity,recursion_depth+1);
+				   break;
+
+		default:   cerr << "Ray intersects with more than 1 point at same distance" << endl;
+	}
+
+	return my_color;
+
+}
+
+/* True once the standard error of the mean of n lens samples, given their sum
+   of squared deviations, is below DOF_MAX_ERROR in every channel. The lens
+   pattern is stratified, so variance/n overestimates the error. */
+static bool dof_converged(const Color& sq_dev, uint32_t n)
+{
+	const double max_sq_dev = max(sq_dev.r, max(sq_dev.g, sq_dev.b));
+	return n > 1 && max_sq_dev / ((double)(n - 1) * n) <= DOF_MAX_ERROR*DOF_MAX_ERROR;
+}
+
+/* Samples are taken in batches of DOF_SAMPLE_BATCH until dof_converged or
+   DOF_NUM_RAYS rays were traced. num_samples receives the count if given. */
+Color Scene::DOF_TraceRay(const Vector& vec_origin,const Vector& vec_dir, const Ray_Cone& cone, Color& ray_intensity, int recursion_depth, double depth_of_field, double pix_h, uint32_t pixel, int* num_samples)
+{
+
+	/* Running mean and sum of squared deviations per channel (Welford) */
+	Color mean(0.0,0.0,0.0);
+	Color sq_dev(0.0,0.0,0.0);
+	int n = 0;
+
+	while(n < DOF_NUM_RAYS) {
+
+		const int batch_end = min(n + DOF_SAMPLE_BATCH, DOF_NUM_RAYS);
+
+		for(;n<batch_end;n++) {	
+
+			Color my_color = DOF_LensSample(vec_origin,vec_dir,cone,ray_intensity,recursion_depth,depth_of_field,pix_h,pixel,n);
+
+			Color delta = my_color - mean;
+			mean += delta / (n + 1);
+			Color delta_after = my_color - mean;
+			sq_dev.r += delta.r * delta_after.r;
+			sq_dev.g += delta.g * delta_after.g;
+			sq_dev.b += delta.b * delta_after.b;
+		}
+
+		if(dof_converged(sq_dev, n)) {
+			break;
+		}
+	}
+
+	if(num_samples) {
+		*num_samples = n;
+	}
+
+	check_color(mean);
+
+	return mean;
+
+}
+
+
+/* hit_distance, when given, receives how far the first hit is (DBL_MAX on a miss).
+   cone is the ray's footprint where it leaves vec_origin, for texture filtering. */
+Color Scene::TraceRay(const Vector& vec_origin, const Vector& vec_dir, const Ray_Cone& cone, Color& ray_intensity, int recursion_depth, double* hit_distance)
+{
+		/* Every reflection adds two to the depth, camera rays start at 0 */
+		STAT_ADD(primary_rays, recursion_depth == 0);
+		STAT_ADD(reflection_rays, recursion_depth != 0);
+		STAT_DEPTH(recursion_depth/2, 1);
+
+		Intersection inter;
+		int result = find_nearest_Intersection(vec_origin,vec_dir,inter);
+		Color final_color;
+
+		if(hit_distance) {
+			*hit_distance = (result == 1) ? sqrt(inter.distanceSquared) : DBL_MAX;
+		}
+
+		switch(result) {
+
+			case 0: 	/* No intersecting object found, ray need not be traced anymore*/
+						final_color.ColorProduct(backgroundColor,ray_intensity);
+						return final_color;
+
+			case 1:    /* Compute the color of the pixel */	
+					   inter.set_cone(cone,vec_dir);
+					   final_color = GetColor(inter,vec_dir,ray_intensity,recursion_depth+1);
+					   return final_color;				
+			default:   cerr << "Ray intersects with more than 1 point at same distance" << endl;
+					   return Color(0.0,0.0,0.0); 			   
+		}
+
+}
+
+/* A hit along a reflection path: its own light, and how much of the color
+   seen in its mirror direction it adds */
+struct Path_Vertex
+{
+	Color local;
+	double weight;
+};
+
+#define MAX_PATH_VERTICES (MAX_RECURSION/2 + 2)   /* a hit and its reflections, from a camera ray on */
+
+/* Color of a hit and its chain of reflections, followed in a loop instead of
+   recursing through TraceRay. The path's throughput, the product of the
+   weights so far, bounds what any further bounce can add since every color
+   is clamped to 1, so the path ends once it is below PATH_MIN_THROUGHPUT or
+   MAX_RECURSION is reached. The vertices are then summed from the last one
+   back, clamping at each like the recursion did, so with a threshold of 0
+   the colors are exactly the recursive ones. */
+Color Scene::GetColor(const Intersection& hit, const Vector& hit_dir, Color& ray_intensity, int recursion_depth, const char* light_visible)
+{
+
+   Path_Vertex path[MAX_PATH_VERTICES];
+   int num_vertices = 0;
+   Color tail(0.0,0.0,0.0);     /* seen past the last vertex */
+   double throughput = 1.0;
+
+   Intersection inter = hit;
+   Vector vec_dir = hit_dir;
+
+   for(;;) {
+   	Path_Vertex& vertex = path[num_vertices++];
+
+   	/* Textured objects take their color from the texture, filtered over the ray's footprint */
+   	Color color = !inter.obj->texture_flag ? inter.obj->getcolor() : (inter.prim >= 0 ? prim_set.texel(inter) : inter.obj->gettexel(inter));
+   	vertex.local = getAmbientLighting(inter, color);
+   	vertex.local += getDiffuseAndSpecularLighting(inter,vec_dir,color,(num_vertices == 1) ? light_visible : NULL);
+   	vertex.weight = inter.obj->getreflectivity();
+
+   	if(recursion_depth > MAX_RECURSION || !continue_path(throughput, vertex.weight, inter.point, num_vertices)) {
+   		break;
+   	}
+
+   	/* Every reflection adds two to the depth, one here and one for the hit */
+   	recursion_depth++;
+   	STAT_ADD(reflection_rays, 1);
+   	STAT_DEPTH(recursion_depth/2, 1);
+
+   	Vector reflect_origin, reflect_dir;
+   	Reflection(inter,vec_dir,reflect_origin,reflect_dir);
+   	const Ray_Cone cone = inter.cone;
+
+   	inter = Intersection();
+   	if(find_nearest_Intersection(reflect_origin,reflect_dir,inter) == 0) {
+   		tail.ColorProduct(backgroundColor,ray_intensity);
+   		break;
+   	}
+
+   	inter.set_cone(cone,reflect_dir);
+   	vec_dir = reflect_dir;
+   	recursion_depth++;
+   }
+
+   for(int i=num_vertices-1;i>=0;i--) {
+   	Color final_color = path[i].local;
+   	final_color += tail * path[i].weight;
+   	check_color(final_color);
+   	tail = final_color;
+   }
+
+   return tail;
+}
+
+/* Multiplies the path's throughput by the weight of its latest vertex and
+   says whether the path goes on. Below PATH_ROULETTE it survives with a
+   probability proportional to the throughput and the vertex's weight grows
+   to make up for the paths that stopped, seeded by the hit point so that
+   renders stay the same at any thread count. */
+static bool continue_path(double& throughput, double& weight, const Vector& point, int bounce)
+{
+	throughput *= weight;
+
+	if(throughput < PATH_ROULETTE && throughput > 0.0) {
+		const double survive = throughput / PATH_ROULETTE;
+		uint32_t bits[2*3];
+		const double coords[3] = { point.x, point.y, point.z };
+		memcpy(bits, coords, sizeof(bits));
+		uint32_t seed = 0;
+		for(int i=0;i<2*3;i++) {
+			seed = hash_u32(seed ^ bits[i]);
+		}
+		if(sample_uniform(seed, bounce, SAMPLE_DIM_ROULETTE) >= survive) {
+			return false;
+		}
+		weight /= survive;
+		throughput = PATH_ROULETTE;
+	}
+
+	return throughput >= PATH_MIN_THROUGHPUT && throughput > 0.0;
+}
+
+static void check_color(Color& final_color)
+{
+	if(final_color.r > 1.0)
+	{
+		final_color.r = 1.0;
+	}
+
+	if(final_color.r < 0.0)
+	{
+		final_color.r = 0.0;
+	}
+
+	if(final_color.g > 1.0) 
+	{
+		final_color.g = 1.0;
+	}
+
+	if(final_color.g < 0.0) 
+	{
+		final_color.g = 0.0;
+	}
+
+	if(final_color.b > 1.0)
+	{
+		final_color.b = 1.0;
+	}
+
+	if(final_color.b < 0.0)
+	{
+		final_color.b = 0.0;
+	}
+
+}
+
+Color Scene::getAmbientLighting(const Intersection& inter, const Color& color)
+{
+	Color my_color = color;
+	return (my_color * 0.2);
+}
+
+/* Where the shadow rays of a hit start and which object they pass through.
+   A sphere or plane can not block light from its own surface and is skipped.
+   A mesh can, so its rays start epsilon off the surface on the side of the
+   normal, which faces the incoming ray, and meet all of its triangles. */
+void Scene::shadow_start(const Intersection& inter, Vector& origin, int& skip_id)
+{
+	origin = inter.point;
+	skip_id = inter.obj->object_id;
+	if(inter.obj->self_shadowing) {
+		Vector normal = inter.surfaceNormal;
+		origin += normal * epsilon;
+		skip_id = -1;
+	}
+}
+
+/* light_visible holds one flag per light when a shadow packet already
+   answered the occlusion queries, otherwise a shadow ray is traced here */
+Color Scene::getDiffuseAndSpecularLighting(const Intersection& inter, const Vector& vec_dir, const Color& color, const char* light_visible)
+{
+
+   Color diffuseColor(0.0, 0.0, 0.0);
+   Color specularColor(0.0, 0.0, 0.0);
+   Color result_Color(0.0, 0.0, 0.0);
+   Color my_color = color;
+   Vector shadow_origin;
+   int skip_id;
+   shadow_start(inter, shadow_origin, skip_id);
+   /*Shadow ray towards light source*/
+		for(int i=0;i<light_list.size();i++) {
+			
+			Vector light_pos,light_vec,dummy;
+			light_pos = light_list[i].location;
+			light_vec = light_pos - inter.point;
+			const double light_distance = light_vec.mag();
+			Vector light_dir = light_vec/light_distance;
+			double check_val = dummy.DotProduct(inter.surfaceNormal,light_dir);
+			
+			if(check_val < 0.0) {
+				check_val = 0.0;
+			}	
+
+			//Find bisector value for specular shading//
+			 Vector v_opp(0.0,0.0,0.0);
+			 v_opp -= vec_dir;
+			 Vector h_temp(0.0,0.0,0.0);
+			 h_temp += v_opp;
+			 h_temp += light_vec;
+			 h_temp = h_temp.unit_vector();
+
+			 double spec_val = h_temp.DotProduct(inter.surfaceNormal,h_temp); 
+
+			 if(spec_val < 0.0) {
+				spec_val = 0.0;
+			 }	
+
+			const bool visible = light_visible ? (light_visible[i] != 0) : !check_Occlusion(shadow_origin,light_dir,light_distance,skip_id);
+
+			if(visible) {
+				
+				Color light_factor_temp(0.0,0.0,0.0);
+				light_factor_temp = light_list[i].color;
+				
+				/* Diffuse Shading */
+				Color diff_factor_temp(0.0,0.0,0.0);
+				diff_factor_temp = (my_color * check_val);
+				diffuseColor += diff_factor_temp;
+				diffuseColor.ColorProduct(diffuseColor,light_factor_temp);
+
+				/* Specular Shading */ 
+				Color spec_factor_temp(0.0,0.0,0.0);
+				spec_factor_temp.r = (light_factor_temp.r * pow(spec_val,32));
+				spec_factor_temp.g = (light_factor_temp.g * pow(spec_val,32));
+				spec_factor_temp.b = (light_factor_temp.b * pow(spec_val,32));
+				specularColor += spec_factor_temp;
+
+			} else {
+					continue;
+			}
+				
+		}
+
+   result_Color += diffuseColor;
+   result_Color += specularColor; 		
+   
+   return result_Color;
+
+}
+
+/* The mirror ray of a hit, started just off the surface */
+void Scene::Reflection(const Intersection& inter, const Vector& incident_dir, Vector& reflect_origin, Vector& reflect_dir)
+{
+
+		Vector vec;
+		Vector normal = inter.surfaceNormal;
+		double perp = 2.0 * vec.DotProduct(incident_dir,normal);
+		Vector reflectDir = incident_dir;
+		reflectDir -= (normal * perp);
+
+		Vector new_point = inter.point;
+		Vector perturb = (reflectDir * epsilon);
+		new_point += perturb;
+		reflect_origin = new_point;
+		reflect_dir = reflectDir;
+
+}
+
+/* Traces a rows x cols block of pinhole camera rays as one packet. Primary
+   hits and their shadow rays share BVH traversal, reflections continue as
+   single rays. colors (and depths, if given) are filled row by row. */
+void Scene::trace_packet(Camera_Setup& cam, uint32_t row_begin, uint32_t col_begin, uint32_t rows, uint32_t cols, Color& ray_intensity, Color* colors, double* depths)
+{
+	const int num_rays = rows*cols;
+	const int num_lights = light_list.size();
+	const Vector origin = cam.get_camera_center();
+	const Ray_Cone cone(0.0, cam.get_pixel_spread());
+
+	Ray_Packet packet;
+	packet.reset(num_rays);
+	for(uint32_t r=0;r<rows;r++) {
+		for(uint32_t c=0;c<cols;c++) {
+			packet.set_ray(r*cols + c, origin, cam.compute_pixel_vector(row_begin + r, col_begin + c), DBL_MAX, -1.0);
+		}
+	}
+
+	STAT_ADD(primary_rays, num_rays);
+	STAT_DEPTH(0, num_rays);
+	trace_packet_closest(bvh, primitives, prim_set, packet);
+
+	Intersection inter[PACKET_MAX_RAYS];
+	for(int i=0;i<num_rays;i++) {
+		if(packet.prim[i] >= 0) {
+			STAT_ADD(hits, 1);
+			prim_set.fill(packet.prim[i], origin, packet.direction(i), packet.t_max[i], packet.part[i], inter[i]);
+			inter[i].set_cone(cone, packet.direction(i));
+		}
+	}
+
+	/* One shadow packet per light, same rays getDiffuseAndSpecularLighting
+	   would trace. The flags are per thread and keep their storage from
+	   packet to packet, like Wavefront_State. */
+	static thread_local std::vector<char> light_visible;
+	light_visible.assign(num_rays*num_lights, 0);
+	Ray_Packet shadow;
+
+	for(int l=0;l<num_lights;l++) {
+		shadow.reset(num_rays);
+		for(int i=0;i<num_rays;i++) {
+			if(packet.prim[i] < 0) {
+				continue;
+			}
+			Vector light_vec = light_list[l].location - inter[i].point;
+			const double light_distance = light_vec.mag();
+			Vector light_dir = light_vec/light_distance;
+			Vector shadow_origin;
+			int skip_id;
+			shadow_start(inter[i], shadow_origin, skip_id);
+			shadow.set_ray(i, shadow_origin, light_dir, light_distance, skip_id);
+			STAT_ADD(shadow_rays, 1);
+		}
+
+		trace_packet_occluded(bvh, primitives, prim_set, shadow);
+
+		for(int i=0;i<num_rays;i++) {
+			light_visible[i*num_lights + l] = (shadow.active[i] != 0);
+			STAT_ADD(occluded, packet.prim[i] >= 0 && shadow.active[i] == 0);
+		}
+	}
+
+	for(int i=0;i<num_rays;i++) {
+		if(depths) {
+			depths[i] = (packet.prim[i] < 0) ? DBL_MAX : sqrt(inter[i].distanceSquared);
+		}
+
+		if(packet.prim[i] < 0) {
+			colors[i].ColorProduct(backgroundColor,ray_intensity);
+		} else {
+			colors[i] = GetColor(inter[i],packet.direction(i),ray_intensity,1,num_lights ? &light_visible[i*num_lights] : NULL);
+		}
+	}
+}
+
+/* Per thread storage of trace_wavefront, reused from tile to tile */
+struct Wavefront_State
+{
+	Ray_Queue rays;                     /* to extend at the current bounce */
+	Ray_Queue next_rays;                /* reflections of the current bounce */
+	Ray_Queue shadow;                   /* one per hit and light, path is hit*num_lights + light */
+	Ray_Queue sorted;                   /* scratch space of sort_queue */
+	std::vector<uint64_t> sort_keys;
+	std::vector<int> hit_rays;          /* rays of rays that hit something */
+	std::vector<Intersection> hits;     /* parallel to hit_rays */
+	std::vector<char> light_visible;
+	std::vector<Path_Vertex> vertices;  /* MAX_PATH_VERTICES per path */
+	std::vector<int> num_vertices;
+	std::vector<double> throughput;
+	std::vector<Ray_Cone> cones;        /* of each path's ray in flight */
+	std::vector<Color> tail;            /* seen past each path's last vertex */
+};
+
+/* Renders a rows x cols block of pinhole pixels like trace_packet and
+   GetColor, but breadth first: all paths of the block advance one bounce at
+   a time through separate stages with queues of rays in between.
+   generate: camera rays, queued in PACKET_MAX_DIM squares
+   extend:   closest hits of the whole queue, packet by packet
+   shadow:   one ray per hit and light, all occlusion queries at once
+   shade:    Scene's lighting at every hit and the reflection rays to extend next
+   Each stage runs over the whole batch before the next, so its code and
+   the BVH nodes it touches stay in cache. The colors are summed from every
+   path's vertices as in GetColor, and come out the same. */
+void Scene::trace_wavefront(Camera_Setup& cam, uint32_t row_begin, uint32_t col_begin, uint32_t rows, uint32_t cols, Color& ray_intensity, Color* colors, double* depths)
+{
+	static thread_local Wavefront_State wave;
+
+	const int num_paths = rows*cols;
+	const int num_lights = light_list.size();
+	const Ray_Cone pixel_cone(0.0, cam.get_pixel_spread());
+
+	wave.vertices.resize(num_paths*MAX_PATH_VERTICES);
+	wave.num_vertices.assign(num_paths, 0);
+	wave.throughput.assign(num_paths, 1.0);
+	wave.cones.assign(num_paths, pixel_cone);
+	wave.tail.assign(num_paths, Color(0.0,0.0,0.0));
+
+	/* Generate */
+	wave.rays.clear();
+	for(uint32_t block_row=0;block_row<rows;block_row+=PACKET_MAX_DIM) {
+		for(uint32_t block_col=0;block_col<cols;block_col+=PACKET_MAX_DIM) {
+			for(uint32_t r=block_row;r<min<uint32_t>(block_row + PACKET_MAX_DIM, rows);r++) {
+				for(uint32_t c=block_col;c<min<uint32_t>(block_col + PACKET_MAX_DIM, cols);c++) {
+					wave.rays.push(r*cols + c, cam.get_camera_center(), cam.compute_pixel_vector(row_begin + r, col_begin + c), DBL_MAX, -1);
+				}
+			}
+		}
+	}
+	STAT_ADD(primary_rays, num_paths);
+	STAT_DEPTH(0, num_paths);
+
+	if(depths) {
+		for(int p=0;p<num_paths;p++) {
+			depths[p] = DBL_MAX;
+		}
+	}
+
+	/* Depth of the hits the next extend finds, as GetColor counts it */
+	int recursion_depth = 1;
+
+	while(wave.rays.size() > 0) {
+
+		/* Extend, camera rays are coherent as they are */
+		#ifdef RAY_SORTING
+		if(recursion_depth > 1) {
+			sort_queue(wave.rays, bvh.nodes[0].bounds, wave.sort_keys, wave.sorted);
+		}
+		#endif
+		queue_closest(bvh, primitives, prim_set, wave.rays);
+
+		wave.hit_rays.clear();
+		for(size_t i=0;i<wave.rays.size();i++) {
+			if(wave.rays.prim[i] < 0) {
+				wave.tail[wave.rays.path[i]].ColorProduct(backgroundColor,ray_intensity);
+			} else {
+				wave.hit_rays.push_back(i);
+			}
+		}
+
+		const int num_hits = wave.hit_rays.size();
+		STAT_ADD(hits, num_hits);
+		wave.hits.resize(num_hits);
+		for(int k=0;k<num_hits;k++) {
+			const int i = wave.hit_rays[k];
+			const Vector vec_dir = wave.rays.direction(i);
+			Intersection& inter = wave.hits[k];
+			inter = Intersection();
+			prim_set.fill(wave.rays.prim[i], wave.rays.origin(i), vec_dir, wave.rays.t_max[i], wave.rays.part[i], inter);
+			inter.set_cone(wave.cones[wave.rays.path[i]], vec_dir);
+			if(depths && recursion_depth == 1) {
+				depths[wave.rays.path[i]] = sqrt(inter.distanceSquared);
+			}
+		}
+
+		/* Shadow, light by light: the rays of one light leave a tile's hits in
+		   about the same direction, they need no sorting to share packets */
+		wave.shadow.clear();
+		for(int l=0;l<num_lights;l++) {
+			for(int k=0;k<num_hits;k++) {
+				const Intersection& inter = wave.hits[k];
+				Vector light_vec = light_list[l].location - inter.point;
+				const double light_distance = light_vec.mag();
+				Vector light_dir = light_vec/light_distance;
+				Vector shadow_origin;
+				int skip_id;
+				shadow_start(inter, shadow_origin, skip_id);
+				wave.shadow.push(k*num_lights + l, shadow_origin, light_dir, light_distance, skip_id);
+			}
+		}
+		STAT_ADD(shadow_rays, wave.shadow.size());
+
+		queue_occluded(bvh, primitives, prim_set, wave.shadow);
+
+		wave.light_visible.resize(wave.shadow.size());
+		for(size_t s=0;s<wave.shadow.size();s++) {
+			wave.light_visible[wave.shadow.path[s]] = !wave.shadow.blocked[s];
+			STAT_ADD(occluded, wave.shadow.blocked[s]);
+		}
+
+		/* Shade */
+		wave.next_rays.clear();
+		for(int k=0;k<num_hits;k++) {
+			const int i = wave.hit_rays[k];
+			const int p = wave.rays.path[i];
+			const Intersection& inter = wave.hits[k];
+			const Vector vec_dir = wave.rays.direction(i);
+
+			Path_Vertex& vertex = wave.vertices[p*MAX_PATH_VERTICES + wave.num_vertices[p]++];
+			Color color = !inter.obj->texture_flag ? inter.obj->getcolor() : prim_set.texel(inter);
+			vertex.local = getAmbientLighting(inter, color);
+			vertex.local += getDiffuseAndSpecularLighting(inter,vec_dir,color,num_lights ? &wave.light_visible[k*num_lights] : NULL);
+			vertex.weight = inter.obj->getreflectivity();
+
+			if(recursion_depth > MAX_RECURSION || !continue_path(wave.throughput[p], vertex.weight, inter.point, wave.num_vertices[p])) {
+				continue;
+			}
+
+			STAT_ADD(reflection_rays, 1);
+			STAT_DEPTH((recursion_depth + 1)/2, 1);
+
+			Vector reflect_origin, reflect_dir;
+			Reflection(inter,vec_dir,reflect_origin,reflect_dir);
+			wave.next_rays.push(p, reflect_origin, reflect_dir, DBL_MAX, -1);
+			wave.cones[p] = inter.cone;
+		}
+
+		std::swap(wave.rays, wave.next_rays);
+		recursion_depth += 2;
+	}
+
+	for(int p=0;p<num_paths;p++) {
+		Color final_color = wave.tail[p];
+		for(int v=wave.num_vertices[p]-1;v>=0;v--) {
+			const Path_Vertex& vertex = wave.vertices[p*MAX_PATH_VERTICES + v];
+			Color vertex_color = vertex.local;
+			vertex_color += final_color * vertex.weight;
+			check_color(vertex_color);
+			final_color = vertex_color;
+		}
+		colors[p] = final_color;
+	}
+}
+
+/* Shoot rays from the camera center through every pixel of one TILE_SIZE
+   square, tiles are numbered row by row. Pinhole renders also store the hit
+   distance of every pixel in depth (row major) when it is not NULL. */
+/* Image is a float Framebuffer when the pixels are processed further, or a
+   Framebuffer_RGB8 when they go straight to the output file */
+template<typename Image>
+void Scene::render_tile(Camera_Setup& cam, Image& framebuffer, double* depth, int* samples, uint32_t tile, uint32_t width, uint32_t height, double focal_distance)
+{
+	const uint32_t tiles_x = (width + TILE_SIZE - 1)/TILE_SIZE;
+	const uint32_t row_begin = (tile / tiles_x) * TILE_SIZE;
+	const uint32_t col_begin = (tile % tiles_x) * TILE_SIZE;
+	const uint32_t row_end = min(row_begin + TILE_SIZE, height);
+	const uint32_t col_end = min(col_begin + TILE_SIZE, width);
+
+	Vector my_ray;
+	Color pixel_color;
+	const Ray_Cone pixel_cone(0.0, cam.get_pixel_spread());
+	Color ray_intensity(1.0,1.0,1.0);
+
+	#if defined(WAVEFRONT_TRACING) && !defined(DOF_LENS_SAMPLING)
+	if(accel_mode == ACCEL_BVH) {
+		Color colors[TILE_SIZE*TILE_SIZE];
+		double depths[TILE_SIZE*TILE_SIZE];
+		const uint32_t rows = row_end - row_begin;
+		const uint32_t cols = col_end - col_begin;
+		trace_wavefront(cam, row_begin, col_begin, rows, cols, ray_intensity, colors, depths);
+
+		for(uint32_t r=0;r<rows;r++) {
+			for(uint32_t c=0;c<cols;c++) {
+				framebuffer.set_pixel_data(row_begin + r, col_begin + c, colors[r*cols + c]);
+				if(depth) {
+					depth[(row_begin + r)*width + col_begin + c] = depths[r*cols + c];
+				}
+			}
+		}
+		return;
+	}
+	#endif
+
+	#if defined(PACKET_TRACING) && !defined(DOF_LENS_SAMPLING)
+	if(accel_mode == ACCEL_BVH) {
+		Color colors[PACKET_DIM*PACKET_DIM];
+		double depths[PACKET_DIM*PACKET_DIM];
+		for (uint32_t row=row_begin; row < row_end; row+=PACKET_DIM)
+		{
+			for(uint32_t col=col_begin; col < col_end; col+=PACKET_DIM)
+			{
+				const uint32_t rows = min(row + PACKET_DIM, row_end) - row;
+				const uint32_t cols = min(col + PACKET_DIM, col_end) - col;
+				trace_packet(cam, row, col, rows, cols, ray_intensity, colors, depths);
+
+				for(uint32_t r=0;r<rows;r++) {
+					for(uint32_t c=0;c<cols;c++) {
+						framebuffer.set_pixel_data(row + r, col + c, colors[r*cols + c]);
+						if(depth) {
+							depth[(row + r)*width + col + c] = depths[r*cols + c];
+						}
+					}
+				}
+			}
+		}
+		return;
+	}
+	#endif
+
+	for (uint32_t row=row_begin; row < row_end; row++) 
+	{
+		for(uint32_t col=col_begin; col < col_end; col++)
+		{
+			my_ray = cam.compute_pixel_vector(row,col);
+
+			#ifdef DOF_LENS_SAMPLING
+			pixel_color = DOF_TraceRay(cam.get_camera_center(),my_ray,pixel_cone,ray_intensity,0,focal_distance,cam.get_pixel_height(),row*width + col,samples ? &samples[row*width + col] : NULL);
+			#else
+			pixel_color = TraceRay(cam.get_camera_center(),my_ray,pixel_cone,ray_intensity,0,depth ? &depth[row*width + col] : NULL);
+			#endif
+
+			framebuffer.set_pixel_data(row,col,pixel_color);
+		}
+	}
+}
+
+/* image_name with its extension replaced by suffix, for files kept beside an image */
+static string companion_filename(const char* image_name, const char* suffix)
+{
+	string filename(image_name);
+	return filename.substr(0, filename.rfind('.')) + suffix;
+}
+
+/* Grayscale image of the lens rays each pixel took, white at DOF_NUM_RAYS.
+   Written next to image_name as <name>_samples.pgm; the mean is printed so
+   DOF_MAX_ERROR can be tuned against the render time it buys. */
+static void write_sample_map(const char* image_name, const vector<int>& samples, const uint32_t& width, const uint32_t& height)
+{
+	string filename = companion_filename(image_name, "_samples.pgm");
+
+	FILE *fp = fopen(filename.c_str(), "wb");
+
+	if(fp == NULL) {
+		cerr << "Unable to open " << filename << " for writing" << endl;
+		return;
+	}
+
+	(void) fprintf(fp, "P5\n%d %d\n255\n", width, height);
+
+	vector<unsigned char> gray(width*height);
+	double total = 0.0;
+	for(uint32_t i=0;i<width*height;i++) {
+		gray[i] = (unsigned char)((samples[i] * 255) / DOF_NUM_RAYS);
+		total += samples[i];
+	}
+
+	(void) fwrite(&gray[0], 1, gray.size(), fp);
+	(void) fclose(fp);
+
+	cout << filename << ": " << total/(width*height) << " lens rays per pixel on average" << endl;
+}
+
+#ifdef RENDER_STATS
+/* The frame's counters and timers, beside image_name as <name>_stats.json */
+static void write_render_stats(const char* image_name)
+{
+	string filename = companion_filename(image_name, "_stats.json");
+
+	if(Render_Stats::shared().write_json(filename.c_str(), image_name)) {
+		cout << "Render statistics written to " << filename << endl;
+	}
+}
+#endif
+
+/* Pixels of blur per unit of |1/depth - 1/focal| for DOF_TraceRay's lens */
+static double dof_lens_scale(Camera_Setup& cam)
+{
+	return DOF_LENS_RADIUS * cam.get_distance() * fabs(cam.get_head_vector().y);
+}
+
+void Scene::image_ppm(const char* filename, const uint32_t& width, const uint32_t& height)
+{
+
+	#ifdef RENDER_STATS
+	Render_Stats::shared().reset();
+	#endif
+
+	if(accel_dirty) {
+		build_acceleration();
+	}
+
+	/* One tile per task */
+	const uint32_t num_tiles = ((width + TILE_SIZE - 1)/TILE_SIZE) * ((height + TILE_SIZE - 1)/TILE_SIZE);
+
+	#if defined(DOF_ENABLED) && defined(DOF_POST_PROCESS)
+	Framebuffer framebuffer(width,height);
+	std::vector<double> depth(width*height);
+	{
+		STAT_TIMER(STAT_TRACE);
+		Thread_Pool::shared().parallel_for(num_tiles, [&](uint32_t tile) {
+			render_tile(camera, framebuffer, &depth[0], NULL, tile, width, height, dof_val);
+		});
+	}
+
+	Framebuffer_RGB8 blurred(width,height);
+	depth_of_field_blur(framebuffer, depth, blurred, width, height, dof_val, dof_lens_scale(camera), Thread_Pool::shared());
+	write_ppm(filename, blurred, width, height, Thread_Pool::shared());
+	#else
+	/* Bands of rows go to the file as soon as their tiles are done */
+	Framebuffer_RGB8 framebuffer(width,height);
+	Band_Writer<unsigned char> writer(framebuffer, width, height, TILE_SIZE, (width + TILE_SIZE - 1)/TILE_SIZE);
+	writer.add_file(filename);
+
+	{
+		STAT_TIMER(STAT_TRACE);
+		Thread_Pool::shared().parallel_for(num_tiles, [&](uint32_t tile) {
+			render_tile(camera, framebuffer, NULL, NULL, tile, width, height, dof_val);
+			writer.tile_done(tile);
+		});
+	}
+	#endif
+
+	#ifdef RENDER_STATS
+	write_render_stats(filename);
+	#endif
+
+}
+
+/* Camera at the origin looking through one face of the cube */
+static Camera_Setup cube_face_camera(int face, int dim)
+{
+	Vector U_Vec(0.0,1.0,0.0);
+	Vector W_Vec(0.0,0.0,-1.0);
+	
+	switch(face)
+	{
+
+		case 0: /* Front Face */
+				U_Vec = Vector(0.0,1.0,0.0);
+				W_Vec = Vector(0.0,0.0,-1.0);
+				break;
+		case 1: /* Right Face */
+				U_Vec = Vector(0.0,1.0,0.0);
+				W_Vec = Vector(1.0,0.0,0.0);
+				break;	
+		case 2: /* Left Face */
+				U_Vec = Vector(0.0,1.0,0.0);
+				W_Vec = Vector(-1.0,0.0,0.0);
+				break;
+		case 3: /* Back Face */
+				U_Vec = Vector(0.0,1.0,0.0);
+				W_Vec = Vector(0.0,0.0,1.0);
+				break;
+		case 4: /* Top Face */
+				U_Vec = Vector(0.0,0.0,1.0);
+				W_Vec = Vector(0.0,1.0,0.0);
+				break;	
+		case 5: /* Bottom Face */
+				U_Vec = Vector(0.0,0.0,-1.0);
+				W_Vec = Vector(0.0,-1.0,0.0);
+				break;
+
+		default: cerr << "Invalid cube face " << face << ", using the front face" << endl; 
+	}
+
+	return Camera_Setup(Vector(0.0,0.0,0.0),U_Vec,W_Vec,1.0,dim,dim,90,90);
+}
+
+/* One progressive pass: every pixel still sampling gets lens ray number pass.
+   A pixel stops, like in DOF_TraceRay, when it is converged at the end of a
+   batch; its sample count then falls behind the pass number for good.
+   Returns whether any pixel of the tile was traced. */
+bool Scene::progressive_pass_tile(Camera_Setup& cam, Framebuffer_RGB8& framebuffer, uint32_t tile, uint32_t width, uint32_t height, double focal_distance, uint32_t pass)
+{
+	const uint32_t tiles_x = (width + TILE_SIZE - 1)/TILE_SIZE;
+	const uint32_t row_begin = (tile / tiles_x) * TILE_SIZE;
+	const uint32_t col_begin = (tile % tiles_x) * TILE_SIZE;
+	const uint32_t row_end = min(row_begin + TILE_SIZE, height);
+	const uint32_t col_end = min(col_begin + TILE_SIZE, width);
+
+	Color ray_intensity(1.0,1.0,1.0);
+	const Ray_Cone pixel_cone(0.0, cam.get_pixel_spread());
+	bool traced = false;
+
+	for (uint32_t row=row_begin; row < row_end; row++) 
+	{
+		for(uint32_t col=col_begin; col < col_end; col++)
+		{
+			if(framebuffer.get_accumulated_samples(row,col) != pass) {
+				continue;
+			}
+
+			if(pass % DOF_SAMPLE_BATCH == 0 && dof_converged(framebuffer.get_accumulated_sq_dev(row,col), pass)) {
+				continue;
+			}
+
+			Vector my_ray = cam.compute_pixel_vector(row,col);
+			framebuffer.accumulate(row,col,DOF_LensSample(cam.get_camera_center(),my_ray,pixel_cone,ray_intensity,0,focal_distance,cam.get_pixel_height(),row*width + col,pass));
+			traced = true;
+		}
+	}
+
+	return traced;
+}
+
+/* Mean of the accumulated samples, clamped like a traced pixel */
+static void resolve_accumulation(Framebuffer_RGB8& framebuffer, const uint32_t& width, const uint32_t& height)
+{
+	for (uint32_t row=0; row < height; row++) {
+		for(uint32_t col=0; col < width; col++) {
+			Color pixel_color = framebuffer.get_accumulated_mean(row,col);
+			check_color(pixel_color);
+			framebuffer.set_pixel_data(row,col,pixel_color);
+		}
+	}
+}
+
+/* Renders the six faces at one focal distance a lens ray per pixel per pass,
+   so a usable image exists after the first pass and improves from there.
+   A complete set of checkpoints from an earlier, interrupted run is picked up
+   where it stopped; the last checkpoint marks the faces as finished. */
+void Scene::progressive_cube_map(vector<Camera_Setup>& cameras, Framebuffer_RGB8* const* framebuffers, const char* const* filenames, const uint32_t& dim, double focal_distance)
+{
+	const uint32_t tiles_per_face = ((dim + TILE_SIZE - 1)/TILE_SIZE) * ((dim + TILE_SIZE - 1)/TILE_SIZE);
+	string checkpoints[NUM_CUBE_FACES];
+	uint32_t first_pass = 0;
+
+	for(int k=0;k<NUM_CUBE_FACES;k++) {
+		checkpoints[k] = companion_filename(filenames[k], ".accum");
+	}
+
+	for(int k=0;k<NUM_CUBE_FACES;k++) {
+		uint32_t passes = 0;
+		if(!framebuffers[k]->load_accumulation(checkpoints[k].c_str(), passes) || (k > 0 && passes != first_pass)) {
+			first_pass = 0;
+			break;
+		}
+		first_pass = passes;
+	}
+
+	if(first_pass == 0) {
+		for(int k=0;k<NUM_CUBE_FACES;k++) {
+			framebuffers[k]->reset_accumulation();
+		}
+	}
+	else {
+		cout << "Resuming " << filenames[0] << " and the other faces after pass " << first_pass << endl;
+	}
+
+	for(uint32_t pass=first_pass;pass<DOF_NUM_RAYS;pass++) {
+
+		std::atomic<bool> traced(false);
+		{
+			STAT_TIMER(STAT_TRACE);
+			Thread_Pool::shared().parallel_for(NUM_CUBE_FACES*tiles_per_face, [&](uint32_t task) {
+				const uint32_t face = task / tiles_per_face;
+				if(progressive_pass_tile(cameras[face], *framebuffers[face], task % tiles_per_face, dim, dim, focal_distance, pass)) {
+					traced = true;
+				}
+			});
+		}
+
+		/* Every pixel has converged */
+		if(!traced) {
+			break;
+		}
+
+		const uint32_t passes = pass + 1;
+
+		if(PROGRESSIVE_CHECKPOINT_PASSES > 0 && passes % PROGRESSIVE_CHECKPOINT_PASSES == 0 && passes < DOF_NUM_RAYS) {
+			for(int k=0;k<NUM_CUBE_FACES;k++) {
+				framebuffers[k]->save_accumulation(checkpoints[k].c_str(), passes);
+			}
+		}
+
+		if(PROGRESSIVE_PREVIEW_PASSES > 0 && passes % PROGRESSIVE_PREVIEW_PASSES == 0 && passes < DOF_NUM_RAYS) {
+			for(int k=0;k<NUM_CUBE_FACES;k++) {
+				resolve_accumulation(*framebuffers[k], dim, dim);
+				write_ppm(filenames[k], *framebuffers[k], dim, dim, Thread_Pool::shared());
+			}
+		}
+	}
+
+	for(int k=0;k<NUM_CUBE_FACES;k++) {
+		resolve_accumulation(*framebuffers[k], dim, dim);
+		write_ppm(filenames[k], *framebuffers[k], dim, dim, Thread_Pool::shared());
+
+		#ifdef DOF_SAMPLE_MAP
+		vector<int> samples(dim*dim);
+		for(uint32_t i=0;i<dim*dim;i++) {
+			samples[i] = framebuffers[k]->get_accumulated_samples(i / dim, i % dim);
+		}
+		write_sample_map(filenames[k], samples, dim, dim);
+		#endif
+
+		if(PROGRESSIVE_CHECKPOINT_PASSES > 0) {
+			framebuffers[k]->save_accumulation(checkpoints[k].c_str(), DOF_NUM_RAYS);
+		}
+	}
+}
+
+/* Renders all six cube faces for every focal distance in one job: the scene
+   and its acceleration structures are shared, and the tiles of every face go
+   to the pool together. filenames[i][k] is face k at focal_distances[i].
+   Unless lens sampling is on the faces are traced only once, each focal
+   distance is then a depth of field blur of that trace (or the trace itself
+   when depth of field is off). */
+void Scene::cube_map_ppm(const char* const filenames[][NUM_CUBE_FACES], const double* focal_distances, int num_focal, const uint32_t& dim)
+{
+
+	/* The whole sweep counts as one frame, its statistics go beside the first image */
+	#ifdef RENDER_STATS
+	Render_Stats::shared().reset();
+	#endif
+
+	if(accel_dirty) {
+		build_acceleration();
+	}
+
+	/* Faces that are blurred afterwards keep float pixels, all others are
+	   traced straight to the bytes of their output files */
+	#if defined(DOF_ENABLED) && !defined(DOF_LENS_SAMPLING)
+	typedef Framebuffer Face_Image;
+	#else
+	typedef Framebuffer_RGB8 Face_Image;
+	#endif
+
+	vector<Camera_Setup> cameras;
+	Face_Image* framebuffers[NUM_CUBE_FACES];
+	vector<double> depth[NUM_CUBE_FACES];
+
+	for(int k=0;k<NUM_CUBE_FACES;k++) {
+		cameras.push_back(cube_face_camera(k, dim));
+		framebuffers[k] = new Face_Image(dim,dim);
+	}
+
+	const uint32_t tiles_x = (dim + TILE_SIZE - 1)/TILE_SIZE;
+	const uint32_t tiles_per_face = tiles_x * tiles_x;
+
+	#if defined(DOF_LENS_SAMPLING) && defined(PROGRESSIVE_RENDER)
+	for(int i=0;i<num_focal;i++) {
+		progressive_cube_map(cameras, framebuffers, filenames[i], dim, focal_distances[i]);
+	}
+
+	/* The whole sweep is written, nothing left to resume */
+	for(int i=0;i<num_focal;i++) {
+		for(int k=0;k<NUM_CUBE_FACES;k++) {
+			remove(companion_filename(filenames[i][k], ".accum").c_str());
+		}
+	}
+	#elif defined(DOF_LENS_SAMPLING)
+	vector<int> samples[NUM_CUBE_FACES];
+	#ifdef DOF_SAMPLE_MAP
+	for(int k=0;k<NUM_CUBE_FACES;k++) {
+		samples[k].resize(dim*dim);
+	}
+	#endif
+
+	for(int i=0;i<num_focal;i++) {
+		Band_Writer<unsigned char>* writers[NUM_CUBE_FACES];
+		for(int k=0;k<NUM_CUBE_FACES;k++) {
+			writers[k] = new Band_Writer<unsigned char>(*framebuffers[k], dim, dim, TILE_SIZE, tiles_x);
+			writers[k]->add_file(filenames[i][k]);
+		}
+
+		{
+			STAT_TIMER(STAT_TRACE);
+			Thread_Pool::shared().parallel_for(NUM_CUBE_FACES*tiles_per_face, [&](uint32_t task) {
+				const uint32_t face = task / tiles_per_face;
+				render_tile(cameras[face], *framebuffers[face], NULL, samples[face].empty() ? NULL : &samples[face][0], task % tiles_per_face, dim, dim, focal_distances[i]);
+				writers[face]->tile_done(task % tiles_per_face);
+			});
+		}
+
+		for(int k=0;k<NUM_CUBE_FACES;k++) {
+			delete writers[k];
+			#ifdef DOF_SAMPLE_MAP
+			write_sample_map(filenames[i][k], samples[k], dim, dim);
+			#endif
+		}
+	}
+	#else
+	#ifdef DOF_ENABLED
+	for(int k=0;k<NUM_CUBE_FACES;k++) {
+		depth[k].resize(dim*dim);
+	}
+
+	{
+		STAT_TIMER(STAT_TRACE);
+		Thread_Pool::shared().parallel_for(NUM_CUBE_FACES*tiles_per_face, [&](uint32_t task) {
+			const uint32_t face = task / tiles_per_face;
+			render_tile(cameras[face], *framebuffers[face], &depth[face][0], NULL, task % tiles_per_face, dim, dim, 0.0);
+		});
+	}
+
+	for(int i=0;i<num_focal;i++) {
+		for(int k=0;k<NUM_CUBE_FACES;k++) {
+			Framebuffer_RGB8 blurred(dim,dim);
+			depth_of_field_blur(*framebuffers[k], depth[k], blurred, dim, dim, focal_distances[i], dof_lens_scale(cameras[k]), Thread_Pool::shared());
+			write_ppm(filenames[i][k], blurred, dim, dim, Thread_Pool::shared());
+		}
+	}
+	#else
+	/* Every focal distance gets the same image, streamed band by band while the faces render */
+	Band_Writer<unsigned char>* writers[NUM_CUBE_FACES];
+	for(int k=0;k<NUM_CUBE_FACES;k++) {
+		writers[k] = new Band_Writer<unsigned char>(*framebuffers[k], dim, dim, TILE_SIZE, tiles_x);
+		for(int i=0;i<num_focal;i++) {
+			writers[k]->add_file(filenames[i][k]);
+		}
+	}
+
+	{
+		STAT_TIMER(STAT_TRACE);
+		Thread_Pool::shared().parallel_for(NUM_CUBE_FACES*tiles_per_face, [&](uint32_t task) {
+			const uint32_t face = task / tiles_per_face;
+			render_tile(cameras[face], *framebuffers[face], NULL, NULL, task % tiles_per_face, dim, dim, 0.0);
+			writers[face]->tile_done(task % tiles_per_face);
+		});
+	}
+
+	for(int k=0;k<NUM_CUBE_FACES;k++) {
+		delete writers[k];
+	}
+	#endif
+	#endif
+
+	for(int k=0;k<NUM_CUBE_FACES;k++) {
+		delete framebuffers[k];
+	}
+
+	#ifdef RENDER_STATS
+	write_render_stats(filenames[0][0]);
+	#endif
+
+}
+
+/* Objects straight from the description's records, numbered from 1 with the
+   spheres first, then planes and meshes. Objects sharing a texture or mesh
+   file path share the loaded texture or mesh; a mesh whose file can not be
+   read is left out. */
+static void build_scene(const Scene_Description& desc, Scene& scene)
+{
+	const Sphere_Record* spheres = desc.get_spheres();
+	const Plane_Record* planes = desc.get_planes();
+	const Light_Record* lights = desc.get_lights();
+	const Mesh_Record* meshes = desc.get_meshes();
+	int object_id = 0;
+
+	scene.obj_list.reserve(desc.get_num_spheres() + desc.get_num_planes() + desc.get_num_meshes());
+
+	for(size_t i=0;i<desc.get_num_spheres();i++)
+	{
+		const Sphere_Record& record = spheres[i];
+		Sphere* sphere = new Sphere(Vector(record.center[0],record.center[1],record.center[2]), record.radius, Color(record.color[0],record.color[1],record.color[2]), record.reflectivity, ++object_id);
+		scene.add_Object(sphere);
+
+		if(record.texture >= 0)
+		{
+			sphere->addTexture(desc.textures[record.texture].c_str());
+		}
+	}
+
+	for(size_t i=0;i<desc.get_num_planes();i++)
+	{
+		const Plane_Record& record = planes[i];
+		Plane* plane = new Plane(Vector(record.center[0],record.center[1],record.center[2]), record.length, record.width, Vector(record.normal[0],record.normal[1],record.normal[2]), Vector(record.headup[0],record.headup[1],record.headup[2]), Color(record.color[0],record.color[1],record.color[2]), record.reflectivity, ++object_id);
+		scene.add_Object(plane);
+
+		if(record.texture >= 0)
+		{
+			plane->addTexture(desc.textures[record.texture].c_str());
+		}
+	}
+
+	for(size_t i=0;i<desc.get_num_meshes();i++)
+	{
+		const Mesh_Record& record = meshes[i];
+		Mesh_Handle data = Mesh_Cache::shared().load(desc.mesh_files[record.file].c_str());
+
+		if(!data)
+		{
+			cerr << "Mesh " << desc.mesh_files[record.file] << " could not be loaded, leaving it out" << endl;
+			continue;
+		}
+
+		scene.add_Object(new Mesh(data, Vector(record.center[0],record.center[1],record.center[2]), record.scale, Color(record.color[0],record.color[1],record.color[2]), record.reflectivity, ++object_id));
+	}
+
+	for(size_t i=0;i<desc.get_num_lights();i++)
+	{
+		scene.add_Light_Source(Light_Source(Vector(lights[i].location[0],lights[i].location[1],lights[i].location[2]), Color(lights[i].color[0],lights[i].color[1],lights[i].color[2])));
+	}
+}
+
+#endif
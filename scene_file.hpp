@@ -0,0 +1,428 @@
+#ifndef _scene_file_h
+#define _scene_file_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+
+#define SCENE_FILE_MAGIC "RTSCENE1"
+#define SCENE_FILE_VERSION 2
+#define SCENE_FILE_BYTE_ORDER 0x01020304u   /* reads back swapped on a host of the other byte order */
+
+using namespace std;
+
+/* Compiled scenes: a fixed header followed by arrays of fixed size records,
+   each starting on an 8 byte boundary, so a loader maps the file and uses the
+   records where they lie. Numbers are in the byte order of the host that
+   wrote the file. Texture and mesh file paths are stored once, objects refer
+   to them by index, -1 for none.
+
+     Scene_File_Header
+     Sphere_Record[num_spheres]     at sphere_offset
+     Plane_Record[num_planes]       at plane_offset
+     Light_Record[num_lights]       at light_offset
+     Mesh_Record[num_meshes]        at mesh_offset
+     uint64_t[num_textures]         at texture_offset, into the strings
+     uint64_t[num_mesh_files]       at mesh_file_offset, into the strings
+     char[string_size]              at string_offset, NUL terminated paths
+
+   Records hold what the text format does, with its defaults. Version 1
+   files, from before meshes, are not read; compile their scenes again. */
+
+struct Scene_File_Header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	double camera_dim;
+	uint64_t num_spheres;
+	uint64_t num_planes;
+	uint64_t num_lights;
+	uint64_t num_textures;
+	uint64_t sphere_offset;
+	uint64_t plane_offset;
+	uint64_t light_offset;
+	uint64_t texture_offset;
+	uint64_t string_offset;
+	uint64_t string_size;
+	uint64_t num_meshes;
+	uint64_t num_mesh_files;
+	uint64_t mesh_offset;
+	uint64_t mesh_file_offset;
+};
+
+struct Sphere_Record
+{
+	double center[3];
+	double radius;
+	double color[3];
+	double reflectivity;
+	int32_t texture;
+	uint32_t reserved;
+
+	Sphere_Record() : radius(1.0), reflectivity(0.0), texture(-1), reserved(0)
+	{
+		center[0] = center[1] = center[2] = 0.0;
+		color[0] = color[1] = color[2] = 1.0;
+	}
+};
+
+struct Plane_Record
+{
+	double center[3];
+	double width;
+	double length;
+	double normal[3];
+	double headup[3];
+	double color[3];
+	double reflectivity;
+	int32_t texture;
+	uint32_t reserved;
+
+	Plane_Record() : width(1.0), length(1.0), reflectivity(0.0), texture(-1), reserved(0)
+	{
+		center[0] = center[1] = center[2] = 0.0;
+		normal[0] = 0.0; normal[1] = 1.0; normal[2] = 0.0;
+		headup[0] = 0.0; headup[1] = 1.0; headup[2] = 0.0;
+		color[0] = color[1] = color[2] = 1.0;
+	}
+};
+
+struct Light_Record
+{
+	double location[3];
+	double color[3];
+
+	Light_Record()
+	{
+		location[0] = 0.0; location[1] = 10.0; location[2] = -5.0;
+		color[0] = color[1] = color[2] = 1.0;
+	}
+};
+
+/* The triangles stay in the OBJ file, file indexes mesh_files */
+struct Mesh_Record
+{
+	double center[3];
+	double scale;
+	double color[3];
+	double reflectivity;
+	int32_t file;
+	uint32_t reserved;
+
+	Mesh_Record() : scale(1.0), reflectivity(0.0), file(-1), reserved(0)
+	{
+		center[0] = center[1] = center[2] = 0.0;
+		color[0] = color[1] = color[2] = 1.0;
+	}
+};
+
+static_assert(sizeof(Scene_File_Header) == 136 && sizeof(Sphere_Record) == 72 && sizeof(Plane_Record) == 128 && sizeof(Light_Record) == 48 && sizeof(Mesh_Record) == 72, "scene file records must keep their layout");
+
+/* Everything a scene file describes. A description is either built record by
+   record by a parser or loaded from a compiled file, whose records are then
+   used straight from the mapping until the description is destroyed. */
+class Scene_Description
+{
+
+	private:
+	void* mapping;
+	size_t mapping_size;
+	const Sphere_Record* mapped_spheres;
+	const Plane_Record* mapped_planes;
+	const Light_Record* mapped_lights;
+	const Mesh_Record* mapped_meshes;
+	size_t num_mapped_spheres;
+	size_t num_mapped_planes;
+	size_t num_mapped_lights;
+	size_t num_mapped_meshes;
+
+	std::vector<Sphere_Record> spheres;
+	std::vector<Plane_Record> planes;
+	std::vector<Light_Record> lights;
+	std::vector<Mesh_Record> meshes;
+	std::map<std::string, int> texture_index;
+	std::map<std::string, int> mesh_file_index;
+
+	/* Index of path in paths, added the first time it is seen */
+	static int add_path(const std::string& path, std::vector<std::string>& paths, std::map<std::string, int>& index)
+	{
+		std::map<std::string, int>::iterator it = index.find(path);
+		if(it != index.end()) {
+			return it->second;
+		}
+		paths.push_back(path);
+		index[path] = paths.size() - 1;
+		return paths.size() - 1;
+	}
+
+	Scene_Description(const Scene_Description&);
+	Scene_Description& operator= (const Scene_Description&);
+
+	void unmap()
+	{
+		if(mapping != NULL) {
+			munmap(mapping, mapping_size);
+		}
+		mapping = NULL;
+		mapping_size = 0;
+		num_mapped_spheres = num_mapped_planes = num_mapped_lights = num_mapped_meshes = 0;
+	}
+
+	public:
+	double camera_dim;
+	std::vector<std::string> textures;
+	std::vector<std::string> mesh_files;
+
+	Scene_Description() : mapping(NULL), mapping_size(0), mapped_spheres(NULL), mapped_planes(NULL), mapped_lights(NULL), mapped_meshes(NULL), num_mapped_spheres(0), num_mapped_planes(0), num_mapped_lights(0), num_mapped_meshes(0), camera_dim(0.0) {}
+
+	virtual ~Scene_Description()
+	{
+		unmap();
+	}
+
+	/* New records with the text format's defaults, to be filled in */
+	Sphere_Record& add_sphere() { spheres.push_back(Sphere_Record()); return spheres.back(); }
+	Plane_Record& add_plane() { planes.push_back(Plane_Record()); return planes.back(); }
+	Light_Record& add_light() { lights.push_back(Light_Record()); return lights.back(); }
+	Mesh_Record& add_mesh() { meshes.push_back(Mesh_Record()); return meshes.back(); }
+
+	/* Index of the path in textures or mesh_files, added the first time it is seen */
+	int add_texture(const std::string& path) { return add_path(path, textures, texture_index); }
+	int add_mesh_file(const std::string& path) { return add_path(path, mesh_files, mesh_file_index); }
+
+	size_t get_num_spheres() const { return mapping ? num_mapped_spheres : spheres.size(); }
+	size_t get_num_planes() const { return mapping ? num_mapped_planes : planes.size(); }
+	size_t get_num_lights() const { return mapping ? num_mapped_lights : lights.size(); }
+	size_t get_num_meshes() const { return mapping ? num_mapped_meshes : meshes.size(); }
+
+	const Sphere_Record* get_spheres() const { return mapping ? mapped_spheres : spheres.data(); }
+	const Plane_Record* get_planes() const { return mapping ? mapped_planes : planes.data(); }
+	const Light_Record* get_lights() const { return mapping ? mapped_lights : lights.data(); }
+	const Mesh_Record* get_meshes() const { return mapping ? mapped_meshes : meshes.data(); }
+
+	bool save(const char* filename) const;
+	bool load(const char* filename);
+
+	/* True if the file starts like a compiled scene */
+	static bool is_compiled(const char* filename)
+	{
+		char magic[8];
+		FILE* fp = fopen(filename, "rb");
+		if(fp == NULL) {
+			return false;
+		}
+		const bool match = fread(magic, 1, 8, fp) == 8 && memcmp(magic, SCENE_FILE_MAGIC, 8) == 0;
+		fclose(fp);
+		return match;
+	}
+};
+
+static uint64_t scene_file_align(uint64_t offset)
+{
+	return (offset + 7) & ~(uint64_t)7;
+}
+
+bool Scene_Description::save(const char* filename) const
+{
+	Scene_File_Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SCENE_FILE_MAGIC, 8);
+	header.version = SCENE_FILE_VERSION;
+	header.byte_order = SCENE_FILE_BYTE_ORDER;
+	header.camera_dim = camera_dim;
+	header.num_spheres = get_num_spheres();
+	header.num_planes = get_num_planes();
+	header.num_lights = get_num_lights();
+	header.num_textures = textures.size();
+	header.num_meshes = get_num_meshes();
+	header.num_mesh_files = mesh_files.size();
+
+	std::vector<uint64_t> texture_offsets;
+	std::vector<uint64_t> mesh_file_offsets;
+	std::string strings;
+	for(size_t i=0;i<textures.size();i++) {
+		texture_offsets.push_back(strings.size());
+		strings += textures[i];
+		strings += '\0';
+	}
+	for(size_t i=0;i<mesh_files.size();i++) {
+		mesh_file_offsets.push_back(strings.size());
+		strings += mesh_files[i];
+		strings += '\0';
+	}
+
+	header.sphere_offset = sizeof(header);
+	header.plane_offset = scene_file_align(header.sphere_offset + header.num_spheres*sizeof(Sphere_Record));
+	header.light_offset = scene_file_align(header.plane_offset + header.num_planes*sizeof(Plane_Record));
+	header.mesh_offset = scene_file_align(header.light_offset + header.num_lights*sizeof(Light_Record));
+	header.texture_offset = scene_file_align(header.mesh_offset + header.num_meshes*sizeof(Mesh_Record));
+	header.mesh_file_offset = scene_file_align(header.texture_offset + header.num_textures*sizeof(uint64_t));
+	header.string_offset = scene_file_align(header.mesh_file_offset + header.num_mesh_files*sizeof(uint64_t));
+	header.string_size = strings.size();
+
+	const std::string temp_name = std::string(filename) + ".tmp";
+	FILE* fp = fopen(temp_name.c_str(), "wb");
+
+	if(fp == NULL) {
+		cerr << "Unable to open " << temp_name << " for writing" << endl;
+		return false;
+	}
+
+	/* Sections are already aligned, every record size is a multiple of 8 */
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	ok = ok && fwrite(get_spheres(), sizeof(Sphere_Record), header.num_spheres, fp) == header.num_spheres;
+	ok = ok && fwrite(get_planes(), sizeof(Plane_Record), header.num_planes, fp) == header.num_planes;
+	ok = ok && fwrite(get_lights(), sizeof(Light_Record), header.num_lights, fp) == header.num_lights;
+	ok = ok && fwrite(get_meshes(), sizeof(Mesh_Record), header.num_meshes, fp) == header.num_meshes;
+	ok = ok && fwrite(texture_offsets.data(), sizeof(uint64_t), header.num_textures, fp) == header.num_textures;
+	ok = ok && fwrite(mesh_file_offsets.data(), sizeof(uint64_t), header.num_mesh_files, fp) == header.num_mesh_files;
+	ok = ok && fwrite(strings.data(), 1, strings.size(), fp) == strings.size();
+	ok = (fclose(fp) == 0) && ok;
+
+	if(!ok || rename(temp_name.c_str(), filename) != 0) {
+		cerr << "Unable to write scene " << filename << endl;
+		remove(temp_name.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+/* count records of record_size at offset lie inside a file of size bytes */
+static bool scene_file_section(uint64_t offset, uint64_t count, uint64_t record_size, uint64_t size)
+{
+	return offset % 8 == 0 && offset <= size && count <= (size - offset)/record_size;
+}
+
+/* Maps the file and checks every offset and texture and mesh file index
+   once, nothing is parsed or copied except the paths. Returns false, leaving the
+   description empty, if the file is not a usable compiled scene. */
+bool Scene_Description::load(const char* filename)
+{
+	unmap();
+	spheres.clear(); planes.clear(); lights.clear(); meshes.clear();
+	textures.clear(); texture_index.clear();
+	mesh_files.clear(); mesh_file_index.clear();
+	camera_dim = 0.0;
+
+	const int fd = open(filename, O_RDONLY);
+	if(fd < 0) {
+		perror(filename);
+		return false;
+	}
+
+	struct stat info;
+	void* mapped = MAP_FAILED;
+	if(fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(Scene_File_Header)) {
+		mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+
+	if(mapped == MAP_FAILED) {
+		cerr << filename << ": not a compiled scene" << endl;
+		return false;
+	}
+
+	madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+
+	const char* bytes = (const char*)mapped;
+	const uint64_t size = info.st_size;
+	const Scene_File_Header& header = *(const Scene_File_Header*)bytes;
+
+	const char* problem = NULL;
+	if(memcmp(header.magic, SCENE_FILE_MAGIC, 8) != 0) {
+		problem = "not a compiled scene";
+	}
+	else if(header.byte_order != SCENE_FILE_BYTE_ORDER) {
+		problem = "compiled on a host of the other byte order";
+	}
+	else if(header.version != SCENE_FILE_VERSION) {
+		problem = "compiled scene of an unsupported version";
+	}
+	else if(!scene_file_section(header.sphere_offset, header.num_spheres, sizeof(Sphere_Record), size)
+		|| !scene_file_section(header.plane_offset, header.num_planes, sizeof(Plane_Record), size)
+		|| !scene_file_section(header.light_offset, header.num_lights, sizeof(Light_Record), size)
+		|| !scene_file_section(header.mesh_offset, header.num_meshes, sizeof(Mesh_Record), size)
+		|| !scene_file_section(header.texture_offset, header.num_textures, sizeof(uint64_t), size)
+		|| !scene_file_section(header.mesh_file_offset, header.num_mesh_files, sizeof(uint64_t), size)
+		|| !scene_file_section(header.string_offset, 0, 1, size) || header.string_size > size - header.string_offset
+		|| (header.string_size > 0 && bytes[header.string_offset + header.string_size - 1] != '\0')) {
+		problem = "compiled scene is truncated or damaged";
+	}
+
+	if(problem == NULL) {
+		const uint64_t* texture_offsets = (const uint64_t*)(bytes + header.texture_offset);
+		for(uint64_t i=0;i<header.num_textures && problem == NULL;i++) {
+			if(texture_offsets[i] >= header.string_size) {
+				problem = "compiled scene has a bad texture path";
+			}
+			else {
+				textures.push_back(std::string(bytes + header.string_offset + texture_offsets[i]));
+			}
+		}
+		const uint64_t* mesh_file_offsets = (const uint64_t*)(bytes + header.mesh_file_offset);
+		for(uint64_t i=0;i<header.num_mesh_files && problem == NULL;i++) {
+			if(mesh_file_offsets[i] >= header.string_size) {
+				problem = "compiled scene has a bad mesh file path";
+			}
+			else {
+				mesh_files.push_back(std::string(bytes + header.string_offset + mesh_file_offsets[i]));
+			}
+		}
+	}
+
+	mapping = mapped;
+	mapping_size = size;
+	mapped_spheres = (const Sphere_Record*)(bytes + header.sphere_offset);
+	mapped_planes = (const Plane_Record*)(bytes + header.plane_offset);
+	mapped_lights = (const Light_Record*)(bytes + header.light_offset);
+	mapped_meshes = (const Mesh_Record*)(bytes + header.mesh_offset);
+	num_mapped_spheres = header.num_spheres;
+	num_mapped_planes = header.num_planes;
+	num_mapped_lights = header.num_lights;
+	num_mapped_meshes = header.num_meshes;
+
+	const int64_t num_textures = header.num_textures;
+	for(size_t i=0;i<num_mapped_spheres && problem == NULL;i++) {
+		if(mapped_spheres[i].texture < -1 || mapped_spheres[i].texture >= num_textures) {
+			problem = "compiled scene refers to a missing texture";
+		}
+	}
+	for(size_t i=0;i<num_mapped_planes && problem == NULL;i++) {
+		if(mapped_planes[i].texture < -1 || mapped_planes[i].texture >= num_textures) {
+			problem = "compiled scene refers to a missing texture";
+		}
+	}
+	const int64_t num_mesh_files = header.num_mesh_files;
+	for(size_t i=0;i<num_mapped_meshes && problem == NULL;i++) {
+		if(mapped_meshes[i].file < 0 || mapped_meshes[i].file >= num_mesh_files) {
+			problem = "compiled scene refers to a missing mesh file";
+		}
+		else if(!(mapped_meshes[i].scale > 0.0)) {
+			problem = "compiled scene has a mesh scale that is not greater than 0";
+		}
+	}
+
+	if(problem != NULL) {
+		cerr << filename << ": " << problem << endl;
+		unmap();
+		textures.clear();
+		mesh_files.clear();
+		return false;
+	}
+
+	camera_dim = header.camera_dim;
+
+	return true;
+}
+
+#endif
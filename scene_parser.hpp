@@ -0,0 +1,401 @@
+#ifndef _scene_parser_h
+#define _scene_parser_h
+
+#include "scene_file.hpp"
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <charconv>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define SCENE_PARSER_BUFFER 65536   /* bytes of the text scene held at a time, also the longest token */
+
+using namespace std;
+
+/* Text scenes: whitespace separated keywords, each followed by its numbers.
+   An object keyword (sphere, plane, light, mesh) starts a new object with
+   the format's defaults and the properties after it apply to that object:
+
+     camera <dim>
+     sphere    dimension <radius>  center <x y z>  color <r g b>  reflectivity <k>  texture <file>
+     plane     dimension <width length>  center  normal  headup  color  reflectivity  texture
+     light     location <x y z>  color <r g b>
+     mesh      file <obj file>  center <x y z>  scale <s>  color <r g b>  reflectivity <k>
+
+   A mesh needs its file, the OBJ's coordinates are scaled by s > 0 and then moved to center. */
+
+/* Splits a file into whitespace separated tokens read a buffer at a time,
+   so memory use does not depend on the file size and nothing is allocated
+   per token. A token points into the buffer and is valid until the next. */
+class Scene_Tokenizer
+{
+
+	private:
+	int fd;
+	std::vector<char> buffer;
+	size_t begin;
+	size_t end;
+	bool at_eof;
+	int line;
+	int token_line;
+
+	/* Moves the unread bytes to the front and reads after them, false at the end of the file */
+	bool refill()
+	{
+		memmove(&buffer[0], &buffer[begin], end - begin);
+		end -= begin;
+		begin = 0;
+
+		while(!at_eof && end < buffer.size()) {
+			const ssize_t bytes = read(fd, &buffer[end], buffer.size() - end);
+			if(bytes > 0) {
+				end += bytes;
+				return true;
+			}
+			if(bytes < 0 && errno == EINTR) {
+				continue;
+			}
+			at_eof = true;
+		}
+		return false;
+	}
+
+	static bool is_space(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+	}
+
+	public:
+	Scene_Tokenizer() : fd(-1), buffer(SCENE_PARSER_BUFFER), begin(0), end(0), at_eof(false), line(1), token_line(1) {}
+
+	virtual ~Scene_Tokenizer()
+	{
+		if(fd >= 0) {
+			close(fd);
+		}
+	}
+
+	bool open_file(const char* filename)
+	{
+		fd = open(filename, O_RDONLY);
+		return fd >= 0;
+	}
+
+	/* Line of the last token returned */
+	int get_line() const { return token_line; }
+
+	/* Next token and its length, NULL at the end of the file or, with
+	   too_long set, for a token that does not fit in the buffer */
+	const char* next(size_t& length, bool& too_long)
+	{
+		too_long = false;
+
+		for(;;) {
+			while(begin < end && is_space(buffer[begin])) {
+				line += (buffer[begin] == '\n');
+				begin++;
+			}
+			if(begin < end) {
+				break;
+			}
+			if(!refill()) {
+				return NULL;
+			}
+		}
+
+		token_line = line;
+		size_t scan = begin;
+		for(;;) {
+			while(scan < end && !is_space(buffer[scan])) {
+				scan++;
+			}
+			if(scan < end || at_eof) {
+				break;
+			}
+
+			/* The token may go on in the part of the file not read yet */
+			const size_t scanned = scan - begin;
+			if(begin == 0 && end == buffer.size()) {
+				too_long = true;
+				return NULL;
+			}
+			if(!refill()) {
+				scan = begin + scanned;
+				break;
+			}
+			scan = begin + scanned;
+		}
+
+		const char* token = &buffer[begin];
+		length = scan - begin;
+		begin = scan;
+		return token;
+	}
+
+};
+
+enum Scene_Keyword
+{
+	KEY_CAMERA,
+	KEY_SPHERE,
+	KEY_PLANE,
+	KEY_LIGHT,
+	KEY_DIMENSION,
+	KEY_CENTER,
+	KEY_LOCATION,
+	KEY_COLOR,
+	KEY_REFLECTIVITY,
+	KEY_NORMAL,
+	KEY_HEADUP,
+	KEY_TEXTURE,
+	KEY_MESH,
+	KEY_FILE,
+	KEY_SCALE,
+	KEY_UNKNOWN
+};
+
+static Scene_Keyword scene_keyword(const char* token, size_t length)
+{
+	static const char* const names[KEY_UNKNOWN] = { "camera", "sphere", "plane", "light", "dimension", "center", "location", "color", "reflectivity", "normal", "headup", "texture", "mesh", "file", "scale" };
+
+	for(int k=0;k<KEY_UNKNOWN;k++) {
+		if(strlen(names[k]) == length && memcmp(names[k], token, length) == 0) {
+			return (Scene_Keyword)k;
+		}
+	}
+	return KEY_UNKNOWN;
+}
+
+/* Single pass text scene reader: records are filled in as the tokens arrive,
+   straight in the description's storage */
+class Scene_Parser
+{
+
+	private:
+	enum Block { BLOCK_NONE, BLOCK_SPHERE, BLOCK_PLANE, BLOCK_LIGHT, BLOCK_MESH };
+
+	Scene_Tokenizer tokenizer;
+	const char* filename;
+	Scene_Description& desc;
+	Block block;
+	Sphere_Record* sphere;
+	Plane_Record* plane;
+	Light_Record* light;
+	Mesh_Record* mesh;
+	bool failed;
+
+	void error(const char* message, const char* token = NULL, size_t length = 0)
+	{
+		cerr << filename << ":" << tokenizer.get_line() << ": " << message;
+		if(token != NULL) {
+			cerr << " '" << std::string(token, length) << "'";
+		}
+		cerr << endl;
+		failed = true;
+	}
+
+	/* The value is what stod would give, written like strtod without hex or inf */
+	bool number(double& value)
+	{
+		size_t length = 0;
+		bool too_long = false;
+		const char* token = tokenizer.next(length, too_long);
+
+		if(token == NULL) {
+			error(too_long ? "token too long" : "a number is missing at the end of the file");
+			return false;
+		}
+
+		const char* first = token;
+		const char* last = token + length;
+		if(first < last && *first == '+') {
+			first++;
+		}
+
+		const std::from_chars_result result = std::from_chars(first, last, value);
+		if(result.ec != std::errc() || result.ptr != last || (first != token && *first == '-')) {
+			error(result.ec == std::errc::result_out_of_range ? "number out of range" : "expected a number, found", token, length);
+			return false;
+		}
+		return true;
+	}
+
+	bool numbers(double* values, int count)
+	{
+		for(int i=0;i<count;i++) {
+			if(!number(values[i])) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool texture(int32_t& index)
+	{
+		size_t length = 0;
+		bool too_long = false;
+		const char* token = tokenizer.next(length, too_long);
+
+		if(token == NULL) {
+			error(too_long ? "token too long" : "a texture file is missing at the end of the file");
+			return false;
+		}
+
+		index = desc.add_texture(std::string(token, length));
+		return true;
+	}
+
+	bool mesh_file(int32_t& index)
+	{
+		size_t length = 0;
+		bool too_long = false;
+		const char* token = tokenizer.next(length, too_long);
+
+		if(token == NULL) {
+			error(too_long ? "token too long" : "a mesh file is missing at the end of the file");
+			return false;
+		}
+
+		index = desc.add_mesh_file(std::string(token, length));
+		return true;
+	}
+
+	/* Called before the next object starts and at the end of the file */
+	void end_block()
+	{
+		if(block == BLOCK_MESH && mesh->file < 0) {
+			error("mesh without a file");
+		}
+	}
+
+	void property(Scene_Keyword key, const char* token, size_t length)
+	{
+		switch(key) {
+
+			case KEY_CAMERA:		number(desc.camera_dim);
+									return;
+
+			case KEY_SPHERE:		end_block();
+									sphere = &desc.add_sphere();
+									block = BLOCK_SPHERE;
+									return;
+
+			case KEY_PLANE:			end_block();
+									plane = &desc.add_plane();
+									block = BLOCK_PLANE;
+									return;
+
+			case KEY_LIGHT:			end_block();
+									light = &desc.add_light();
+									block = BLOCK_LIGHT;
+									return;
+
+			case KEY_MESH:			end_block();
+									mesh = &desc.add_mesh();
+									block = BLOCK_MESH;
+									return;
+
+			case KEY_UNKNOWN:		error("unknown keyword", token, length);
+									return;
+
+			default:				break;
+		}
+
+		if(block == BLOCK_SPHERE) {
+			switch(key) {
+				case KEY_DIMENSION:		number(sphere->radius); return;
+				case KEY_CENTER:		numbers(sphere->center, 3); return;
+				case KEY_COLOR:			numbers(sphere->color, 3); return;
+				case KEY_REFLECTIVITY:	number(sphere->reflectivity); return;
+				case KEY_TEXTURE:		texture(sphere->texture); return;
+				default:				break;
+			}
+		}
+		else if(block == BLOCK_PLANE) {
+			switch(key) {
+				case KEY_DIMENSION:		if(number(plane->width)) { number(plane->length); } return;
+				case KEY_CENTER:		numbers(plane->center, 3); return;
+				case KEY_NORMAL:		numbers(plane->normal, 3); return;
+				case KEY_HEADUP:		numbers(plane->headup, 3); return;
+				case KEY_COLOR:			numbers(plane->color, 3); return;
+				case KEY_REFLECTIVITY:	number(plane->reflectivity); return;
+				case KEY_TEXTURE:		texture(plane->texture); return;
+				default:				break;
+			}
+		}
+		else if(block == BLOCK_LIGHT) {
+			switch(key) {
+				case KEY_LOCATION:		numbers(light->location, 3); return;
+				case KEY_COLOR:			numbers(light->color, 3); return;
+				default:				break;
+			}
+		}
+		else if(block == BLOCK_MESH) {
+			switch(key) {
+				case KEY_FILE:			mesh_file(mesh->file); return;
+				case KEY_CENTER:		numbers(mesh->center, 3); return;
+				case KEY_SCALE:
+					if(number(mesh->scale) && !(mesh->scale > 0.0)) {
+						error("mesh scale must be greater than 0");
+					}
+					return;
+				case KEY_COLOR:			numbers(mesh->color, 3); return;
+				case KEY_REFLECTIVITY:	number(mesh->reflectivity); return;
+				default:				break;
+			}
+		}
+
+		static const char* const block_names[] = { "before any object", "for a sphere", "for a plane", "for a light", "for a mesh" };
+		error((std::string("property not allowed ") + block_names[block] + ":").c_str(), token, length);
+	}
+
+	public:
+	Scene_Parser(const char* file, Scene_Description& description) : filename(file), desc(description), block(BLOCK_NONE), sphere(NULL), plane(NULL), light(NULL), mesh(NULL), failed(false) {}
+
+	/* Stops at the first error, which is reported with its line */
+	bool parse()
+	{
+		if(!tokenizer.open_file(filename)) {
+			perror(filename);
+			return false;
+		}
+
+		for(;;) {
+			size_t length = 0;
+			bool too_long = false;
+			const char* token = tokenizer.next(length, too_long);
+
+			if(token == NULL) {
+				if(too_long) {
+					error("token too long");
+				}
+				else {
+					end_block();
+				}
+				break;
+			}
+
+			property(scene_keyword(token, length), token, length);
+			if(failed) {
+				break;
+			}
+		}
+
+		return !failed;
+	}
+
+};
+
+/* Reads a text scene into desc, false after reporting the first error */
+inline bool parse_scene(const char* filename, Scene_Description& desc)
+{
+	Scene_Parser parser(filename, desc);
+	return parser.parse();
+}
+
+#endif
@@ -0,0 +1,373 @@
+#ifndef _texture_cache_h
+#define _texture_cache_h
+
+#include "color.hpp"
+#include "aligned_allocator.hpp"
+#include "render_stats.hpp"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+
+using namespace std;
+
+#define TEXTURE_TILE_SHIFT 2       /* 4x4 texel tiles, 64 bytes: one cache line */
+#define TEXTURE_TILE (1 << TEXTURE_TILE_SHIFT)
+
+/* An immutable RGB texture read from a binary PPM and kept as a full mip
+   chain. Every level stores its texels as 4 byte RGBX in TEXTURE_TILE
+   square tiles of one cache line each, so a bilinear footprint touches one
+   line, rarely two or four, wherever it lands. The file is read through a
+   read only mapping straight into level 0; maxvals other than 255 are
+   scaled to 8 bits on the way. */
+class Texture
+{
+
+	private:
+	struct Mip_Level
+	{
+		uint32_t width;
+		uint32_t height;
+		uint32_t tiles_x;
+		size_t offset;    /* of the level's first texel in texels */
+	};
+
+	int width;
+	int height;
+	std::vector<Mip_Level> levels;
+	Aligned_Vector<uint32_t>::type texels;
+
+	Texture() : width(0), height(0) {}
+
+	void allocate_levels(uint32_t w, uint32_t h);
+	void build_mip_chain();
+
+	size_t index(const Mip_Level& level, uint32_t x, uint32_t y) const
+	{
+		const size_t tile = (size_t)(y >> TEXTURE_TILE_SHIFT)*level.tiles_x + (x >> TEXTURE_TILE_SHIFT);
+		return level.offset + (tile << (2*TEXTURE_TILE_SHIFT)) + ((y & (TEXTURE_TILE - 1)) << TEXTURE_TILE_SHIFT) + (x & (TEXTURE_TILE - 1));
+	}
+
+	Color bilinear(const Mip_Level& level, double u, double v) const;
+
+	public:
+	virtual ~Texture() {}
+
+	int get_width() const { return width; }
+	int get_height() const { return height; }
+	int get_num_levels() const { return levels.size(); }
+
+	/* Bytes held by all levels, edge tiles are padded */
+	size_t get_texel_bytes() const { return texels.size() * sizeof(uint32_t); }
+
+	/* Texel (x,y) of a level as r | g << 8 | b << 16 */
+	uint32_t get_texel(int level, uint32_t x, uint32_t y) const { return texels[index(levels[level], x, y)]; }
+
+	/* Trilinear lookup at (u,v) in [0,1] for a footprint du x dv wide in
+	   texture coordinates. The level is picked by the longer side of the
+	   footprint in texels, so minified textures read small, cache resident
+	   levels and do not alias; 0 gives bilinear filtering of level 0. */
+	Color sample(double u, double v, double du, double dv) const;
+
+	static Texture* load(const char* filename);
+};
+
+typedef std::shared_ptr<const Texture> Texture_Handle;
+
+/* Header fields are separated by whitespace and may be preceded by
+   comments; exactly one whitespace character follows maxval */
+static bool ppm_header_field(const unsigned char* bytes, size_t size, size_t& pos, int& value)
+{
+	for(;;) {
+		while(pos < size && isspace(bytes[pos])) {
+			pos++;
+		}
+		if(pos < size && bytes[pos] == '#') {
+			while(pos < size && bytes[pos] != '\n') {
+				pos++;
+			}
+			continue;
+		}
+		break;
+	}
+
+	if(pos >= size || !isdigit(bytes[pos])) {
+		return false;
+	}
+
+	long number = 0;
+	while(pos < size && isdigit(bytes[pos])) {
+		number = number*10 + (bytes[pos++] - '0');
+		if(number > INT_MAX) {
+			return false;
+		}
+	}
+
+	value = (int)number;
+	return true;
+}
+
+/* Levels halve down to 1x1, each rounded down and at least one texel */
+void Texture::allocate_levels(uint32_t w, uint32_t h)
+{
+	size_t offset = 0;
+
+	for(;;) {
+		Mip_Level level;
+		level.width = w;
+		level.height = h;
+		level.tiles_x = (w + TEXTURE_TILE - 1) >> TEXTURE_TILE_SHIFT;
+		level.offset = offset;
+		levels.push_back(level);
+
+		const size_t tiles_y = (h + TEXTURE_TILE - 1) >> TEXTURE_TILE_SHIFT;
+		offset += (level.tiles_x * tiles_y) << (2*TEXTURE_TILE_SHIFT);
+
+		if(w == 1 && h == 1) {
+			break;
+		}
+		w = max(w/2, 1u);
+		h = max(h/2, 1u);
+	}
+
+	texels.resize(offset);
+}
+
+/* Box filter: a texel averages the block of the level above that it covers,
+   2x2 texels, or 3 wide along an odd side so no row or column is dropped */
+void Texture::build_mip_chain()
+{
+	for(size_t l=1;l<levels.size();l++) {
+
+		const Mip_Level& src = levels[l - 1];
+		const Mip_Level& dst = levels[l];
+
+		for(uint32_t y=0;y<dst.height;y++) {
+
+			const uint32_t y_begin = (uint64_t)y*src.height/dst.height;
+			const uint32_t y_end = max(y_begin + 1, (uint32_t)((uint64_t)(y + 1)*src.height/dst.height));
+
+			for(uint32_t x=0;x<dst.width;x++) {
+
+				const uint32_t x_begin = (uint64_t)x*src.width/dst.width;
+				const uint32_t x_end = max(x_begin + 1, (uint32_t)((uint64_t)(x + 1)*src.width/dst.width));
+
+				uint32_t sum[3] = {0, 0, 0};
+				for(uint32_t sy=y_begin;sy<y_end;sy++) {
+					for(uint32_t sx=x_begin;sx<x_end;sx++) {
+						const uint32_t texel = texels[index(src, sx, sy)];
+						sum[0] += texel & 0xFF;
+						sum[1] += (texel >> 8) & 0xFF;
+						sum[2] += (texel >> 16) & 0xFF;
+					}
+				}
+
+				const uint32_t count = (y_end - y_begin)*(x_end - x_begin);
+				texels[index(dst, x, y)] = ((sum[0] + count/2)/count) | (((sum[1] + count/2)/count) << 8) | (((sum[2] + count/2)/count) << 16);
+			}
+		}
+	}
+}
+
+/* Texel centers are at half integers, edges clamp */
+Color Texture::bilinear(const Mip_Level& level, double u, double v) const
+{
+	const double x = u*level.width - 0.5;
+	const double y = v*level.height - 0.5;
+	const double x_floor = floor(x);
+	const double y_floor = floor(y);
+	const double fx = x - x_floor;
+	const double fy = y - y_floor;
+
+	const int max_x = level.width - 1;
+	const int max_y = level.height - 1;
+	const uint32_t x0 = min(max((int)x_floor, 0), max_x);
+	const uint32_t x1 = min(max((int)x_floor + 1, 0), max_x);
+	const uint32_t y0 = min(max((int)y_floor, 0), max_y);
+	const uint32_t y1 = min(max((int)y_floor + 1, 0), max_y);
+
+	const uint32_t t00 = texels[index(level, x0, y0)];
+	const uint32_t t10 = texels[index(level, x1, y0)];
+	const uint32_t t01 = texels[index(level, x0, y1)];
+	const uint32_t t11 = texels[index(level, x1, y1)];
+
+	const double w00 = (1.0 - fx)*(1.0 - fy);
+	const double w10 = fx*(1.0 - fy);
+	const double w01 = (1.0 - fx)*fy;
+	const double w11 = fx*fy;
+
+	Color result(0.0,0.0,0.0);
+	result.r = (w00*(t00 & 0xFF) + w10*(t10 & 0xFF) + w01*(t01 & 0xFF) + w11*(t11 & 0xFF)) / 255.0;
+	result.g = (w00*((t00 >> 8) & 0xFF) + w10*((t10 >> 8) & 0xFF) + w01*((t01 >> 8) & 0xFF) + w11*((t11 >> 8) & 0xFF)) / 255.0;
+	result.b = (w00*((t00 >> 16) & 0xFF) + w10*((t10 >> 16) & 0xFF) + w01*((t01 >> 16) & 0xFF) + w11*((t11 >> 16) & 0xFF)) / 255.0;
+
+	return result;
+}
+
+Color Texture::sample(double u, double v, double du, double dv) const
+{
+	const double footprint = max(du*width, dv*height);
+	const double lod = (footprint > 1.0) ? log2(footprint) : 0.0;
+	const int last = levels.size() - 1;
+
+	if(lod >= last) {
+		return bilinear(levels[last], u, v);
+	}
+
+	const int level = (int)lod;
+	const double blend = lod - level;
+	Color fine = bilinear(levels[level], u, v);
+
+	if(blend <= 0.0) {
+		return fine;
+	}
+
+	Color coarse = bilinear(levels[level + 1], u, v);
+	return fine*(1.0 - blend) + coarse*blend;
+}
+
+Texture* Texture::load(const char* filename)
+{
+	STAT_TIMER(STAT_TEXTURE_LOAD);
+
+	const int fd = open(filename, O_RDONLY);
+	if(fd < 0) {
+		perror(filename);
+		return NULL;
+	}
+
+	struct stat info;
+	void* mapped = MAP_FAILED;
+	if(fstat(fd, &info) == 0 && info.st_size > 0) {
+		mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+
+	if(mapped == MAP_FAILED) {
+		cerr << filename << ": unable to map the file" << endl;
+		return NULL;
+	}
+
+	const unsigned char* bytes = (const unsigned char*)mapped;
+	const size_t size = info.st_size;
+	size_t pos = 2;
+	int w = 0, h = 0, maxval = 0;
+
+	const bool header_ok = size > 2 && bytes[0] == 'P' && bytes[1] == '6'
+		&& ppm_header_field(bytes, size, pos, w) && ppm_header_field(bytes, size, pos, h) && ppm_header_field(bytes, size, pos, maxval)
+		&& w > 0 && h > 0 && maxval > 0 && maxval < 65536 && pos < size && isspace(bytes[pos]);
+
+	if(!header_ok) {
+		cerr << filename << ": Not a raw PPM file" << endl;
+		munmap(mapped, size);
+		return NULL;
+	}
+
+	pos++;
+	const size_t channel_bytes = (maxval < 256) ? 1 : 2;
+	const size_t payload = (size_t)w*h*3*channel_bytes;
+
+	if(size - pos < payload) {
+		cerr << filename << ": image data is truncated" << endl;
+		munmap(mapped, size);
+		return NULL;
+	}
+
+	madvise(mapped, size, MADV_SEQUENTIAL);
+
+	Texture* texture = new Texture();
+	texture->width = w;
+	texture->height = h;
+	texture->allocate_levels(w, h);
+
+	const Mip_Level& base = texture->levels[0];
+	const unsigned char* data = bytes + pos;
+
+	for(int y=0;y<h;y++) {
+		for(int x=0;x<w;x++) {
+			uint32_t texel = 0;
+			for(int c=0;c<3;c++) {
+				const size_t i = ((size_t)y*w + x)*3 + c;
+				unsigned value = (channel_bytes == 1) ? data[i] : ((data[2*i] << 8) | data[2*i + 1]);    /* two byte samples are big endian */
+				if(maxval != 255) {
+					value = (min(value, (unsigned)maxval)*255 + maxval/2)/maxval;
+				}
+				texel |= value << (8*c);
+			}
+			texture->texels[texture->index(base, x, y)] = texel;
+		}
+	}
+
+	munmap(mapped, size);
+
+	texture->build_mip_chain();
+
+	cout << "Read " << filename << " , width = " << w << ", height = " << h << ", " << texture->get_num_levels() << " mip levels" << std::endl;
+
+	return texture;
+}
+
+/* Process wide texture cache keyed by the file's canonical path, so every
+   object naming the same file, however the path is spelled, shares one
+   Texture. Entries are weak: a texture is freed when its last handle goes
+   away and loaded again if asked for later. */
+class Texture_Cache
+{
+
+	private:
+	std::mutex cache_mutex;
+	std::map<std::string, std::weak_ptr<const Texture> > textures;
+
+	public:
+	static Texture_Cache& shared()
+	{
+		static Texture_Cache cache;
+		return cache;
+	}
+
+	/* NULL if the file cannot be read as a texture */
+	Texture_Handle load(const char* filename)
+	{
+		char resolved[PATH_MAX];
+		const std::string key = (realpath(filename, resolved) != NULL) ? std::string(resolved) : std::string(filename);
+
+		std::lock_guard<std::mutex> lock(cache_mutex);
+
+		Texture_Handle texture = textures[key].lock();
+		if(!texture) {
+			texture = Texture_Handle(Texture::load(filename));
+			if(texture) {
+				textures[key] = texture;
+			}
+		}
+
+		return texture;
+	}
+
+	/* Textures currently loaded, for diagnostics */
+	size_t size()
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		size_t alive = 0;
+		for(std::map<std::string, std::weak_ptr<const Texture> >::iterator it = textures.begin(); it != textures.end(); ++it) {
+			alive += !it->second.expired();
+		}
+		return alive;
+	}
+};
+
+#endif
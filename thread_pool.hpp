@@ -0,0 +1,157 @@
+#ifndef _thread_pool_h
+#define _thread_pool_h
+
+#include <stdint.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+/* Fixed set of worker threads that execute index ranges handed out through
+   a shared atomic counter, so fast workers keep pulling tasks (tiles) while
+   slow ones are still busy. The calling thread takes part in the work too. */
+class Thread_Pool
+{
+
+	private:
+	std::vector<std::thread> workers;
+	std::mutex pool_mutex;
+	std::mutex submit_mutex;
+	std::condition_variable work_cv;
+	std::condition_variable done_cv;
+
+	const std::function<void(uint32_t)>* job;
+	uint32_t job_size;
+	std::atomic<uint32_t> next_index;
+	uint32_t pending_workers;
+	uint64_t generation;
+	bool shutdown;
+
+	static thread_local bool in_worker;
+
+	void worker_loop();
+	void run_tasks(const std::function<void(uint32_t)>& func, uint32_t count);
+
+	public:
+	Thread_Pool(unsigned num_threads = 0);
+	virtual ~Thread_Pool();
+
+	unsigned size() const { return workers.size() + 1; }
+	void parallel_for(uint32_t count, const std::function<void(uint32_t)>& func);
+
+	static Thread_Pool& shared();
+};
+
+thread_local bool Thread_Pool::in_worker = false;
+
+/* num_threads counts the calling thread, 0 means one per hardware thread */
+Thread_Pool::Thread_Pool(unsigned num_threads) : job(NULL), job_size(0), next_index(0), pending_workers(0), generation(0), shutdown(false)
+{
+	if(num_threads == 0) {
+		num_threads = std::thread::hardware_concurrency();
+	}
+
+	for(unsigned i=1;i<num_threads;i++) {
+		workers.push_back(std::thread(&Thread_Pool::worker_loop, this));
+	}
+}
+
+Thread_Pool::~Thread_Pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+		shutdown = true;
+	}
+	work_cv.notify_all();
+
+	for(size_t i=0;i<workers.size();i++) {
+		workers[i].join();
+	}
+}
+
+Thread_Pool& Thread_Pool::shared()
+{
+	static Thread_Pool pool;
+	return pool;
+}
+
+void Thread_Pool::run_tasks(const std::function<void(uint32_t)>& func, uint32_t count)
+{
+	for(;;) {
+		uint32_t index = next_index.fetch_add(1);
+		if(index >= count) {
+			break;
+		}
+		func(index);
+	}
+}
+
+void Thread_Pool::worker_loop()
+{
+	in_worker = true;
+	uint64_t seen_generation = 0;
+
+	for(;;) {
+
+		const std::function<void(uint32_t)>* func;
+		uint32_t count;
+
+		{
+			std::unique_lock<std::mutex> lock(pool_mutex);
+			work_cv.wait(lock, [&]{ return shutdown || generation != seen_generation; });
+			if(shutdown) {
+				return;
+			}
+			seen_generation = generation;
+			func = job;
+			count = job_size;
+		}
+
+		run_tasks(*func, count);
+
+		{
+			std::lock_guard<std::mutex> lock(pool_mutex);
+			if(--pending_workers == 0) {
+				done_cv.notify_one();
+			}
+		}
+	}
+}
+
+/* Calls func(i) for every i in [0,count) and returns once all calls finished.
+   Calls made from inside a task run serially on the calling worker. */
+void Thread_Pool::parallel_for(uint32_t count, const std::function<void(uint32_t)>& func)
+{
+	if(workers.empty() || count <= 1 || in_worker) {
+		for(uint32_t i=0;i<count;i++) {
+			func(i);
+		}
+		return;
+	}
+
+	std::lock_guard<std::mutex> submit_lock(submit_mutex);
+
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+		job = &func;
+		job_size = count;
+		next_index = 0;
+		pending_workers = workers.size();
+		generation++;
+	}
+	work_cv.notify_all();
+
+	in_worker = true;
+	run_tasks(func, count);
+	in_worker = false;
+
+	std::unique_lock<std::mutex> lock(pool_mutex);
+	done_cv.wait(lock, [&]{ return pending_workers == 0; });
+	job = NULL;
+}
+
+#endif
@@ -1,43 +1,50 @@
 #ifndef _vector_h
 #define _vector_h
 
+#include "precision.hpp"
 #include "color.hpp"
 #include <iostream>
 #include <math.h>
 
 using namespace std;
 
-class Vector {
+/* Three component vector of any scalar type, Vector is the renderer's */
+template<typename T>
+class Vector_T {
  
 public:
-double x,y,z;
+T x,y,z;
  
-Vector() : x(0.0),y(0.0),z(0.0) {}
+Vector_T() : x(0.0),y(0.0),z(0.0) {}
 
-Vector(double x, double y, double z) 
+Vector_T(T x, T y, T z) 
 {
 	 this->x = x; this->y = y; this->z = z;
 }
 
- Vector operator+ (const Vector& vec2) 
+/* From a vector of another precision */
+template<typename U>
+Vector_T(const Vector_T<U>& vec) : x(vec.x), y(vec.y), z(vec.z) {}
+
+ Vector_T operator+ (const Vector_T& vec2) 
  {
-    Vector vec1(0.0,0.0,0.0);
+    Vector_T vec1(0.0,0.0,0.0);
     vec1.x = this->x + vec2.x;
     vec1.y = this->y + vec2.y;
     vec1.z = this->z + vec2.z;
     return vec1;
  }
 
- Vector operator- (const Vector& vec2)
+ Vector_T operator- (const Vector_T& vec2)
  {
-    Vector vec1(0.0,0.0,0.0);
+    Vector_T vec1(0.0,0.0,0.0);
     vec1.x = this->x - vec2.x;
     vec1.y = this->y - vec2.y;
     vec1.z = this->z - vec2.z;
     return vec1;
  }     
 
- Vector& operator= (const Vector& vec)
+ Vector_T& operator= (const Vector_T& vec)
  {
 	this->x = vec.x;
     this->y = vec.y;
@@ -45,7 +52,7 @@ Vector(double x, double y, double z)
     return *this;
  }    
 
-bool operator!= (const Vector& vec)
+bool operator!= (const Vector_T& vec)
  {
     if (this->x == vec.x && this->y == vec.y && this->z == vec.z)
     {
@@ -55,25 +62,25 @@ bool operator!= (const Vector& vec)
     return false;
  }  
 
- Vector operator/ (const double& k)
+ Vector_T operator/ (const T& k)
  {
- 	Vector v1(0.0,0.0,0.0);
+ 	Vector_T v1(0.0,0.0,0.0);
     v1.x = this->x/k;
     v1.y = this->y/k;
     v1.z = this->z/k;
     return v1;
  }        
 
- Vector operator* (const double& k)
+ Vector_T operator* (const T& k)
  {
- 	Vector v1(0.0,0.0,0.0);
+ 	Vector_T v1(0.0,0.0,0.0);
     v1.x = this->x * k;
     v1.y = this->y * k;
     v1.z = this->z * k;
     return v1;
  }         
 
- Vector& operator *= (const double& k)
+ Vector_T& operator *= (const T& k)
  {
     this->x *= k;
     this->y *= k;
@@ -89,7 +96,7 @@ bool operator!= (const Vector& vec)
  //            k * vec1.z);
  // }
 
- Vector& operator /= (const double& k)
+ Vector_T& operator /= (const T& k)
  {
     this->x /= k;
     this->y /= k;
@@ -97,7 +104,7 @@ bool operator!= (const Vector& vec)
     return *this;
  }
 
- Vector& operator += (const Vector& vec)
+ Vector_T& operator += (const Vector_T& vec)
  {
     this->x += vec.x;
     this->y += vec.y;
@@ -105,7 +112,7 @@ bool operator!= (const Vector& vec)
     return *this;
  }
 
- Vector& operator -= (const Vector& vec)
+ Vector_T& operator -= (const Vector_T& vec)
  {
     this->x -= vec.x;
     this->y -= vec.y;
@@ -113,34 +120,34 @@ bool operator!= (const Vector& vec)
     return *this;
  }
 
- double DotProduct (const Vector& vec1, const Vector& vec2) 
+ T DotProduct (const Vector_T& vec1, const Vector_T& vec2) 
  {
     return (vec1.x * vec2.x) + (vec1.y * vec2.y) + (vec1.z * vec2.z);
  }
 
- Vector CrossProduct (const Vector& vec1, const Vector& vec2)
+ Vector_T CrossProduct (const Vector_T& vec1, const Vector_T& vec2)
  {
-    return Vector(
+    return Vector_T(
             (vec1.y * vec2.z) - (vec1.z * vec2.y), 
             (vec1.z * vec2.x) - (vec1.x * vec2.z), 
             (vec1.x * vec2.y) - (vec1.y * vec2.x)
             );
  }
 
-const double mag_square()
+const T mag_square()
  {
     return ((x*x) + (y*y) + (z*z));
  }
 
-const double mag()
+const T mag()
 {
     return sqrt(mag_square());
 }
 
-const Vector unit_vector()
+const Vector_T unit_vector()
 {
-    const double m = mag();
-    return Vector(x/m, y/m, z/m);
+    const T m = mag();
+    return Vector_T(x/m, y/m, z/m);
 }
 
 void display_vector() 
@@ -150,6 +157,8 @@ void display_vector()
 
 };
 
+typedef Vector_T<Real> Vector;
+
 /* Ray struct */
 struct Ray
 {
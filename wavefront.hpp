@@ -0,0 +1,179 @@
+#ifndef _wavefront_h
+#define _wavefront_h
+
+#include "vector.hpp"
+#include "aabb.hpp"
+#include "aligned_allocator.hpp"
+#include "bvh.hpp"
+#include "primitive_soa.hpp"
+#include "primitive_set.hpp"
+#include "ray_packet.hpp"
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+/* Rays waiting for one stage of the wavefront renderer, one array per field
+   so a stage streams through only the fields it reads. Every ray carries the
+   index of the path it belongs to. After queue_closest, t_max, prim and part
+   hold each ray's hit (prim -1 for a miss); after queue_occluded, blocked says
+   which rays were stopped. */
+struct Ray_Queue
+{
+	Aligned_Vector<double>::type ox, oy, oz;
+	Aligned_Vector<double>::type dx, dy, dz;
+	Aligned_Vector<double>::type t_max;
+	std::vector<int> skip_id;
+	std::vector<int> path;
+	std::vector<int> prim;
+	std::vector<uint32_t> part;
+	std::vector<char> blocked;
+
+	size_t size() const { return path.size(); }
+
+	/* Keeps the storage for the next batch */
+	void clear()
+	{
+		ox.clear(); oy.clear(); oz.clear();
+		dx.clear(); dy.clear(); dz.clear();
+		t_max.clear();
+		skip_id.clear();
+		path.clear();
+		prim.clear();
+		part.clear();
+		blocked.clear();
+	}
+
+	void push(int path_index, const Vector& origin, const Vector& dir, double t, int skip)
+	{
+		ox.push_back(origin.x); oy.push_back(origin.y); oz.push_back(origin.z);
+		dx.push_back(dir.x); dy.push_back(dir.y); dz.push_back(dir.z);
+		t_max.push_back(t);
+		skip_id.push_back(skip);
+		path.push_back(path_index);
+		prim.push_back(-1);
+		part.push_back(0);
+		blocked.push_back(0);
+	}
+
+	Vector_T<double> origin(size_t i) const { return Vector_T<double>(ox[i], oy[i], oz[i]); }
+	Vector_T<double> direction(size_t i) const { return Vector_T<double>(dx[i], dy[i], dz[i]); }
+
+	/* Ray i of other appended to this queue */
+	void push_from(const Ray_Queue& other, size_t i)
+	{
+		ox.push_back(other.ox[i]); oy.push_back(other.oy[i]); oz.push_back(other.oz[i]);
+		dx.push_back(other.dx[i]); dy.push_back(other.dy[i]); dz.push_back(other.dz[i]);
+		t_max.push_back(other.t_max[i]);
+		skip_id.push_back(other.skip_id[i]);
+		path.push_back(other.path[i]);
+		prim.push_back(other.prim[i]);
+		part.push_back(other.part[i]);
+		blocked.push_back(other.blocked[i]);
+	}
+
+	/* count rays from begin into a packet */
+	void load(size_t begin, int count, Ray_Packet& packet) const
+	{
+		packet.reset(count);
+		for(int i=0;i<count;i++) {
+			packet.set_ray(i, origin(begin + i), direction(begin + i), t_max[begin + i], skip_id[begin + i]);
+		}
+	}
+};
+
+/* Spreads the low 9 bits of v out to every third bit */
+static inline uint32_t morton_spread_9(uint32_t v)
+{
+	v &= 0x1ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+/* Sort key of a ray: the octant of its direction in the top bits, then the
+   Morton code of its origin on a 512^3 grid over bounds. Rays with equal
+   high bits leave the same cell the same way, so they enter the same BVH
+   nodes in the same order. */
+static inline uint32_t ray_sort_key(const Ray_Queue& queue, size_t i, const AABB& bounds, const Vector_T<double>& scale)
+{
+	const uint32_t octant = (queue.dx[i] < 0.0) << 2 | (queue.dy[i] < 0.0) << 1 | (queue.dz[i] < 0.0);
+	const double o[3] = { queue.ox[i], queue.oy[i], queue.oz[i] };
+	const double lo[3] = { bounds.min_pt.x, bounds.min_pt.y, bounds.min_pt.z };
+	const double s[3] = { scale.x, scale.y, scale.z };
+	uint32_t cell[3];
+	for(int axis=0;axis<3;axis++) {
+		const double c = (o[axis] - lo[axis]) * s[axis];
+		cell[axis] = (c <= 0.0) ? 0 : (c >= 511.0) ? 511 : (uint32_t)c;
+	}
+	return octant << 27 | morton_spread_9(cell[0]) << 2 | morton_spread_9(cell[1]) << 1 | morton_spread_9(cell[2]);
+}
+
+/* Reorders queue by ray_sort_key, so that the packets the stages cut it into
+   hold rays going the same way from nearby origins. Reflections of
+   neighbouring pixels scatter in every direction; sorted, a packet shares
+   more of its traversal and each BVH node it loads serves more rays. Queues
+   of half a packet or less are left alone. keys and sorted are scratch
+   space kept by the caller. */
+static void sort_queue(Ray_Queue& queue, const AABB& bounds, std::vector<uint64_t>& keys, Ray_Queue& sorted)
+{
+	if(queue.size() <= PACKET_MAX_RAYS/2) {
+		return;
+	}
+
+	const Vector_T<double> extent(bounds.max_pt.x - bounds.min_pt.x, bounds.max_pt.y - bounds.min_pt.y, bounds.max_pt.z - bounds.min_pt.z);
+	const Vector_T<double> scale(extent.x > 0.0 ? 512.0/extent.x : 0.0, extent.y > 0.0 ? 512.0/extent.y : 0.0, extent.z > 0.0 ? 512.0/extent.z : 0.0);
+
+	keys.resize(queue.size());
+	for(size_t i=0;i<queue.size();i++) {
+		keys[i] = (uint64_t)ray_sort_key(queue, i, bounds, scale) << 32 | i;
+	}
+	std::sort(keys.begin(), keys.end());
+
+	sorted.clear();
+	for(size_t i=0;i<keys.size();i++) {
+		sorted.push_from(queue, (uint32_t)keys[i]);
+	}
+	std::swap(queue, sorted);
+}
+
+/* Extend stage: closest hit of every ray in the queue, PACKET_MAX_RAYS
+   consecutive rays at a time through the packet traversal, so queues that
+   keep neighbouring rays together share most of their BVH nodes */
+static void queue_closest(const BVH& bvh, const Primitive_SoA& prims, Scene_Primitive_Set& objects, Ray_Queue& queue)
+{
+	Ray_Packet packet;
+
+	for(size_t begin=0;begin<queue.size();begin+=PACKET_MAX_RAYS) {
+		const int count = (int)min<size_t>(PACKET_MAX_RAYS, queue.size() - begin);
+		queue.load(begin, count, packet);
+		trace_packet_closest(bvh, prims, objects, packet);
+
+		for(int i=0;i<count;i++) {
+			queue.t_max[begin + i] = packet.t_max[i];
+			queue.prim[begin + i] = packet.prim[i];
+			queue.part[begin + i] = packet.part[i];
+		}
+	}
+}
+
+/* Shadow stage: any hit closer than t_max, other than the ray's skip_id */
+static void queue_occluded(const BVH& bvh, const Primitive_SoA& prims, Scene_Primitive_Set& objects, Ray_Queue& queue)
+{
+	Ray_Packet packet;
+
+	for(size_t begin=0;begin<queue.size();begin+=PACKET_MAX_RAYS) {
+		const int count = (int)min<size_t>(PACKET_MAX_RAYS, queue.size() - begin);
+		queue.load(begin, count, packet);
+		trace_packet_occluded(bvh, prims, objects, packet);
+
+		for(int i=0;i<count;i++) {
+			queue.blocked[begin + i] = (packet.active[i] == 0);
+		}
+	}
+}
+
+#endif